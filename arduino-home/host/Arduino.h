@@ -0,0 +1,252 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+/**
+  Host (Linux) stand-in for the Arduino core.
+  Provides just enough of the AVR Arduino API for the libraries and sketches in 'arduino-home' to compile and
+  run off-target. Time is virtual: 'delay()' advances the clock instantly and every clock read costs a few
+  simulated microseconds, so busy-wait loops still terminate. See 'hal.cpp' for the simulation driver.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+
+typedef uint8_t         byte;
+typedef bool            boolean;
+
+
+#define HIGH            0x1
+#define LOW             0x0
+
+#define INPUT           0x0
+#define OUTPUT          0x1
+#define INPUT_PULLUP    0x2
+
+#define CHANGE          1
+#define FALLING         2
+#define RISING          3
+
+#define DEC             10
+#define HEX             16
+#define OCT             8
+#define BIN             2
+
+#define F_CPU           16000000ul
+
+#define NUM_DIGITAL_PINS    70
+#define NUM_ANALOG_INPUTS   16
+
+#define A0              54
+#define A1              55
+#define A2              56
+#define A3              57
+#define A4              58
+#define A5              59
+#define A6              60
+#define A7              61
+
+#ifndef min
+#define min(a,b)        ((a)<(b)?(a):(b))
+#endif
+#ifndef max
+#define max(a,b)        ((a)>(b)?(a):(b))
+#endif
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+#define _BV(bit)        (1 << (bit))
+
+// binary constants used by the sketches (Arduino 'binary.h' defines all of them)
+#define B00011000       24
+#define B01100001       97
+
+
+// AVR registers that the sketches touch directly (plain memory on the host)
+extern volatile uint8_t     ADCSRA;
+extern volatile uint8_t     ADCSRB;
+extern volatile uint8_t     ADMUX;
+extern volatile uint16_t    ADC;
+extern volatile uint8_t     MCUCR;
+extern volatile uint8_t     MCUSR;
+extern volatile uint8_t     WDTCSR;
+
+#define BODSE           5
+#define BODS            6
+#define WDIE            6
+#define WDE             3
+#define WDCE            4
+#define WDP3            5
+#define WDP2            2
+#define WDP1            1
+#define WDP0            0
+
+#define ADEN            7
+#define ADSC            6
+#define ADATE           5
+#define ADIF            4
+#define ADIE            3
+#define REFS0           6
+#define MUX5            3
+
+
+// interrupt vectors are plain functions on the host
+#define ISR(vector)     extern "C" void vector()
+
+
+// time
+unsigned long   millis();
+unsigned long   micros();
+void            delay(unsigned long _uMs);
+void            delayMicroseconds(unsigned int _uUs);
+
+// pins
+void            pinMode(uint8_t _uPin, uint8_t _uMode);
+void            digitalWrite(uint8_t _uPin, uint8_t _uValue);
+int             digitalRead(uint8_t _uPin);
+int             analogRead(uint8_t _uPin);
+
+// interrupts
+void            interrupts();
+void            noInterrupts();
+void            attachInterrupt(uint8_t _uInterruptNo, void (*_fpIsr)(), int _iMode);
+void            detachInterrupt(uint8_t _uInterruptNo);
+
+// random numbers (deterministic on the host: the same seed gives the same sequence in every run)
+void            randomSeed(unsigned long _uSeed);
+long            random(long _iMax);
+long            random(long _iMin, long _iMax);
+
+// avr-libc extras
+char           *itoa(int _iValue, char *_pszBuf, int _iBase);
+char           *utoa(unsigned int _uValue, char *_pszBuf, int _iBase);
+char           *ltoa(long _iValue, char *_pszBuf, int _iBase);
+
+
+
+/// Arduino 'Print' base class (number formatting matches the AVR core)
+class Print
+{
+ public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t _uByte) = 0;
+    virtual size_t write(const uint8_t *_pBuf, size_t _uSize)
+    {
+        size_t n = 0;
+        while (_uSize--)
+        {
+            n += write(*_pBuf++);
+        }
+
+        return n;
+    }
+
+    size_t write(const char *_pszStr)
+    {
+        return (_pszStr != NULL) ? write((const uint8_t*)_pszStr, strlen(_pszStr)) : 0;
+    }
+
+    size_t write(const char *_pBuf, size_t _uSize)
+    {
+        return write((const uint8_t*)_pBuf, _uSize);
+    }
+
+    virtual int availableForWrite() {return 0;}
+    virtual void flush() {}
+
+    size_t print(const char *_pszStr)                   {return write(_pszStr);}
+    size_t print(char _ch)                              {return write((uint8_t)_ch);}
+    size_t print(unsigned char _u, int _iBase = DEC)    {return print((unsigned long)_u, _iBase);}
+    size_t print(int _i, int _iBase = DEC)              {return print((long)_i, _iBase);}
+    size_t print(unsigned int _u, int _iBase = DEC)     {return print((unsigned long)_u, _iBase);}
+    size_t print(long _i, int _iBase = DEC);
+    size_t print(unsigned long _u, int _iBase = DEC);
+    size_t print(double _f, int _iDigits = 2);
+
+    size_t println()                                    {return write("\r\n");}
+    template <typename T>
+    size_t println(T _value)                            {size_t n = print(_value); return n + println();}
+    template <typename T>
+    size_t println(T _value, int _iFormat)              {size_t n = print(_value, _iFormat); return n + println();}
+};
+
+
+/// Arduino 'Stream' base class
+class Stream : public Print
+{
+ public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+
+/**
+  In-memory serial port.
+  Bytes written by the sketch are collected for the host (and optionally echoed to a file); the host injects
+  received bytes with 'inject()'.
+*/
+class HardwareSerial : public Stream
+{
+ public:
+    explicit HardwareSerial(int _iPort);
+
+    void begin(unsigned long _uBaud);
+    void end() {}
+
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+
+    virtual size_t write(uint8_t _uByte);
+    virtual int availableForWrite() {return 63;}     ///< transmission is instant on the host, so the AVR tx buffer is always empty
+    using Print::write;
+    size_t write(unsigned long _u)  {return write((uint8_t)_u);}
+    size_t write(long _i)           {return write((uint8_t)_i);}
+    size_t write(unsigned int _u)   {return write((uint8_t)_u);}
+    size_t write(int _i)            {return write((uint8_t)_i);}
+
+    operator bool() const {return true;}
+
+    /// host side: queue bytes to be received by the sketch
+    void inject(const char *_pBuf, size_t _uSize);
+    void inject(const char *_pszStr) {inject(_pszStr, strlen(_pszStr));}
+
+    /// host side: echo all transmitted bytes to the given file (NULL disables echo)
+    void setEcho(FILE *_pFile) {m_pEcho = _pFile;}
+
+    int port() const {return m_iPort;}
+    unsigned long baud() const {return m_uBaud;}
+    unsigned long txCount() const {return m_uTxCount;}
+    unsigned long rxCount() const {return m_uRxCount;}
+
+ private:
+    static const size_t RX_SIZE = 4096;
+
+    int             m_iPort;
+    unsigned long   m_uBaud;
+    FILE           *m_pEcho;
+    char            m_rx[RX_SIZE];
+    size_t          m_uRxBegin;
+    size_t          m_uRxEnd;
+    unsigned long   m_uTxCount;
+    unsigned long   m_uRxCount;
+    char            m_pszTxLine[128];
+    size_t          m_uTxLineLen;
+};
+
+
+extern HardwareSerial   Serial;
+extern HardwareSerial   Serial1;
+extern HardwareSerial   Serial2;
+extern HardwareSerial   Serial3;
+
+
+
+#endif  // #ifndef HOST_ARDUINO_H
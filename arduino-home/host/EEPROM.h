@@ -0,0 +1,55 @@
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+#include <Arduino.h>
+
+
+/// host EEPROM (erased cells read 0xFF; the simulation driver can load/save the image from a file)
+class EEPROMClass
+{
+ public:
+    static const int SIZE = 4096;
+
+    EEPROMClass()
+        :m_uWriteCount(0)
+    {
+        memset(m_data, 0xFF, SIZE);
+    }
+
+    uint8_t read(int _iAddr) const
+    {
+        return ((_iAddr >= 0) && (_iAddr < SIZE)) ? m_data[_iAddr] : 0xFF;
+    }
+
+    void write(int _iAddr, uint8_t _uValue)
+    {
+        if ((_iAddr >= 0) && (_iAddr < SIZE))
+        {
+            m_data[_iAddr] = _uValue;
+            m_uWriteCount++;
+        }
+    }
+
+    void update(int _iAddr, uint8_t _uValue)
+    {
+        if (read(_iAddr) != _uValue)
+        {
+            write(_iAddr, _uValue);
+        }
+    }
+
+    int length() const {return SIZE;}
+
+    /// host side: raw image access and number of cell writes (for wear estimates)
+    uint8_t *data() {return m_data;}
+    unsigned long writeCount() const {return m_uWriteCount;}
+
+ private:
+    uint8_t         m_data[SIZE];
+    unsigned long   m_uWriteCount;
+};
+
+
+extern EEPROMClass EEPROM;
+
+
+#endif  // #ifndef HOST_EEPROM_H
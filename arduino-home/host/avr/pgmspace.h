@@ -0,0 +1,23 @@
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+#include <Arduino.h>
+#include <string.h>
+
+
+// program memory is ordinary memory on the host
+#define PROGMEM
+#define PSTR(s)                 (s)
+
+#define pgm_read_byte(addr)     (*(const uint8_t*)(addr))
+#define pgm_read_word(addr)     (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr)    (*(const uint32_t*)(addr))
+#define pgm_read_ptr(addr)      (*(void* const*)(addr))
+
+#define memcpy_P                memcpy
+#define strcmp_P                strcmp
+#define strncmp_P               strncmp
+#define strlen_P                strlen
+#define strcpy_P                strcpy
+
+
+#endif  // #ifndef HOST_AVR_PGMSPACE_H
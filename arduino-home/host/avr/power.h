@@ -0,0 +1,13 @@
+#ifndef HOST_AVR_POWER_H
+#define HOST_AVR_POWER_H
+#include <Arduino.h>
+
+
+// peripheral power reduction is a no-op on the host
+#define power_adc_disable()
+#define power_adc_enable()
+#define power_all_disable()
+#define power_all_enable()
+
+
+#endif  // #ifndef HOST_AVR_POWER_H
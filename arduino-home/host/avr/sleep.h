@@ -0,0 +1,22 @@
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+#include <Arduino.h>
+
+
+#define SLEEP_MODE_IDLE         0
+#define SLEEP_MODE_ADC          1
+#define SLEEP_MODE_PWR_DOWN     2
+#define SLEEP_MODE_PWR_SAVE     3
+#define SLEEP_MODE_STANDBY      6
+
+
+void set_sleep_mode(uint8_t _uMode);
+void sleep_enable();
+void sleep_disable();
+
+/// sleeps until the next interrupt (advances virtual time to the next scheduled event)
+void sleep_mode();
+void sleep_cpu();
+
+
+#endif  // #ifndef HOST_AVR_SLEEP_H
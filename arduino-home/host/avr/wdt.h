@@ -0,0 +1,11 @@
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+#include <Arduino.h>
+
+
+// the WDT interrupt is modelled from WDTCSR by the simulation driver; reset mode is not simulated
+#define wdt_reset()
+#define wdt_disable()       (WDTCSR = 0)
+
+
+#endif  // #ifndef HOST_AVR_WDT_H
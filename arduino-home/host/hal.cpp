@@ -0,0 +1,804 @@
+/**
+  Host simulation driver for the Arduino HAL shim.
+
+  Runs a sketch ('setup()' once, then 'loop()' forever) against a virtual clock until the requested simulated
+  time has passed. Time advances instantly on 'delay()' and sleep, and by a small fixed cost on every clock read
+  or ADC conversion. Stimulus comes from an optional scenario file:
+
+    # comment
+    <ms> pin <pin> <0|1>              drive a digital input (fires attached interrupts on matching edges)
+    <ms> adc <pin> <value>            set an analog input (0..1023), read by 'analogRead()' or by conversions
+                                      started with ADSC (ADC_vect runs on completion if ADIE is set)
+    <ms> rx <port> <text>             inject bytes into Serial<port> (escapes: \r \n \\ \xHH)
+    reply <port> <prefix> <text>      when Serial<port> transmits a line starting with <prefix>, inject <text>
+                                      (a prefix starting with \x7E matches a binary XBee API frame instead: each 0x7E
+                                      byte starts a new frame, which is answered as soon as it equals the prefix;
+                                      a prefix ending in '$' must equal all bytes sent since the last line end and is
+                                      answered without waiting for a line end, e.g. the XBee '+++' guard sequence;
+                                      a CTRL-Z byte starts a new line, so '\x1A' matches the end of a SMS PDU)
+
+  Usage: <sim> [-t seconds] [-s scenario] [-e eeprom.bin] [-q]
+*/
+
+#include <map>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "avr/sleep.h"
+
+
+
+// sketch entry points and the optional WDT and ADC vectors
+void setup();
+void loop();
+extern "C" void WDT_vect() __attribute__((weak));
+extern "C" void ADC_vect() __attribute__((weak));
+
+
+volatile uint8_t    ADCSRA = 0x87;
+volatile uint8_t    ADCSRB = 0;
+volatile uint8_t    ADMUX = 0;
+volatile uint16_t   ADC = 0;
+volatile uint8_t    MCUCR = 0;
+volatile uint8_t    MCUSR = 0;
+volatile uint8_t    WDTCSR = 0;
+
+HardwareSerial      Serial(0);
+HardwareSerial      Serial1(1);
+HardwareSerial      Serial2(2);
+HardwareSerial      Serial3(3);
+EEPROMClass         EEPROM;
+
+
+namespace
+{
+    const unsigned long long    CLOCK_READ_COST_US  = 4;        ///< simulated cost of a millis()/micros() call
+    const unsigned long long    PIN_IO_COST_US      = 4;        ///< simulated cost of digitalRead()/digitalWrite()
+    const unsigned long long    ADC_COST_US         = 112;      ///< simulated ADC conversion time
+    const unsigned long long    REPLY_DELAY_US      = 10000;    ///< delay before a scripted reply is received
+    const unsigned long long    TIMER0_TICK_US      = 1024;     ///< millis() timer interrupt period (wakes the MCU from idle sleep)
+    const int                   MAX_INTERRUPTS      = 6;
+
+
+    enum eEventType
+    {
+        EET_PIN = 0,
+        EET_ADC,
+        EET_RX
+    };
+
+    struct sEvent
+    {
+        eEventType      _eType;
+        int             _iTarget;       ///< pin or port number
+        int             _iValue;
+        std::string     _text;
+    };
+
+    struct sReply
+    {
+        int             _iPort;
+        std::string     _prefix;
+        std::string     _text;
+        bool            _bExact;        ///< prefix has to match the whole (unterminated) line
+    };
+
+
+    unsigned long long                      gMicros = 0;
+    unsigned long long                      gEndMicros = 60ull * 1000000ull;
+    unsigned long long                      gNextWdtMicros = 0;
+    unsigned long long                      gAdcDoneMicros = 0;                  ///< end of the running ADC conversion, 0 if idle
+    unsigned long long                      gSleepMicros = 0;
+    unsigned long                           gLoopCount = 0;
+    uint8_t                                 gSleepMode = SLEEP_MODE_IDLE;
+    bool                                    gInterruptsEnabled = true;
+    bool                                    gInIsr = false;
+    const char                             *gpszEepromFile = NULL;
+    clock_t                                 gWallStart = 0;
+
+    uint8_t                                 gPinMode[NUM_DIGITAL_PINS];
+    uint8_t                                 gPinLatch[NUM_DIGITAL_PINS];
+    int                                     gPinDrive[NUM_DIGITAL_PINS];         ///< external drive level, -1 if not driven
+    int                                     gAnalog[NUM_ANALOG_INPUTS];
+
+    void                                    (*gIsr[MAX_INTERRUPTS])() = {NULL};
+    int                                     gIsrMode[MAX_INTERRUPTS];
+    bool                                    gIsrPending[MAX_INTERRUPTS];
+    const uint8_t                           gIsrPin[MAX_INTERRUPTS] = {2, 3, 21, 20, 19, 18};   ///< Mega mapping (0 and 1 match the Fio)
+
+    std::multimap<unsigned long long, sEvent>   gEvents;
+    std::vector<sReply>                         gReplies;
+    HardwareSerial                             *gPorts[4] = {&Serial, &Serial1, &Serial2, &Serial3};
+
+
+    /// effective pin level as seen by digitalRead()
+    int pinLevel(int _iPin)
+    {
+        if (gPinDrive[_iPin] >= 0) return gPinDrive[_iPin];
+        if (gPinMode[_iPin] == OUTPUT) return gPinLatch[_iPin];
+        return (gPinMode[_iPin] == INPUT_PULLUP) ? HIGH : LOW;
+    }
+
+    void runIsr(int _iNo)
+    {
+        gIsrPending[_iNo] = false;
+        gInIsr = true;
+        gIsr[_iNo]();
+        gInIsr = false;
+    }
+
+    void runPendingIsrs()
+    {
+        for (int i = 0; i < MAX_INTERRUPTS; i++)
+        {
+            if ( (gIsrPending[i] == true) && (gIsr[i] != NULL) )
+            {
+                runIsr(i);
+            }
+        }
+    }
+
+    /// change the external drive of a pin and raise the attached interrupt on a matching edge
+    void drivePin(int _iPin, int _iLevel)
+    {
+        int iOld = pinLevel(_iPin);
+        gPinDrive[_iPin] = _iLevel;
+        int iNew = pinLevel(_iPin);
+
+        for (int i = 0; i < MAX_INTERRUPTS; i++)
+        {
+            if ( (gIsr[i] != NULL) && (gIsrPin[i] == _iPin) && (iOld != iNew) )
+            {
+                if ( (gIsrMode[i] == CHANGE) ||
+                     ((gIsrMode[i] == RISING) && (iNew == HIGH)) ||
+                     ((gIsrMode[i] == FALLING) && (iNew == LOW)) )
+                {
+                    gIsrPending[i] = true;
+                }
+            }
+        }
+    }
+
+    /// WDT interrupt period from the WDTCSR prescaler bits (16ms .. 8s)
+    unsigned long long wdtPeriod()
+    {
+        int iPrescale = (WDTCSR & 0x07) | ((WDTCSR & _BV(WDP3)) ? 0x08 : 0x00);
+        return 16000ull << min(iPrescale, 9);
+    }
+
+    bool wdtEnabled()
+    {
+        return (WDTCSR & _BV(WDIE)) && (WDT_vect != NULL);
+    }
+
+    std::string unescape(const std::string &_text)
+    {
+        std::string out;
+        for (size_t i = 0; i < _text.size(); i++)
+        {
+            if ( (_text[i] == '\\') && (i + 1 < _text.size()) )
+            {
+                char ch = _text[++i];
+                if (ch == 'r') out += '\r';
+                else if (ch == 'n') out += '\n';
+                else if ( (ch == 'x') && (i + 2 < _text.size()) )
+                {
+                    out += (char)strtol(_text.substr(i + 1, 2).c_str(), NULL, 16);
+                    i += 2;
+                }
+                else out += ch;
+            }
+            else
+            {
+                out += _text[i];
+            }
+        }
+
+        return out;
+    }
+
+    /// runs the ADC: a conversion started with ADSC completes ADC_COST_US later (restarts if ADATE is set), and
+    /// the ADC interrupt runs once the flag is set and ADIE and interrupts are enabled
+    void updateAdc()
+    {
+        if ((ADCSRA & _BV(ADEN)) == 0)
+        {
+            ADCSRA &= ~_BV(ADSC);
+            gAdcDoneMicros = 0;
+            return;
+        }
+
+        if ( (gAdcDoneMicros > 0) && (gMicros >= gAdcDoneMicros) )
+        {
+            int iChannel = (ADMUX & 0x07) | ((ADCSRB & _BV(MUX5)) ? 0x08 : 0x00);
+            ADC = (uint16_t)gAnalog[iChannel];
+            gAdcDoneMicros = 0;
+            ADCSRA = (ADCSRA & ~_BV(ADSC)) | _BV(ADIF);
+            if ((ADCSRA & _BV(ADATE)) != 0)
+            {
+                ADCSRA |= _BV(ADSC);
+            }
+        }
+
+        if ( ((ADCSRA & _BV(ADIF)) != 0) && ((ADCSRA & _BV(ADIE)) != 0) && (ADC_vect != NULL) &&
+             (gInterruptsEnabled == true) && (gInIsr == false) )
+        {
+            ADCSRA &= ~_BV(ADIF);
+            gInIsr = true;
+            ADC_vect();
+            gInIsr = false;
+        }
+
+        if ( ((ADCSRA & _BV(ADSC)) != 0) && (gAdcDoneMicros == 0) )
+        {
+            gAdcDoneMicros = gMicros + ADC_COST_US;
+        }
+    }
+
+    void finish();
+
+    /// advance virtual time, delivering due scenario events and timer interrupts
+    void advance(unsigned long long _uUs)
+    {
+        gMicros += _uUs;
+
+        while ( (gEvents.empty() == false) &&
+                (gEvents.begin()->first <= gMicros) )
+        {
+            sEvent evt = gEvents.begin()->second;
+            gEvents.erase(gEvents.begin());
+
+            if (evt._eType == EET_PIN) drivePin(evt._iTarget, evt._iValue);
+            else if (evt._eType == EET_ADC) gAnalog[evt._iTarget] = evt._iValue;
+            else gPorts[evt._iTarget]->inject(evt._text.data(), evt._text.size());
+        }
+
+        if (wdtEnabled() == true)
+        {
+            if (gNextWdtMicros == 0)
+            {
+                gNextWdtMicros = gMicros + wdtPeriod();
+            }
+            else if (gMicros >= gNextWdtMicros)
+            {
+                gNextWdtMicros += wdtPeriod();
+                if ( (gInterruptsEnabled == true) && (gInIsr == false) )
+                {
+                    gInIsr = true;
+                    WDT_vect();
+                    gInIsr = false;
+                }
+            }
+        }
+        else
+        {
+            gNextWdtMicros = 0;
+        }
+
+        updateAdc();
+
+        if ( (gInterruptsEnabled == true) && (gInIsr == false) )
+        {
+            runPendingIsrs();
+        }
+
+        if (gMicros >= gEndMicros)
+        {
+            finish();
+        }
+    }
+
+    void loadScenario(const char *_pszFile)
+    {
+        FILE *pFile = fopen(_pszFile, "r");
+        if (pFile == NULL)
+        {
+            fprintf(stderr, "sim: cannot open scenario '%s'\n", _pszFile);
+            exit(1);
+        }
+
+        char line[512];
+        while (fgets(line, sizeof(line), pFile) != NULL)
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            if ( (line[0] == '#') || (line[0] == '\0') )
+            {
+                continue;
+            }
+
+            char cmd[16] = {0};
+            char arg[128] = {0};
+            int iTarget = 0, iOffset = 0;
+            unsigned long uMs = 0;
+
+            if (sscanf(line, "reply %d %127s %n", &iTarget, arg, &iOffset) == 2)
+            {
+                sReply reply = {iTarget, unescape(arg), unescape(line + iOffset), false};
+                if ( (reply._prefix.size() > 1) && (reply._prefix[reply._prefix.size() - 1] == '$') )
+                {
+                    reply._prefix.erase(reply._prefix.size() - 1);
+                    reply._bExact = true;
+                }
+
+                gReplies.push_back(reply);
+            }
+            else if (sscanf(line, "%lu %15s %d %n", &uMs, cmd, &iTarget, &iOffset) == 3)
+            {
+                sEvent evt;
+                evt._iTarget = iTarget;
+                evt._iValue = atoi(line + iOffset);
+
+                if (strcmp(cmd, "pin") == 0) evt._eType = EET_PIN;
+                else if (strcmp(cmd, "adc") == 0) evt._eType = EET_ADC;
+                else if (strcmp(cmd, "rx") == 0) evt._eType = EET_RX;
+                else
+                {
+                    fprintf(stderr, "sim: bad scenario line '%s'\n", line);
+                    continue;
+                }
+
+                if (evt._eType == EET_ADC) evt._iTarget = (iTarget >= A0) ? iTarget - A0 : iTarget;
+                if (evt._eType == EET_RX) evt._text = unescape(line + iOffset);
+                gEvents.insert(std::make_pair(uMs * 1000ull, evt));
+            }
+            else
+            {
+                fprintf(stderr, "sim: bad scenario line '%s'\n", line);
+            }
+        }
+
+        fclose(pFile);
+    }
+
+    void finish()
+    {
+        double fWall = (double)(clock() - gWallStart) / CLOCKS_PER_SEC;
+        double fSim = (double)gMicros / 1e6;
+
+        fflush(stdout);
+        fprintf(stderr, "\nsim: %.1fs simulated in %.3fs (x%.0f), %lu loops, %.1fs asleep\n",
+                fSim, fWall, (fWall > 0.0) ? fSim / fWall : 0.0, gLoopCount, (double)gSleepMicros / 1e6);
+
+        for (int i = 0; i < 4; i++)
+        {
+            if (gPorts[i]->txCount() + gPorts[i]->rxCount() > 0)
+            {
+                fprintf(stderr, "sim: Serial%d %lu bytes tx, %lu bytes rx\n", i, gPorts[i]->txCount(), gPorts[i]->rxCount());
+            }
+        }
+
+        fprintf(stderr, "sim: %lu EEPROM writes\n", EEPROM.writeCount());
+
+        if (gpszEepromFile != NULL)
+        {
+            FILE *pFile = fopen(gpszEepromFile, "wb");
+            if (pFile != NULL)
+            {
+                fwrite(EEPROM.data(), 1, EEPROM.length(), pFile);
+                fclose(pFile);
+            }
+        }
+
+        exit(0);
+    }
+}
+
+
+
+unsigned long millis()
+{
+    advance(CLOCK_READ_COST_US);
+    return (unsigned long)(gMicros / 1000ull);
+}
+
+unsigned long micros()
+{
+    advance(CLOCK_READ_COST_US);
+    return (unsigned long)gMicros;
+}
+
+void delay(unsigned long _uMs)
+{
+    // step in 1ms increments so that interrupts and scenario events are delivered in order
+    for (unsigned long i = 0; i < _uMs; i++)
+    {
+        advance(1000);
+    }
+}
+
+void delayMicroseconds(unsigned int _uUs)
+{
+    advance(_uUs);
+}
+
+void pinMode(uint8_t _uPin, uint8_t _uMode)
+{
+    if (_uPin < NUM_DIGITAL_PINS)
+    {
+        gPinMode[_uPin] = _uMode;
+    }
+}
+
+void digitalWrite(uint8_t _uPin, uint8_t _uValue)
+{
+    advance(PIN_IO_COST_US);
+    if (_uPin < NUM_DIGITAL_PINS)
+    {
+        gPinLatch[_uPin] = _uValue ? HIGH : LOW;
+    }
+}
+
+int digitalRead(uint8_t _uPin)
+{
+    advance(PIN_IO_COST_US);
+    return (_uPin < NUM_DIGITAL_PINS) ? pinLevel(_uPin) : LOW;
+}
+
+int analogRead(uint8_t _uPin)
+{
+    advance(ADC_COST_US);
+    if (_uPin >= A0) _uPin -= A0;
+    return (_uPin < NUM_ANALOG_INPUTS) ? gAnalog[_uPin] : 0;
+}
+
+void interrupts()
+{
+    gInterruptsEnabled = true;
+    if (gInIsr == false)
+    {
+        runPendingIsrs();
+    }
+}
+
+void noInterrupts()
+{
+    gInterruptsEnabled = false;
+}
+
+void attachInterrupt(uint8_t _uInterruptNo, void (*_fpIsr)(), int _iMode)
+{
+    if (_uInterruptNo < MAX_INTERRUPTS)
+    {
+        gIsr[_uInterruptNo] = _fpIsr;
+        gIsrMode[_uInterruptNo] = _iMode;
+        gIsrPending[_uInterruptNo] = false;
+    }
+}
+
+void detachInterrupt(uint8_t _uInterruptNo)
+{
+    if (_uInterruptNo < MAX_INTERRUPTS)
+    {
+        gIsr[_uInterruptNo] = NULL;
+    }
+}
+
+
+void set_sleep_mode(uint8_t _uMode)
+{
+    gSleepMode = _uMode;
+}
+
+void sleep_enable() {}
+void sleep_disable() {}
+
+void sleep_cpu()
+{
+    sleep_mode();
+}
+
+void sleep_mode()
+{
+    // ADC noise reduction mode starts a conversion
+    if ( (gSleepMode == SLEEP_MODE_ADC) && ((ADCSRA & _BV(ADEN)) != 0) )
+    {
+        ADCSRA |= _BV(ADSC);
+        updateAdc();
+    }
+
+    // wake on the next scenario event, WDT or ADC interrupt or the end of the simulation (or the next timer tick
+    // when idle)
+    unsigned long long uWake = gEndMicros;
+    if (gSleepMode == SLEEP_MODE_IDLE) uWake = min(uWake, (gMicros / TIMER0_TICK_US + 1) * TIMER0_TICK_US);
+    if (gEvents.empty() == false) uWake = min(uWake, gEvents.begin()->first);
+    if ( (wdtEnabled() == true) && (gNextWdtMicros > 0) ) uWake = min(uWake, gNextWdtMicros);
+    if ( (gAdcDoneMicros > 0) && ((ADCSRA & _BV(ADIE)) != 0) ) uWake = min(uWake, gAdcDoneMicros);
+
+    if (uWake > gMicros)
+    {
+        gSleepMicros += uWake - gMicros;
+        advance(uWake - gMicros);
+    }
+    else
+    {
+        advance(CLOCK_READ_COST_US);
+    }
+}
+
+
+static char *formatNumber(unsigned long _uValue, bool _bNegative, char *_pszBuf, int _iBase)
+{
+    if ( (_iBase < 2) || (_iBase > 36) )
+    {
+        _iBase = 10;
+    }
+
+    char tmp[8 * sizeof(unsigned long) + 1];
+    int n = 0;
+    do
+    {
+        int d = (int)(_uValue % _iBase);
+        tmp[n++] = (char)(d < 10 ? '0' + d : 'a' + d - 10);
+        _uValue /= _iBase;
+    } while (_uValue > 0);
+
+    char *p = _pszBuf;
+    if (_bNegative == true) *p++ = '-';
+    while (n > 0) *p++ = tmp[--n];
+    *p = '\0';
+
+    return _pszBuf;
+}
+
+// same generator as avr-libc 'random()' (Park-Miller minimal standard)
+static long gRandomState = 1;
+
+void randomSeed(unsigned long _uSeed)
+{
+    if (_uSeed != 0)
+    {
+        gRandomState = (long)(_uSeed % 0x7FFFFFFFul);
+    }
+}
+
+static long nextRandom()
+{
+    long x = (gRandomState == 0) ? 123459876 : gRandomState;
+    long hi = x / 127773;
+    long lo = x % 127773;
+    x = 16807 * lo - 2836 * hi;
+    if (x < 0)
+    {
+        x += 0x7FFFFFFF;
+    }
+
+    gRandomState = x;
+    return x;
+}
+
+long random(long _iMax)
+{
+    return (_iMax == 0) ? 0 : nextRandom() % _iMax;
+}
+
+long random(long _iMin, long _iMax)
+{
+    return (_iMin >= _iMax) ? _iMin : random(_iMax - _iMin) + _iMin;
+}
+
+
+char *itoa(int _iValue, char *_pszBuf, int _iBase)
+{
+    // like avr-libc, only base 10 values are signed
+    if (_iBase == 10) return formatNumber(_iValue < 0 ? -(long)_iValue : _iValue, _iValue < 0, _pszBuf, _iBase);
+    return formatNumber((unsigned int)_iValue, false, _pszBuf, _iBase);
+}
+
+char *utoa(unsigned int _uValue, char *_pszBuf, int _iBase)
+{
+    return formatNumber(_uValue, false, _pszBuf, _iBase);
+}
+
+char *ltoa(long _iValue, char *_pszBuf, int _iBase)
+{
+    if (_iBase == 10) return formatNumber(_iValue < 0 ? -(unsigned long)_iValue : _iValue, _iValue < 0, _pszBuf, _iBase);
+    return formatNumber((unsigned long)_iValue, false, _pszBuf, _iBase);
+}
+
+
+size_t Print::print(long _iValue, int _iBase)
+{
+    char buf[8 * sizeof(long) + 2];
+    return write(ltoa(_iValue, buf, _iBase));
+}
+
+size_t Print::print(unsigned long _uValue, int _iBase)
+{
+    char buf[8 * sizeof(long) + 1];
+    return write(formatNumber(_uValue, false, buf, _iBase));
+}
+
+size_t Print::print(double _fValue, int _iDigits)
+{
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%.*f", _iDigits, _fValue);
+    return write(buf);
+}
+
+
+HardwareSerial::HardwareSerial(int _iPort)
+    :m_iPort(_iPort),
+     m_uBaud(0),
+     m_pEcho(NULL),
+     m_uRxBegin(0),
+     m_uRxEnd(0),
+     m_uTxCount(0),
+     m_uRxCount(0),
+     m_uTxLineLen(0)
+{
+}
+
+void HardwareSerial::begin(unsigned long _uBaud)
+{
+    m_uBaud = _uBaud;
+}
+
+int HardwareSerial::available()
+{
+    return (int)(m_uRxEnd - m_uRxBegin);
+}
+
+int HardwareSerial::read()
+{
+    if (m_uRxBegin == m_uRxEnd)
+    {
+        return -1;
+    }
+
+    m_uRxCount++;
+    return (unsigned char)m_rx[m_uRxBegin++ % RX_SIZE];
+}
+
+int HardwareSerial::peek()
+{
+    return (m_uRxBegin == m_uRxEnd) ? -1 : (unsigned char)m_rx[m_uRxBegin % RX_SIZE];
+}
+
+size_t HardwareSerial::write(uint8_t _uByte)
+{
+    m_uTxCount++;
+    if (m_pEcho != NULL)
+    {
+        fputc(_uByte, m_pEcho);
+    }
+
+    // collect binary API frames and answer them once they match a scripted reply
+    if ( (_uByte == 0x7E) ||
+         ( (m_uTxLineLen > 0) && (m_pszTxLine[0] == 0x7E) ) )
+    {
+        if ( (_uByte == 0x7E) || (m_uTxLineLen + 1 >= sizeof(m_pszTxLine)) )
+        {
+            m_uTxLineLen = 0;
+        }
+
+        m_pszTxLine[m_uTxLineLen++] = (char)_uByte;
+        for (size_t i = 0; i < gReplies.size(); i++)
+        {
+            const sReply &reply = gReplies[i];
+            if ( (reply._iPort == m_iPort) &&
+                 (reply._prefix.size() == m_uTxLineLen) &&
+                 (memcmp(m_pszTxLine, reply._prefix.data(), m_uTxLineLen) == 0) )
+            {
+                sEvent evt = {EET_RX, m_iPort, 0, reply._text};
+                gEvents.insert(std::make_pair(gMicros + REPLY_DELAY_US, evt));
+                break;
+            }
+        }
+    }
+
+    // collect tx lines and answer them with the first matching scripted reply (a CTRL-Z, which ends a SMS body
+    // written without a line end, starts a new line)
+    else if ( (_uByte == '\r') || (_uByte == '\n') || (_uByte == 0x1A) || (m_uTxLineLen + 1 >= sizeof(m_pszTxLine)) )
+    {
+        m_pszTxLine[m_uTxLineLen] = '\0';
+        for (size_t i = 0; (m_uTxLineLen > 0) && (i < gReplies.size()); i++)
+        {
+            const sReply &reply = gReplies[i];
+            if ( (reply._iPort == m_iPort) &&
+                 (reply._bExact == false) &&
+                 (strncmp(m_pszTxLine, reply._prefix.c_str(), reply._prefix.size()) == 0) )
+            {
+                sEvent evt = {EET_RX, m_iPort, 0, reply._text};
+                gEvents.insert(std::make_pair(gMicros + REPLY_DELAY_US, evt));
+                break;
+            }
+        }
+
+        m_uTxLineLen = 0;
+        if (_uByte == 0x1A)
+        {
+            m_pszTxLine[m_uTxLineLen++] = (char)_uByte;
+        }
+    }
+    else
+    {
+        m_pszTxLine[m_uTxLineLen++] = (char)_uByte;
+        for (size_t i = 0; i < gReplies.size(); i++)
+        {
+            const sReply &reply = gReplies[i];
+            if ( (reply._iPort == m_iPort) &&
+                 (reply._bExact == true) &&
+                 (reply._prefix.size() == m_uTxLineLen) &&
+                 (memcmp(m_pszTxLine, reply._prefix.data(), m_uTxLineLen) == 0) )
+            {
+                sEvent evt = {EET_RX, m_iPort, 0, reply._text};
+                gEvents.insert(std::make_pair(gMicros + REPLY_DELAY_US, evt));
+                m_uTxLineLen = 0;
+                break;
+            }
+        }
+    }
+
+    return 1;
+}
+
+void HardwareSerial::inject(const char *_pBuf, size_t _uSize)
+{
+    for (size_t i = 0; (i < _uSize) && (m_uRxEnd - m_uRxBegin < RX_SIZE); i++)
+    {
+        m_rx[m_uRxEnd++ % RX_SIZE] = _pBuf[i];
+    }
+}
+
+
+
+int main(int argc, char **argv)
+{
+    const char *pszScenario = NULL;
+    bool bQuiet = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ( (strcmp(argv[i], "-t") == 0) && (i + 1 < argc) ) gEndMicros = (unsigned long long)(atof(argv[++i]) * 1e6);
+        else if ( (strcmp(argv[i], "-s") == 0) && (i + 1 < argc) ) pszScenario = argv[++i];
+        else if ( (strcmp(argv[i], "-e") == 0) && (i + 1 < argc) ) gpszEepromFile = argv[++i];
+        else if (strcmp(argv[i], "-q") == 0) bQuiet = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-t seconds] [-s scenario] [-e eeprom.bin] [-q]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < NUM_DIGITAL_PINS; i++)
+    {
+        gPinMode[i] = INPUT;
+        gPinLatch[i] = LOW;
+        gPinDrive[i] = -1;
+    }
+
+    for (int i = 0; i < NUM_ANALOG_INPUTS; i++)
+    {
+        gAnalog[i] = 512;
+    }
+
+    if (gpszEepromFile != NULL)
+    {
+        FILE *pFile = fopen(gpszEepromFile, "rb");
+        if (pFile != NULL)
+        {
+            size_t n = fread(EEPROM.data(), 1, EEPROM.length(), pFile);
+            (void)n;
+            fclose(pFile);
+        }
+    }
+
+    if (pszScenario != NULL)
+    {
+        loadScenario(pszScenario);
+    }
+
+    Serial.setEcho(bQuiet ? NULL : stdout);
+    gWallStart = clock();
+
+    setup();
+    for (;;)
+    {
+        loop();
+        gLoopCount++;
+        advance(CLOCK_READ_COST_US);
+    }
+}
@@ -0,0 +1,18 @@
+// compiles every library header on the host, including the ones no sketch uses yet
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <serialio.h>
+#include <containers.h>
+#include <taskmanager.h>
+#include <blink.h>
+#include <xbee.h>
+#include <celshield.h>
+#include <smsalerts.h>
+#include <smsjournal.h>
+#include <lcd.h>
+#include <deviceconfig.h>
+#include <gps.h>
+#include <sensorregistry.h>
+#include <fixedpoint.h>
+#include <adcsampler.h>
+#include <debounce.h>
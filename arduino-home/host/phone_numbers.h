@@ -0,0 +1,9 @@
+#ifndef HOST_PHONE_NUMBERS_H
+#define HOST_PHONE_NUMBERS_H
+
+
+// placeholder for the private 'sensor_base/phone_numbers.h' used on the device
+#define PHONE_NO_DEFAULT        "+00000000000"
+
+
+#endif  // #ifndef HOST_PHONE_NUMBERS_H
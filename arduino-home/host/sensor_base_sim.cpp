@@ -0,0 +1,3 @@
+// host build of the base station sketch (see 'hal.cpp' for the simulation driver)
+#include <Arduino.h>
+#include "../sensor_base/sensor_base.ino"
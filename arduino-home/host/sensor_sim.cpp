@@ -0,0 +1,3 @@
+// host build of the sensor node sketch (see 'hal.cpp' for the simulation driver)
+#include <Arduino.h>
+#include "../sensor/sensor.ino"
@@ -0,0 +1,281 @@
+#ifndef ADCSAMPLER_H
+#define ADCSAMPLER_H
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include <containers.h>
+
+
+
+/**
+  Interrupt driven ADC sampling of a few analog pins.
+  A sweep converts every registered channel in turn (2^(2n) conversions for a channel with n bits of oversampling),
+  each conversion is started from the ADC interrupt, so the CPU never waits for the ADC. The results of the last
+  sweep are cached per channel: the latest conversion, the oversampled (decimated, 10+n bits) value and its average
+  in counts. Sweeps are started periodically with 'startSweep()' so the ADC interrupt does not keep waking the CPU.
+  'sampleNoiseReduced()' converts a pin while the CPU sleeps in ADC noise reduction mode (for battery powered
+  devices that do not sweep).
+  NOTE: 'analogRead()' must not be used while a sweep is running. There is one instance (the ADC interrupt needs it).
+*/
+class AdcSampler
+{
+  public:
+    static const unsigned char  MAX_CHANNELS = 4;
+    static const unsigned char  MAX_OVERSAMPLING = 3;      ///< 64 conversions, their sum still fits 16 bits
+
+  public:
+    AdcSampler()
+        :m_uChannelCount(0),
+         m_uCurrent(0),
+         m_uConversions(0),
+         m_uSum(0),
+         m_bBusy(false),
+         m_bSingle(false),
+         m_uSingleValue(0),
+         m_uSweepCount(0)
+    {
+        instance() = this;
+    }
+
+    /// registers an analog pin with 0 to MAX_OVERSAMPLING bits of oversampling, returns its channel or -1 if full
+    int addChannel(uint8_t _uPin, unsigned char _uOversampling = 0)
+    {
+        if (m_uChannelCount >= MAX_CHANNELS)
+        {
+            return -1;
+        }
+
+        sChannel &channel = m_channels[m_uChannelCount];
+        channel._uPin = _uPin;
+        channel._uMux = mux(_uPin);
+        channel._uOversampling = (_uOversampling < MAX_OVERSAMPLING) ? _uOversampling : (unsigned char)MAX_OVERSAMPLING;
+        channel._uLatest = 0;
+        channel._uValue = 0;
+        return m_uChannelCount++;
+    }
+
+    /// enables the ADC interrupt and runs the first sweep (waits for it, so all channels have values)
+    void begin()
+    {
+        ADCSRA |= _BV(ADEN) | _BV(ADIE);
+        if (startSweep() == true)
+        {
+            while (busy() == true)
+            {
+                delay(1);
+            }
+        }
+    }
+
+    /// starts a sweep through all channels, returns false if a sweep is still running or there are no channels
+    bool startSweep()
+    {
+        if ( (m_bBusy == true) || (m_uChannelCount == 0) )
+        {
+            return false;
+        }
+
+        m_uCurrent = 0;
+        m_uConversions = 0;
+        m_uSum = 0;
+        m_bBusy = true;
+        select(m_channels[0]._uMux);
+        ADCSRA |= _BV(ADIE) | _BV(ADSC);
+        return true;
+    }
+
+    bool busy() const {return m_bBusy;}
+
+    /// number of completed sweeps
+    unsigned long sweepCount() const
+    {
+        unsigned long uCount = 0;
+        CONTAINERS_ATOMIC
+        {
+            uCount = m_uSweepCount;
+        }
+
+        return uCount;
+    }
+
+    /// last conversion of the channel [counts]
+    unsigned int latest(int _iChannel) const {return load(m_channels[_iChannel]._uLatest);}
+
+    /// oversampled value of the channel, 10+n bits
+    unsigned int oversampled(int _iChannel) const {return load(m_channels[_iChannel]._uValue);}
+
+    /// mean of the channel's conversions in the last sweep [counts]
+    unsigned int average(int _iChannel) const
+    {
+        unsigned char uShift = m_channels[_iChannel]._uOversampling;
+        return min((oversampled(_iChannel) + (1u << uShift >> 1)) >> uShift, 1023u);
+    }
+
+    /// channel of a registered pin, -1 if the pin is not registered
+    int channel(uint8_t _uPin) const
+    {
+        for (unsigned char i = 0; i < m_uChannelCount; i++)
+        {
+            if (m_channels[i]._uPin == _uPin)
+            {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    /// cached average of a registered pin ('analogRead()' for other pins)
+    int read(uint8_t _uPin) const
+    {
+        int iChannel = channel(_uPin);
+        return (iChannel >= 0) ? (int)average(iChannel) : analogRead(_uPin);
+    }
+
+    /**
+      Converts a pin 2^(2n) times in ADC noise reduction sleep and returns the average [counts]. Interrupts must be
+      enabled and no sweep may be running. If another interrupt wakes the CPU first, it waits in idle sleep for the
+      conversion to complete.
+    */
+    unsigned int sampleNoiseReduced(uint8_t _uPin, unsigned char _uOversampling = 0)
+    {
+        if (_uOversampling > MAX_OVERSAMPLING)
+        {
+            _uOversampling = MAX_OVERSAMPLING;
+        }
+
+        select(mux(_uPin));
+
+        unsigned int uSum = 0;
+        for (unsigned char i = 0; i < (1 << (2 * _uOversampling)); i++)
+        {
+            m_bSingle = true;
+            ADCSRA |= _BV(ADEN) | _BV(ADIE);
+
+            // entering ADC noise reduction mode starts the conversion
+            set_sleep_mode(SLEEP_MODE_ADC);
+            sleep_enable();
+            sleep_cpu();
+            while (m_bSingle == true)
+            {
+                set_sleep_mode(SLEEP_MODE_IDLE);
+                sleep_cpu();
+            }
+
+            sleep_disable();
+            uSum += m_uSingleValue;
+        }
+
+        ADCSRA &= ~_BV(ADIE);
+        return min((uSum + (1u << (2 * _uOversampling) >> 1)) >> (2 * _uOversampling), 1023u);
+    }
+
+    /// ADC conversion complete (called by the ADC interrupt)
+    static void handleInterrupt()
+    {
+        if (instance() != NULL)
+        {
+            instance()->onConversion(ADC);
+        }
+    }
+
+  private:
+    struct sChannel
+    {
+        uint8_t             _uPin;
+        uint8_t             _uMux;
+        unsigned char       _uOversampling;
+        volatile uint16_t   _uLatest;
+        volatile uint16_t   _uValue;        ///< oversampled value of the last sweep
+    };
+
+    static AdcSampler *&instance()
+    {
+        static AdcSampler *s_pInstance = NULL;
+        return s_pInstance;
+    }
+
+    /// ADC channel of an analog pin (as 'analogRead()')
+    static uint8_t mux(uint8_t _uPin)
+    {
+        return (_uPin >= A0) ? _uPin - A0 : _uPin;
+    }
+
+    /// selects the channel with AVcc as reference (as 'analogRead()' with the DEFAULT reference)
+    static void select(uint8_t _uMux)
+    {
+        ADMUX = _BV(REFS0) | (_uMux & 0x07);
+#ifdef MUX5
+        ADCSRB = (ADCSRB & ~_BV(MUX5)) | ((_uMux & 0x08) ? _BV(MUX5) : 0);
+#endif
+    }
+
+    static unsigned int load(const volatile uint16_t &_rValue)
+    {
+        unsigned int uValue = 0;
+        CONTAINERS_ATOMIC
+        {
+            uValue = _rValue;
+        }
+
+        return uValue;
+    }
+
+    void onConversion(uint16_t _uValue)
+    {
+        if (m_bSingle == true)
+        {
+            m_uSingleValue = _uValue;
+            m_bSingle = false;
+            return;
+        }
+
+        if (m_bBusy == false)
+        {
+            return;
+        }
+
+        sChannel &channel = m_channels[m_uCurrent];
+        channel._uLatest = _uValue;
+        m_uSum += _uValue;
+        if (++m_uConversions < (1u << (2 * channel._uOversampling)))
+        {
+            ADCSRA |= _BV(ADSC);
+            return;
+        }
+
+        channel._uValue = m_uSum >> channel._uOversampling;
+        m_uSum = 0;
+        m_uConversions = 0;
+        if (++m_uCurrent < m_uChannelCount)
+        {
+            select(m_channels[m_uCurrent]._uMux);
+            ADCSRA |= _BV(ADSC);
+            return;
+        }
+
+        m_uSweepCount++;
+        m_bBusy = false;
+    }
+
+  private:
+    sChannel                m_channels[MAX_CHANNELS];
+    unsigned char           m_uChannelCount;
+    volatile unsigned char  m_uCurrent;         ///< channel being converted
+    volatile unsigned char  m_uConversions;     ///< conversions of the current channel
+    volatile uint16_t       m_uSum;
+    volatile bool           m_bBusy;            ///< sweep is running
+    volatile bool           m_bSingle;          ///< noise reduction conversion is running
+    volatile uint16_t       m_uSingleValue;
+    volatile unsigned long  m_uSweepCount;
+};
+
+
+ISR(ADC_vect)
+{
+    AdcSampler::handleInterrupt();
+}
+
+
+
+
+#endif  // #ifndef ADCSAMPLER_H
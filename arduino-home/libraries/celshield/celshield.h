@@ -3,6 +3,7 @@
 #include <Arduino.h>
 #include "../serialio/serialio.h"
 #include "../containers/containers.h"
+#include "../smsjournal/smsjournal.h"
 
 
 
@@ -11,13 +12,408 @@
 
 
 
+/// GSM 03.38 escape septet (the next septet is a code from the extension table)
+#define GSM7_ESCAPE             0x1B
+
+
+/// GSM 03.38 default alphabet code of an ASCII character; characters from the extension table are returned as
+/// 0x100 + code (sent as GSM7_ESCAPE, code) and characters the alphabet does not have are sent as '?'
+inline unsigned short gsm7Code(char _c)
+{
+    switch (_c)
+    {
+        case '@':   return 0x00;
+        case '$':   return 0x02;
+        case '_':   return 0x11;
+        case '^':   return 0x114;
+        case '{':   return 0x128;
+        case '}':   return 0x129;
+        case '\\':  return 0x12F;
+        case '[':   return 0x13C;
+        case '~':   return 0x13D;
+        case ']':   return 0x13E;
+        case '|':   return 0x140;
+        case '\n':
+        case '\r':  return _c;
+        case '`':   return '?';
+    }
+    
+    return ( (_c >= ' ') && (_c <= 'z') ) ? _c : '?';
+}
+
+
+/// number of characters of '_pszText' that fit into '_uMaxSeptets' septets (an escaped character is never split);
+/// '_rSeptets' returns the septets they take
+inline size_t gsm7Fit(const char *_pszText, size_t _uMaxSeptets, size_t &_rSeptets)
+{
+    size_t n = 0;
+    _rSeptets = 0;
+    for (; _pszText[n] != '\0'; n++)
+    {
+        size_t uSeptets = (gsm7Code(_pszText[n]) > 0xFF) ? 2 : 1;
+        if (_rSeptets + uSeptets > _uMaxSeptets)
+        {
+            break;
+        }
+        
+        _rSeptets += uSeptets;
+    }
+    
+    return n;
+}
+
+
+/**
+  Packs ASCII text into GSM 7-bit user data, one octet at a time (the text is read in place, nothing is buffered).
+  Packing stops after '_uLength' characters or at the end of the text.
+  Septets are packed LSB first; '_uFillBits' zero bits are inserted first to align the text to a septet boundary
+  after a user data header.
+*/
+class Gsm7Packer
+{
+ public:
+    Gsm7Packer()
+        :m_pszText(""),
+         m_pszEnd(m_pszText),
+         m_uBits(0),
+         m_uBitCount(0),
+         m_uEscaped(0)
+    {}
+    
+    void begin(const char *_pszText, size_t _uLength, unsigned char _uFillBits)
+    {
+        m_pszText = _pszText;
+        m_pszEnd = _pszText + _uLength;
+        m_uBits = 0;
+        m_uBitCount = _uFillBits;
+        m_uEscaped = 0;
+    }
+    
+    /// next octet of packed user data (zero padded after the end of the text)
+    unsigned char next()
+    {
+        while ( (m_uBitCount < 8) && ( (m_uEscaped != 0) || ( (m_pszText < m_pszEnd) && (*m_pszText != '\0') ) ) )
+        {
+            unsigned char uSeptet = 0;
+            if (m_uEscaped != 0)
+            {
+                uSeptet = m_uEscaped;
+                m_uEscaped = 0;
+            }
+            else
+            {
+                unsigned short uCode = gsm7Code(*m_pszText++);
+                if (uCode > 0xFF)
+                {
+                    uSeptet = GSM7_ESCAPE;
+                    m_uEscaped = (unsigned char)uCode;
+                }
+                else
+                {
+                    uSeptet = (unsigned char)uCode;
+                }
+            }
+            
+            m_uBits |= (unsigned short)uSeptet << m_uBitCount;
+            m_uBitCount += 7;
+        }
+        
+        unsigned char uOctet = (unsigned char)m_uBits;
+        m_uBits >>= 8;
+        m_uBitCount = (m_uBitCount > 8) ? m_uBitCount - 8 : 0;
+        return uOctet;
+    }
+    
+ private:
+    const char          *m_pszText;
+    const char          *m_pszEnd;
+    unsigned short      m_uBits;            ///< septet bits not yet returned
+    unsigned char       m_uBitCount;
+    unsigned char       m_uEscaped;         ///< extension table code following an escape septet, 0 if none
+};
+
+
+
+/// priority classes of outgoing SMS (lower values are more urgent)
+enum eSmsPriority
+{
+    ESP_ALARM = 0,      ///< sensor events at or above the alarm priority level
+    ESP_POWER,          ///< mains power failures
+    ESP_SENSOR,         ///< sensor low battery and timeouts
+    ESP_REPLY,          ///< command replies, status and sensor reports
+};
+
+
+/**
+  Bounded outbox of SMS to send, ordered by priority class and then by age (see 'StaticSmsOutbox' for the storage).
+  Numbers and texts are kept back to back in a shared text arena that is compacted when a message is removed, so
+  short messages only take the space they need. Long texts are kept as one message and sent part by part.
+  When a message does not fit, the least urgent (and then newest) messages that are less urgent than the new one are
+  evicted to make room; otherwise the new message is rejected. Both are counted as lost.
+  The front message is locked while one of its parts is being sent: it is neither evicted nor moved back until the
+  part is done, so more urgent messages go out between the parts of a long one.
+*/
+class SmsOutbox
+{
+  protected:
+    struct sEntry
+    {
+        unsigned short  m_uOffset;          ///< arena offset of the number, followed by the text
+        unsigned short  m_uSize;            ///< arena bytes (number and text, with terminators)
+        unsigned short  m_uTextPos;         ///< text sent so far
+        unsigned char   m_uPriority;        ///< eSmsPriority
+        unsigned char   m_uRef;             ///< concatenated SMS reference number
+        unsigned char   m_uPart;            ///< part being sent next, from 1
+        unsigned char   m_uParts;           ///< number of parts, 1 if the message is not concatenated
+        unsigned short  m_uJournalOffset;   ///< SmsJournal record (offset+1), 0 if the message is not journaled (see JOURNAL_PENDING)
+        unsigned short  m_uJournalSeq;
+        bool            m_bFailed;          ///< a part of the message failed
+    };
+    
+    SmsOutbox(sEntry *_pEntries, size_t _uCapacity, char *_pArena, size_t _uArenaSize)
+        :m_pEntries(_pEntries),
+         m_pArena(_pArena),
+         m_uCapacity(_uCapacity),
+         m_uArenaSize(_uArenaSize),
+         m_uCount(0),
+         m_uArenaUsed(0),
+         m_bLocked(false),
+         m_uLostCount(0)
+    {
+    }
+    
+  public:
+    static const unsigned short JOURNAL_PENDING = 0xFFFF;   ///< journal offset of messages that wait to be journaled
+    
+    /// queue a message of '_uParts' parts (evicting less urgent messages if required); returns false if it was rejected
+    bool push(const char *_pszNumber, const char *_pszText, unsigned char _uPriority, unsigned char _uParts, unsigned char _uRef,
+              unsigned short _uJournalOffset = 0, unsigned short _uJournalSeq = 0)
+    {
+        size_t uNumberSize = strlen(_pszNumber) + 1;
+        size_t uTextSize = strlen(_pszText) + 1;
+        if (makeRoom(uNumberSize + uTextSize, _uPriority) == false)
+        {
+            countLoss();
+            return false;
+        }
+        
+        // behind all messages that are at least as urgent
+        size_t uPos = m_uCount;
+        while ( (uPos > (m_bLocked ? 1u : 0u)) && (m_pEntries[uPos - 1].m_uPriority > _uPriority) )
+        {
+            uPos--;
+        }
+        
+        memmove(m_pEntries + uPos + 1, m_pEntries + uPos, (m_uCount - uPos) * sizeof(sEntry));
+        m_uCount++;
+        
+        sEntry &entry = m_pEntries[uPos];
+        entry.m_uOffset = (unsigned short)m_uArenaUsed;
+        entry.m_uSize = (unsigned short)(uNumberSize + uTextSize);
+        entry.m_uTextPos = 0;
+        entry.m_uPriority = _uPriority;
+        entry.m_uRef = _uRef;
+        entry.m_uPart = 1;
+        entry.m_uParts = _uParts;
+        entry.m_uJournalOffset = _uJournalOffset;
+        entry.m_uJournalSeq = _uJournalSeq;
+        entry.m_bFailed = false;
+        
+        memcpy(m_pArena + m_uArenaUsed, _pszNumber, uNumberSize);
+        memcpy(m_pArena + m_uArenaUsed + uNumberSize, _pszText, uTextSize);
+        m_uArenaUsed += entry.m_uSize;
+        return true;
+    }
+    
+    /// returns true if a message of '_uSize' arena bytes (number and text, with terminators) would be accepted
+    bool accepts(size_t _uSize, unsigned char _uPriority) const
+    {
+        size_t uFree = m_uArenaSize - m_uArenaUsed;
+        size_t uSlots = m_uCapacity - m_uCount;
+        for (size_t i = m_uCount; (i > (m_bLocked ? 1u : 0u)) && ( (uFree < _uSize) || (uSlots == 0) ); i--)
+        {
+            if (m_pEntries[i - 1].m_uPriority <= _uPriority)
+            {
+                break;
+            }
+            
+            uFree += m_pEntries[i - 1].m_uSize;
+            uSlots++;
+        }
+        
+        return (uFree >= _uSize) && (uSlots > 0);
+    }
+    
+    bool empty() const {return m_uCount == 0;}
+    size_t count() const {return m_uCount;}
+    size_t capacity() const {return m_uCapacity;}
+    
+    /// front message: number, the text that was not sent yet, and the part of it that is sent next
+    const char *number() const {return m_pArena + m_pEntries[0].m_uOffset;}
+    const char *text() const {return number() + strlen(number()) + 1 + m_pEntries[0].m_uTextPos;}
+    unsigned char priority() const {return m_pEntries[0].m_uPriority;}
+    unsigned char ref() const {return m_pEntries[0].m_uRef;}
+    unsigned char part() const {return m_pEntries[0].m_uPart;}
+    unsigned char parts() const {return m_pEntries[0].m_uParts;}
+    unsigned short journalOffset() const {return m_pEntries[0].m_uJournalOffset;}
+    unsigned short journalSeq() const {return m_pEntries[0].m_uJournalSeq;}
+    bool failed() const {return m_pEntries[0].m_bFailed;}
+    
+    /// index of the first message that waits to be journaled, -1 if there is none
+    int journalPending() const
+    {
+        for (size_t i = 0; i < m_uCount; i++)
+        {
+            if (m_pEntries[i].m_uJournalOffset == JOURNAL_PENDING)
+            {
+                return (int)i;
+            }
+        }
+        
+        return -1;
+    }
+    
+    /// message at '_uIndex' (0 is the front message): number, whole text and priority
+    const char *number(size_t _uIndex) const {return m_pArena + m_pEntries[_uIndex].m_uOffset;}
+    const char *message(size_t _uIndex) const {return number(_uIndex) + strlen(number(_uIndex)) + 1;}
+    unsigned char priority(size_t _uIndex) const {return m_pEntries[_uIndex].m_uPriority;}
+    
+    /// sets the journal record (offset+1, 0 if it could not be journaled) of the message at '_uIndex'
+    void setJournal(size_t _uIndex, unsigned short _uJournalOffset, unsigned short _uJournalSeq)
+    {
+        m_pEntries[_uIndex].m_uJournalOffset = _uJournalOffset;
+        m_pEntries[_uIndex].m_uJournalSeq = _uJournalSeq;
+    }
+    
+    /// keep the front message in place while its next part is being sent
+    void lockFront() {m_bLocked = true;}
+    
+    /// the next part of the front message ('_uLength' characters of 'text()') was sent or failed ('_bSent' false, see
+    /// 'failed()'); removes the message after its last part
+    void popPart(size_t _uLength, bool _bSent)
+    {
+        sEntry &entry = m_pEntries[0];
+        entry.m_bFailed |= (_bSent == false);
+        entry.m_uTextPos += (unsigned short)_uLength;
+        entry.m_uPart++;
+        m_bLocked = false;
+        
+        if ( (entry.m_uPart > entry.m_uParts) || (*text() == '\0') )
+        {
+            remove(0);
+            return;
+        }
+        
+        // more urgent messages that arrived while the part was sent go first
+        for (size_t i = 0; (i + 1 < m_uCount) && (m_pEntries[i + 1].m_uPriority < m_pEntries[i].m_uPriority); i++)
+        {
+            sEntry tmp = m_pEntries[i];
+            m_pEntries[i] = m_pEntries[i + 1];
+            m_pEntries[i + 1] = tmp;
+        }
+    }
+    
+    /// removes the front message without sending it (it is counted as lost)
+    void drop()
+    {
+        m_bLocked = false;
+        remove(0);
+        countLoss();
+    }
+    
+    /// number of messages that were evicted, rejected because the outbox was full, or dropped
+    unsigned short lostCount() const {return m_uLostCount;}
+    
+  private:
+    /// evicts less urgent messages until '_uSize' arena bytes and a slot are free; returns false if that is not possible
+    bool makeRoom(size_t _uSize, unsigned char _uPriority)
+    {
+        if (accepts(_uSize, _uPriority) == false)
+        {
+            return false;
+        }
+        
+        while ( (m_uArenaSize - m_uArenaUsed < _uSize) || (m_uCount >= m_uCapacity) )
+        {
+            remove(m_uCount - 1);
+            countLoss();
+        }
+        
+        return true;
+    }
+    
+    /// removes a message and compacts the arena
+    void remove(size_t _uIndex)
+    {
+        unsigned short uOffset = m_pEntries[_uIndex].m_uOffset;
+        unsigned short uSize = m_pEntries[_uIndex].m_uSize;
+        memmove(m_pArena + uOffset, m_pArena + uOffset + uSize, m_uArenaUsed - uOffset - uSize);
+        m_uArenaUsed -= uSize;
+        
+        m_uCount--;
+        memmove(m_pEntries + _uIndex, m_pEntries + _uIndex + 1, (m_uCount - _uIndex) * sizeof(sEntry));
+        for (size_t i = 0; i < m_uCount; i++)
+        {
+            if (m_pEntries[i].m_uOffset > uOffset)
+            {
+                m_pEntries[i].m_uOffset -= uSize;
+            }
+        }
+    }
+    
+    void countLoss()
+    {
+        if (m_uLostCount < 0xFFFF)
+        {
+            m_uLostCount++;
+        }
+    }
+    
+  private:
+    sEntry              *m_pEntries;        ///< most urgent first, oldest first within a priority class
+    char                *m_pArena;
+    size_t              m_uCapacity;
+    size_t              m_uArenaSize;
+    size_t              m_uCount;
+    size_t              m_uArenaUsed;
+    bool                m_bLocked;          ///< front message is being sent
+    unsigned short      m_uLostCount;
+};
+
+
+
+
+/// SmsOutbox with statically allocated storage for up to N messages with A bytes of numbers and texts (A < 64K)
+template <size_t N, size_t A>
+class StaticSmsOutbox : public SmsOutbox
+{
+  public:
+    StaticSmsOutbox()
+        :SmsOutbox(m_entries, N, m_arena, A)
+    {
+    }
+    
+  private:
+    sEntry              m_entries[N];
+    char                m_arena[A];
+};
+
+
+
+
 class GprsSms
 {
+  public:
+	const static int	MAX_NUMBER_DIGITS	= 15;		///< digits of a phone number (E.164), number buffers take MAX_NUMBER_DIGITS+2
+	
   protected:
 	const static int	PROVIDER_TEXT_SIZE	= 32;
 	const static int	SERVICE_TEXT_SIZE	= 96;
-	const static int	MAX_SMS_SIZE		= 142;
+	const static int	MAX_SMS_SIZE		= 160;		///< septets of a single SMS (GSM 7-bit)
+	const static int	MAX_PART_SIZE		= 153;		///< septets of each part of a concatenated SMS (after the user data header)
+	const static int	PDU_HEADER_SIZE		= 14 + (MAX_NUMBER_DIGITS + 1) / 2;	///< SMSC, SMS-SUBMIT header with the number and concatenation header
 	const static int	SCRATCH_SIZE		= 255;
+	const static unsigned long RX_IDLE_TIME_MS	= 500;		///< time after which a partial line from the module is returned
 	
   public:
 	enum eGprsEvent
@@ -40,257 +436,168 @@ class GprsSms
 		{
 			m_pszText[0] = '\0';
 			
-			strncpy(m_pszNumber, _pszNumber, 12);
-			m_pszNumber[12] = '\0';
+			strncpy(m_pszNumber, _pszNumber, MAX_NUMBER_DIGITS+1);
+			m_pszNumber[MAX_NUMBER_DIGITS+1] = '\0';
 		}
 		
 		sMessage(const char *_pszText, const char *_pszNumber)
+		{
+			set(_pszText, _pszNumber);
+		}
+		
+		void set(const char *_pszText, const char *_pszNumber)
 		{
 			strncpy(m_pszText, _pszText, MAX_SMS_SIZE);
 			m_pszText[MAX_SMS_SIZE] = '\0';
 			
-			strncpy(m_pszNumber, _pszNumber, 12);
-			m_pszNumber[12] = '\0';
+			strncpy(m_pszNumber, _pszNumber, MAX_NUMBER_DIGITS+1);
+			m_pszNumber[MAX_NUMBER_DIGITS+1] = '\0';
 		}
 		
 		char m_pszText[MAX_SMS_SIZE+1];
-		char m_pszNumber[13];
+		char m_pszNumber[MAX_NUMBER_DIGITS+2];
+	};
+	
+  public:
+	/// result passed to AT transaction completion callbacks
+	enum eAtResult
+	{
+		EAR_OK = 0,
+		EAR_ERROR,
+		EAR_TIMEOUT,
+	};
+	
+  protected:
+	const static int			AT_QUEUE_SIZE			= 16;
+	const static unsigned int	AT_TIMEOUT_MS			= 5000;		///< default time allowed for a command to complete
+	const static unsigned int	AT_PROMPT_TIMEOUT_MS	= 10000;	///< time allowed for the SMS '>' prompt
+	const static unsigned int	AT_SEND_TIMEOUT_MS		= 30000;	///< time allowed for a SMS to be sent
+	const static unsigned long	TEST_INTERVAL_MS		= 15000;	///< time between module health checks
+	
+	/// AT transaction flags
+	enum eAtFlags
+	{
+		EAF_NONE		= 0x00,
+		EAF_PARAM_INT	= 0x01,		///< append 'm_iParam' to the command
+		EAF_SMS_BODY	= 0x04,		///< write the PDU of the message being sent instead of a command
+		EAF_PROMPT		= 0x08,		///< response is a prompt without a new line
+		EAF_POWER_KEY	= 0x10,		///< set the power pin to 'm_iParam' instead of writing a command
+	};
+	
+	/// AT+CMGF message formats
+	enum eSmsMode
+	{
+		ESM_UNKNOWN	= -1,
+		ESM_PDU		= 0,		///< used for sending
+		ESM_TEXT	= 1,		///< used for reading and deleting
+	};
+	
+	typedef void (GprsSms::*AtDoneFunc)(eAtResult _eResult);
+	
+	/**
+	  Queued AT transaction.
+	  The command is written when the transaction becomes active, and the transaction completes when a line starting
+	  with 'm_pszExpect' is received, when the module returns an error, or when the timeout expires.
+	  Transactions without a command or expected response are timed steps that always complete with EAR_OK.
+	*/
+	struct sAtTransaction
+	{
+		const char		*m_pszCmd;			///< command text (without CR/LF), may be NULL
+		const char		*m_pszExpect;		///< response that completes the transaction, may be NULL
+		int				m_iParam;
+		unsigned int	m_uTimeOutMs;
+		unsigned char	m_uFlags;			///< eAtFlags
+		AtDoneFunc		m_fpDone;			///< completion callback, may be NULL
 	};
 	
   public:
-    GprsSms(Stream &_rStream, int _iPowerPin)
+    /// messages to send are kept in '_rOutbox' (e.g. a 'StaticSmsOutbox')
+    GprsSms(Stream &_rStream, int _iPowerPin, SmsOutbox &_rOutbox)
         :m_serial(_rStream),
          m_iPowerPin(_iPowerPin),
-		 m_uTxBusyTime(0),
+         m_lineReader(_rStream, RX_IDLE_TIME_MS),
+         m_bAtActive(false),
+         m_uAtStartTime(0),
+         m_uTxTextPos(0),
+         m_uPduHeaderSize(0),
+         m_uPduSize(0),
+         m_uTxPartLength(0),
+         m_bSmsTextNext(false),
+         m_eSmsMode(ESM_UNKNOWN),
+         m_uConcatRef(0),
+         m_rOutbox(_rOutbox),
+         m_pJournal(NULL),
+         m_uRejectedCount(0),
+         m_bCmgsSeen(false),
          m_iWaitFailCount(0),
          m_uLastTestTime(0)
     {
 		m_pszServiceText[0] = '\0';
 		m_pszProviderText[0] = '\0';
+		m_pszRxNumber[0] = '\0';
     }
     
     virtual ~GprsSms()
     {
     }
     
-    bool busy()
+    /// returns true while AT transactions are active or queued
+    bool busy() const
     {
-		// check for bad uBusyTime values
-		if (m_uTxBusyTime > millis() + 30000ul)
-		{
-			m_uTxBusyTime = millis() + 5000ul;
-            return false;
-		}
-        else
-        {
-            return m_uTxBusyTime > millis();
-        }
+        return (m_bAtActive == true) || (m_atQueue.empty() == false);
     }
     
-	/// wait for 'OK/ERROR' return from module
-	int waitForReturn()
-	{
-		DEBUG_PRINT("wait - ");
-		
-		int n = readln(m_serial, m_pScratch, SCRATCH_SIZE, 5000, false);
-        if (n == 0)
-        {
-            m_iWaitFailCount++;
-            DEBUG_PRINTLN("");
-            return 0;
-        }
-        else
+    /// service gprs tx and rx queues (never waits on the module)
+    void update()
+    {
+        service();
+        
+        if (m_pJournal != NULL)
         {
-            m_iWaitFailCount = 0;
-            
-            m_pScratch[n] = '\0';
-            DEBUG_PRINTLN(m_pScratch);
-            
-            delay(500);
-            return n;
+            m_pJournal->update();
+            journalPending();
         }
-	}
-
-    /// service gprs tx and rx queues
-    void update(unsigned long _uTimeOut)
-    {
-		// check for new data from grps
-        read(_uTimeOut);
         
         // check if we should send
 		if ( (busy() == false) &&
-             (m_txMsgQueue.empty() == false) )
+             (m_rOutbox.empty() == false) )
 		{
             sendNextMessage();
 		}
         
-        // test and reset module
-        if ( (busy() == false) &&
-             (millis() - m_uLastTestTime > 15000ul) )
+        // test module (module is reset by 'onTestDone()' if it stops responding)
+        else if ( (busy() == false) &&
+                  (millis() - m_uLastTestTime > TEST_INTERVAL_MS) )
         {
 			DEBUG_PRINTLN("update: testing...");
             
-            m_serial.print("AT\r\n");
-            waitForReturn();
-            
-            if (m_iWaitFailCount > 3)
-            {
-                DEBUG_PRINTLN("update: cycling power...");
-                powerDown();
-                powerUp();
-            }
-            
+            pushCommand("AT", "OK", AT_TIMEOUT_MS, &GprsSms::onTestDone);
             m_uLastTestTime = millis();
         }
     }
-	
-	/// read all data from GPRS
-	void read(unsigned long _uTimeOut)
-	{
-		// read from GPRS
-		int n = 0;
-		while ((n = readln(m_serial, m_pScratch, SCRATCH_SIZE, _uTimeOut, true)) > 0)
-		{
-			m_pScratch[n] = '\0';
-			
-			DEBUG_PRINT("read - ");
-			DEBUG_PRINTLN(m_pScratch);
-			
-			// new message received
-			if (strncmp(m_pScratch, "+CMTI:", 6) == 0)
-			{
-                DEBUG_PRINTLN("read - new messages received");
-				m_rxEventQueue.push(EGE_NEW_MSG_RCV);
-			}
-			
-			// 'checkAirtime()' text received
-			else if (strncmp(m_pScratch, "+CUSD:", 6) == 0)
-			{
-				// tokenise return
-				char *pszCmd = strtok(m_pScratch, "+: ");
-				int mode = atoi(strtok(NULL, ", "));
-				char *pszText = strtok(NULL, "\"");
-				
-				strncpy(m_pszServiceText, pszText, SERVICE_TEXT_SIZE);
-				m_pszServiceText[SERVICE_TEXT_SIZE] = '\0';
-				
-                DEBUG_PRINT("read - service text received - ");
-                DEBUG_PRINTLN(m_pszServiceText);
-                
-				m_rxEventQueue.push(EGE_SERVICE_TEXT_RCV);
-				m_uTxBusyTime = millis();
-			}
-			
-			// 'sendMessage()' reply received
-			else if (strncmp(m_pScratch, "+CMGS:", 6) == 0)
-			{
-                DEBUG_PRINTLN("read - message send completed");
-                
-				waitForReturn();
-				m_uTxBusyTime = millis();
-			}
-			
-			// voice call received
-			else if (strncmp(m_pScratch, "RING", 4) == 0)
-			{
-                DEBUG_PRINTLN("read - voice call received");
-                
-				m_rxEventQueue.push(EGE_CALL_RCV);
-			}
-		}
-	}
-	
-    /// sends the next tx message in the queue
-    bool sendNextMessage()
+    
+    /// run queued AT transactions until all have completed (returns false if the time ran out; used during startup and before resets)
+    bool waitForCommands(unsigned long _uTimeOutMs)
     {
-        m_uTxBusyTime = millis() + 15000ul;
-        
-        if (m_txMsgQueue.empty() == false)
+        for (unsigned long t = millis(); millis() - t < _uTimeOutMs;)
         {
-            sMessage msg;
-            m_txMsgQueue.pop(msg);
-				
-            // start message
-            DEBUG_PRINT("sendMessage - ");
-            DEBUG_PRINTLN(msg.m_pszNumber);
-            
-            m_serial.print("AT+CMGF=1\r\n");
-		    waitForReturn();
-            m_serial.print("AT+CMGS=\"");
-            m_serial.print(msg.m_pszNumber);
-            m_serial.print("\"\r\n");
-		
-            // wait for response
-            DEBUG_PRINT("sendMessage wait - ");
-            unsigned long t = millis() + 10000ul;
-            while (t > millis())
+            service();
+            if (busy() == false)
             {
-                if (m_serial.available() > 0)
-                {
-                    char ch = m_serial.read();
-                    DEBUG_PRINT(ch);
-                    if (ch == '>')
-                    {
-                        break;
-                    }
-                }
+                return true;
             }
-		
-            DEBUG_PRINTLN("");
-            
-            // send text
-            DEBUG_PRINT("sendMessage - ");
-            DEBUG_PRINTLN(msg.m_pszText);
-            
-            m_serial.print(msg.m_pszText);
-            delay(100);
-            m_serial.print("\r\n");
-            delay(100);
-            m_serial.write(0x1A);
-            delay(100);
-            m_serial.print("\r\n");
         }
+        
+        return false;
     }
-    
-    /// lists all unread messages
+	
+    /// lists all unread messages (messages are queued as they are received)
     void readAllMessages()
     {
 		DEBUG_PRINTLN("readAllMessages - request");
 		
-        m_serial.print("AT+CMGF=1\r\n");
-		waitForReturn();
-        m_serial.print("AT+CMGL=\"REC UNREAD\"\r\n");
-		
-		// read from GPRS
-		int n = 0;
-		while ((n = readln(m_serial, m_pScratch, SCRATCH_SIZE, 5000, false)) > 0)
-		{
-			m_pScratch[n] = '\0';
-			
-			// 'readAllMessages()' message list received
-			DEBUG_PRINT("readAllMessages - ");
-			DEBUG_PRINTLN(m_pScratch);
-			
-			if (strncmp(m_pScratch, "+CMGL:", 6) == 0)
-			{
-				// tokenise return
-				char *pszCmd = strtok(m_pScratch, "+: ");
-				int smsIndex = atoi(strtok(NULL, "\", "));
-				char *pszStat = strtok(NULL, "\",");
-				char *pszNumber = strtok(NULL, "\",");
-				
-				// read message text
-				n = readln(m_serial, m_pScratch, SCRATCH_SIZE, 5000, false);
-				m_pScratch[n] = '\0';
-				
-				// queue message
-				m_rxMsgQueue.push(sMessage(m_pScratch, pszNumber));
-			}
-			else if (strcmp(m_pScratch, "OK") == 0)
-			{
-				break;
-			}
-		}
+        pushSmsMode(ESM_TEXT);
+        pushCommand("AT+CMGL=\"REC UNREAD\"", "OK");
     }
     
     /// deletes the message at the given location
@@ -298,12 +605,7 @@ class GprsSms
     {
 		DEBUG_PRINTLN("deleteMessage");
 		
-        m_serial.print("AT+CMGF=1\r\n");
-		waitForReturn();
-        m_serial.print("AT+CMGD=");
-        m_serial.print(_iIndex);
-        m_serial.print("\r\n");
-		waitForReturn();
+        pushCommand("AT+CMGD=", "OK", AT_TIMEOUT_MS, NULL, EAF_PARAM_INT, _iIndex);
     }
     
     /// delete all read messages
@@ -311,10 +613,8 @@ class GprsSms
     {
 		DEBUG_PRINTLN("deleteAllReadMessages");
 		
-        m_serial.print("AT+CMGF=1\r\n");
-		waitForReturn();
-        m_serial.print("AT+CMGDA=\"DEL READ\"\r\n");
-		waitForReturn();
+        pushSmsMode(ESM_TEXT);
+        pushCommand("AT+CMGDA=\"DEL READ\"", "OK");
     }
     
     /// delete all sent messages
@@ -322,190 +622,718 @@ class GprsSms
     {
 		DEBUG_PRINTLN("deleteAllSentMessages");
 		
-        m_serial.print("AT+CMGF=1\r\n");
-		waitForReturn();
-        m_serial.print("AT+CMGDA=\"DEL SENT\"\r\n");
-		waitForReturn();
-        m_serial.print("AT+CMGDA=\"DEL UNSENT\"\r\n");
-		waitForReturn();
+        pushSmsMode(ESM_TEXT);
+        pushCommand("AT+CMGDA=\"DEL SENT\"", "OK");
+        pushCommand("AT+CMGDA=\"DEL UNSENT\"", "OK");
     }
     
-    /// check provider
+    /// check provider (provider text is updated when the reply is received)
     void checkProvider()
     {
 		DEBUG_PRINTLN("checkProvider");
 		
 		m_pszProviderText[0] = '\0';
-        m_serial.print("AT+CMGF=1\r\n");
-		waitForReturn();
-        m_serial.print("AT+COPS?\r\n");
-		
-		// read from GPRS
-		int n = 0;
-		if ((n = readln(m_serial, m_pScratch, MAX_SMS_SIZE, 5000, false)) > 0)
-		{
-			m_pScratch[n] = '\0';
-			
-			DEBUG_PRINTLN(m_pScratch);
-						
-			// 'checkProvider()' text received
-			if (strncmp(m_pScratch, "+COPS:", 6) == 0)
-			{
-				// tokenise return
-				char *pszCmd = strtok(m_pScratch, "+: ");
-				int mode = atoi(strtok(NULL, ", "));
-				int format = atoi(strtok(NULL, ", "));
-				char *pszText = strtok(NULL, "\",");
-				strncpy(m_pszProviderText, pszText, PROVIDER_TEXT_SIZE);
-                m_pszProviderText[PROVIDER_TEXT_SIZE] = '\0';
-				
-				waitForReturn();
-			}
-		}
+        pushCommand("AT+COPS?", "OK");
     }
     
-    /// check airtime
+    /// check airtime (raises EGE_SERVICE_TEXT_RCV when the reply is received)
     void checkAirtime()
     {
 		DEBUG_PRINTLN("checkAirtime");
 		
-        m_uTxBusyTime = millis() + 10000;
-        
 		m_pszServiceText[0] = '\0';
-        m_serial.print("AT+CMGF=1\r\n");
-		waitForReturn();
-        m_serial.print("ATD*100#\r\n");
-		waitForReturn();
+        pushCommand("ATD*100#", "+CUSD:", 10000);
     }
     
-    /// switch GPRS module on
+    /// switch GPRS module on (power key is pulsed if the module does not respond)
     void powerUp()
     {
 		DEBUG_PRINTLN("powerUp");
 		
-        // flush module
-        flush(m_serial);
-        
-        // try an AT command and switch on if there is no response
-        m_serial.print("AT\r\n");
-        if (waitForReturn() == 0)
-        {
-            pinMode(m_iPowerPin, OUTPUT);
-            digitalWrite(m_iPowerPin,LOW);
-            delay(1000);
-            digitalWrite(m_iPowerPin,HIGH);
-            delay(2000);
-            digitalWrite(m_iPowerPin,LOW);
-            delay(3000);
-            
-            // turn echo off
-            m_serial.print("ATE0\r\n");
-            
-            // wait a little for GPRS to initialise
-            delay(3000);
-        }
-        
-        // flush module
-        flush(m_serial);
+        m_lineReader.discard();
+        m_eSmsMode = ESM_UNKNOWN;
+        pushCommand("AT", "OK", AT_TIMEOUT_MS, &GprsSms::onPowerUpTestDone);
     }
 	
-    /// switch GPRS module off
+    /// switch GPRS module off (power key is pulsed if the module responds)
     void powerDown()
     {
 		DEBUG_PRINTLN("powerDown");
 		
-        // flush module
-        flush(m_serial);
-        
-        // try an AT command and switch on if there is a response
-        m_serial.print("AT\r\n");
-        if (waitForReturn() > 0)
-        {
-            pinMode(m_iPowerPin, OUTPUT);
-            digitalWrite(m_iPowerPin,LOW);
-            delay(1000);
-            digitalWrite(m_iPowerPin,HIGH);
-            delay(2000);
-            digitalWrite(m_iPowerPin,LOW);
-            delay(3000);
-        }
-        
-        // flush module
-        flush(m_serial);
+        m_lineReader.discard();
+        m_eSmsMode = ESM_UNKNOWN;
+        pushCommand("AT", "OK", AT_TIMEOUT_MS, &GprsSms::onPowerDownTestDone);
     }
 	
 	/// returns the next event
 	eGprsEvent popRxEvent()
 	{
 		char event = EGE_NONE;
-		m_rxEventQueue.pop(event);
+		m_rxEventQueue.try_pop(event);
 		return (eGprsEvent)event;
 	}
 	
 	/// returns true if there are mesages in the queue
 	bool hasRxMessages()
 	{
-		return m_rxMsgQueue.empty() == false;
+		return m_rxMsgBuffer.empty() == false;
 	}
 	
-	/// pops the next message from the message queue
-	sMessage &popRxMessage(sMessage &_rMsg)
+	/**
+	  Keep alerts (messages more urgent than replies) in '_pJournal' until the module confirmed that they were sent,
+	  so that they survive a reset. Call 'replayJournal()' once the module is up to queue the alerts that were not
+	  sent before the reset. Alerts that failed or were evicted from the outbox stay in the journal as well.
+	*/
+	void setJournal(SmsJournal *_pJournal)
 	{
-		m_rxMsgQueue.pop(_rMsg);
+		m_pJournal = _pJournal;
 	}
 	
-    /// creates a message (using variable argument list) and queues it to be sent (message length is limited)
+	/// queue the pending journal alerts, oldest first (returns the number of alerts queued)
+	size_t replayJournal()
+	{
+		DEBUG_PRINTLN("replayJournal");
+		
+		size_t n = 0;
+		unsigned short uSeq = 0;
+		unsigned short uOffset = 0;
+		for (bool bFirst = true; (m_pJournal != NULL) && (m_pJournal->nextPending(uSeq, uOffset, bFirst) == true); bFirst = false)
+		{
+			char pszNumber[MAX_NUMBER_DIGITS+2];
+			char pszText[SCRATCH_SIZE+1];
+			unsigned char uPriority = ESP_REPLY;
+			bool bComplete = m_pJournal->read(uOffset, uPriority, pszNumber, sizeof(pszNumber), pszText, sizeof(pszText));
+			
+			DEBUG_PRINT("replayJournal - ");
+			DEBUG_PRINTLN(pszText);
+			
+			// alerts that can never be sent (or were not read in full, so a cut number is not sent to) are done
+			if ( (bComplete == false) || (validNumber(pszNumber) == false) )
+			{
+				m_pJournal->ack(uOffset, uSeq);
+				countRejected();
+				continue;
+			}
+			
+			if (m_rOutbox.push(pszNumber, pszText, uPriority, (unsigned char)txPartCount(pszText), ++m_uConcatRef, uOffset, uSeq) == true)
+			{
+				n++;
+			}
+		}
+		
+		return n;
+	}
+	
+	/// returns true if there are messages waiting to be sent
+	bool hasTxMessages() const
+	{
+		return m_rOutbox.empty() == false;
+	}
+	
+	/// returns true if the given message would be queued now (possibly evicting less urgent messages)
+	bool canQueueTxMessage(const char *_pszPoneNo, const char *_pszText, eSmsPriority _ePriority) const
+	{
+		return m_rOutbox.accepts(strlen(_pszPoneNo) + strlen(_pszText) + 2, _ePriority);
+	}
+	
+	/// returns true if there are events in the queue
+	bool hasRxEvents()
+	{
+		return m_rxEventQueue.empty() == false;
+	}
+	
+	/// pops the next message from the message queue
+	sMessage &popRxMessage(sMessage &_rMsg)
+	{
+		m_rxMsgBuffer.try_pop(_rMsg);
+		return _rMsg;
+	}
+	
+	/// next received message, read in place (NULL if there are none); release it with 'popRxMessage()'
+	sMessage *rxMessage()
+	{
+		return m_rxMsgBuffer.front();
+	}
+	
+	/// releases the message returned by 'rxMessage()'
+	void popRxMessage()
+	{
+		m_rxMsgBuffer.pop();
+	}
+	
+	/// number of messages dropped because the outbox or rx queue was full, or because their number was invalid
+	unsigned short droppedMessageCount() const
+	{
+		return m_rOutbox.lostCount() + m_rxMsgBuffer.overflowCount() + m_uRejectedCount;
+	}
+	
+    /// creates a reply message (using variable argument list) and queues it to be sent (message length is limited)
     void pushTxMessageFmt(const char *_pszPoneNo, const char *_pszFmt, ...)
     {
         // build message
+        char pszText[SCRATCH_SIZE+1];
 		va_list ap;
 		va_start(ap, _pszFmt);
-        int n = vsnprintf(m_pScratch, SCRATCH_SIZE, _pszFmt, ap);
+        int n = vsnprintf(pszText, SCRATCH_SIZE, _pszFmt, ap);
 		va_end(ap);
         
         if (n > 0)
         {
-            pushTxMessageTxt(_pszPoneNo, m_pScratch);
+            pushTxMessageTxt(_pszPoneNo, pszText);
         }
     }
     
-    /// creates a message (using just text) and queues it to be sent (can send very long messages)
-    void pushTxMessageTxt(const char *_pszPoneNo, const char *_pszText)
+    /**
+      Creates a message (using just text) and queues it to be sent.
+      Texts longer than one SMS are sent as a concatenated SMS, which arrives as one message on the phone. The
+      outbox evicts less urgent messages to make room, or drops the message (see 'SmsOutbox'). Returns false if the
+      message was dropped.
+    */
+    bool pushTxMessageTxt(const char *_pszPoneNo, const char *_pszText, eSmsPriority _ePriority = ESP_REPLY)
     {
 		DEBUG_PRINT("pushTxMessage - ");
 		DEBUG_PRINTLN(_pszPoneNo);
 		
-        // queue message(s)
 		DEBUG_PRINT("pushTxMessage - ");
 		DEBUG_PRINTLN(_pszText);
         
-        int n = strlen(_pszText);
-        for (int i = 0; i < n; i += MAX_SMS_SIZE)
+        if (_pszText[0] == '\0')
         {
-            sMessage msg(_pszText+i, _pszPoneNo);
-            
-            DEBUG_PRINT(i);
-            DEBUG_PRINT(": ");
-            DEBUG_PRINTLN(msg.m_pszText);
-            
-            m_txMsgQueue.push(msg);
+            return true;
+        }
+        
+        if (validNumber(_pszPoneNo) == false)
+        {
+            DEBUG_PRINTLN("pushTxMessage - invalid number");
+            countRejected();
+            return false;
+        }
+        
+        // journal alerts that the outbox takes (later by 'update()' if the journal is still writing the previous one)
+        size_t uParts = txPartCount(_pszText);
+        unsigned short uJournalOffset = 0;
+        unsigned short uJournalSeq = 0;
+        if ( (m_pJournal != NULL) && (_ePriority < ESP_REPLY) &&
+             (m_rOutbox.accepts(strlen(_pszPoneNo) + strlen(_pszText) + 2, _ePriority) == true) )
+        {
+            uJournalOffset = (m_pJournal->ready() == true) ? m_pJournal->append(_ePriority, _pszPoneNo, _pszText, uJournalSeq) :
+                                                             SmsOutbox::JOURNAL_PENDING;
+        }
+        
+        if (m_rOutbox.push(_pszPoneNo, _pszText, _ePriority, (unsigned char)uParts, ++m_uConcatRef, uJournalOffset, uJournalSeq) == false)
+        {
+            DEBUG_PRINTLN("pushTxMessage - outbox full");
+            return false;
         }
+        
+        return true;
     }
     
 	const char *serviceText() const {return m_pszServiceText;}
 	const char *providerText() const {return m_pszProviderText;}
     
+  protected:
+    /// journal the first outbox message that waits for it, once the journal is ready for the next record
+    void journalPending()
+    {
+        int i = m_rOutbox.journalPending();
+        if ( (i >= 0) && (m_pJournal->ready() == true) )
+        {
+            unsigned short uSeq = 0;
+            unsigned short uOffset = m_pJournal->append(m_rOutbox.priority(i), m_rOutbox.number(i), m_rOutbox.message(i), uSeq);
+            m_rOutbox.setJournal(i, uOffset, uSeq);
+        }
+    }
+    
+    /// returns true if the number can be sent to: an optional '+' followed by 1 to MAX_NUMBER_DIGITS digits
+    static bool validNumber(const char *_pszNumber)
+    {
+        if (*_pszNumber == '+')
+        {
+            _pszNumber++;
+        }
+        
+        size_t uDigits = 0;
+        for (; _pszNumber[uDigits] != '\0'; uDigits++)
+        {
+            if ( (_pszNumber[uDigits] < '0') || (_pszNumber[uDigits] > '9') || (uDigits >= MAX_NUMBER_DIGITS) )
+            {
+                return false;
+            }
+        }
+        
+        return uDigits > 0;
+    }
+    
+    void countRejected()
+    {
+        if (m_uRejectedCount < 0xFFFF)
+        {
+            m_uRejectedCount++;
+        }
+    }
+    
+    /// number of SMS needed to send the text (parts of a concatenated SMS if it does not fit one)
+    static size_t txPartCount(const char *_pszText)
+    {
+        size_t uSeptets = 0;
+        if (_pszText[gsm7Fit(_pszText, MAX_SMS_SIZE, uSeptets)] == '\0')
+        {
+            return 1;
+        }
+        
+        size_t uParts = 0;
+        for (const char *p = _pszText; *p != '\0'; p += gsm7Fit(p, MAX_PART_SIZE, uSeptets))
+        {
+            uParts++;
+        }
+        
+        return uParts;
+    }
+    
+    /// queue an AT transaction (returns false if the queue is full)
+    bool pushCommand(const char *_pszCmd, const char *_pszExpect, unsigned int _uTimeOutMs = AT_TIMEOUT_MS, AtDoneFunc _fpDone = NULL, unsigned char _uFlags = EAF_NONE, int _iParam = 0, bool _bFront = false)
+    {
+        if (m_atQueue.full() == true)
+        {
+            DEBUG_PRINTLN("pushCommand - queue full");
+            return false;
+        }
+        
+        sAtTransaction at;
+        at.m_pszCmd = _pszCmd;
+        at.m_pszExpect = _pszExpect;
+        at.m_iParam = _iParam;
+        at.m_uTimeOutMs = _uTimeOutMs;
+        at.m_uFlags = _uFlags;
+        at.m_fpDone = _fpDone;
+        
+        if (_bFront == true) m_atQueue.pushFront(at);
+        else m_atQueue.push(at);
+        
+        return true;
+    }
+    
+    /// queue power key presses in front of all other transactions
+    void pushPowerKeyPulse()
+    {
+        // pushed in reverse order: LOW 1s, HIGH 2s, LOW 3s
+        pushCommand(NULL, NULL, 3000, NULL, EAF_POWER_KEY, LOW, true);
+        pushCommand(NULL, NULL, 2000, NULL, EAF_POWER_KEY, HIGH, true);
+        pushCommand(NULL, NULL, 1000, NULL, EAF_POWER_KEY, LOW, true);
+    }
+    
+    /// read module input and advance the active AT transaction by one step
+    void service()
+    {
+        // process all lines received so far
+        while (m_lineReader.readln() > 0)
+        {
+            processLine(m_lineReader.line());
+        }
+        
+        if (m_bAtActive == false)
+        {
+            if (m_atQueue.empty() == false)
+            {
+                m_atQueue.pop(m_at);
+                startCommand();
+            }
+        }
+        else if ( (m_at.m_uFlags & EAF_SMS_BODY) && (m_uTxTextPos != 0xFFFF) )
+        {
+            writeMessageText();
+        }
+        else if ( (m_at.m_uFlags & EAF_PROMPT) &&
+                  (strchr(m_lineReader.line(), '>') != NULL) )
+        {
+            m_lineReader.clear();
+            completeCommand(EAR_OK);
+        }
+        else if (millis() - m_uAtStartTime >= m_at.m_uTimeOutMs)
+        {
+            // timed steps complete successfully when their time is up
+            completeCommand( ((m_at.m_pszCmd == NULL) && (m_at.m_pszExpect == NULL)) ? EAR_OK : EAR_TIMEOUT );
+        }
+    }
+    
+    /// start the transaction in 'm_at'
+    void startCommand()
+    {
+        m_bAtActive = true;
+        m_uAtStartTime = millis();
+        
+        if (m_at.m_uFlags & EAF_POWER_KEY)
+        {
+            pinMode(m_iPowerPin, OUTPUT);
+            digitalWrite(m_iPowerPin, m_at.m_iParam);
+        }
+        else if (m_at.m_uFlags & EAF_SMS_BODY)
+        {
+            DEBUG_PRINT("sendMessage - ");
+            DEBUG_PRINTLN(m_rOutbox.text());
+            
+            // the text of concatenated parts starts at the septet boundary after the 6 octet header
+            m_packer.begin(m_rOutbox.text(), m_uTxPartLength, (m_rOutbox.parts() > 1) ? 1 : 0);
+            m_bCmgsSeen = false;
+            m_uTxTextPos = 0;
+            writeMessageText();
+        }
+        else if (m_at.m_pszCmd != NULL)
+        {
+            DEBUG_PRINT("command - ");
+            DEBUG_PRINTLN(m_at.m_pszCmd);
+            
+            m_serial.print(m_at.m_pszCmd);
+            if (m_at.m_uFlags & EAF_PARAM_INT)
+            {
+                m_serial.print(m_at.m_iParam);
+            }
+            
+            m_serial.print("\r\n");
+        }
+    }
+    
+    /// write as many PDU octets (in hex) as the serial tx buffer takes without blocking, followed by CTRL-Z
+    void writeMessageText()
+    {
+        int iFree = m_serial.availableForWrite() / 2;
+        for (; (iFree > 0) && (m_uTxTextPos < m_uPduSize); iFree--)
+        {
+            unsigned char uOctet = (m_uTxTextPos < m_uPduHeaderSize) ? m_pduHeader[m_uTxTextPos] : m_packer.next();
+            m_serial.write(hexDigit(uOctet >> 4));
+            m_serial.write(hexDigit(uOctet & 0x0F));
+            m_uTxTextPos++;
+        }
+        
+        // CTRL-Z and line end once there is room for them
+        if ( (m_uTxTextPos >= m_uPduSize) && (m_serial.availableForWrite() >= 3) )
+        {
+            m_serial.write(0x1A);
+            m_serial.print("\r\n");
+            m_uTxTextPos = 0xFFFF;     // PDU done, wait for reply
+        }
+    }
+    
+    static char hexDigit(unsigned char _uNibble)
+    {
+        return (_uNibble < 10) ? '0' + _uNibble : 'A' + _uNibble - 10;
+    }
+    
+    /// complete the active transaction and call its callback
+    void completeCommand(eAtResult _eResult)
+    {
+        m_bAtActive = false;
+        
+        if (_eResult == EAR_TIMEOUT)
+        {
+            m_iWaitFailCount++;
+            DEBUG_PRINTLN("command - timeout");
+        }
+        else if (_eResult == EAR_OK)
+        {
+            m_iWaitFailCount = 0;
+        }
+        
+        if (m_at.m_fpDone != NULL)
+        {
+            (this->*m_at.m_fpDone)(_eResult);
+        }
+    }
+    
+    /// process a line received from the module: unsolicited results, data lines and transaction responses
+    void processLine(char *_pszLine)
+    {
+        DEBUG_PRINT("read - ");
+        DEBUG_PRINTLN(_pszLine);
+        
+        // message text following a '+CMGL:' line
+        if (m_bSmsTextNext == true)
+        {
+            m_bSmsTextNext = false;
+            sMessage *pMsg = m_rxMsgBuffer.emplace();
+            if (pMsg != NULL)
+            {
+                pMsg->set(_pszLine, m_pszRxNumber);
+                m_rxMsgBuffer.commit();
+            }
+            
+            return;
+        }
+        
+        // new message received
+        if (strncmp(_pszLine, "+CMTI:", 6) == 0)
+        {
+            DEBUG_PRINTLN("read - new messages received");
+            m_rxEventQueue.try_push(EGE_NEW_MSG_RCV);
+        }
+        
+        // 'checkAirtime()' text received
+        else if (strncmp(_pszLine, "+CUSD:", 6) == 0)
+        {
+            // tokenise return (copy of the line, since the expected response is matched below)
+            char pszLine[SERVICE_TEXT_SIZE+16];
+            strncpy(pszLine, _pszLine, sizeof(pszLine)-1);
+            pszLine[sizeof(pszLine)-1] = '\0';
+            
+            strtok(pszLine, "+: ");                         // command
+            strtok(NULL, ", ");                             // mode
+            char *pszText = strtok(NULL, "\"");
+            
+            if (pszText != NULL)
+            {
+                strncpy(m_pszServiceText, pszText, SERVICE_TEXT_SIZE);
+                m_pszServiceText[SERVICE_TEXT_SIZE] = '\0';
+            }
+            
+            DEBUG_PRINT("read - service text received - ");
+            DEBUG_PRINTLN(m_pszServiceText);
+            
+            m_rxEventQueue.try_push(EGE_SERVICE_TEXT_RCV);
+        }
+        
+        // 'readAllMessages()' message header received
+        else if (strncmp(_pszLine, "+CMGL:", 6) == 0)
+        {
+            // tokenise return
+            strtok(_pszLine, "+: ");                        // command
+            strtok(NULL, "\", ");                           // index
+            strtok(NULL, "\",");                            // status
+            char *pszNumber = strtok(NULL, "\",");
+            
+            // keep number, the text follows on the next line
+            strncpy(m_pszRxNumber, (pszNumber != NULL) ? pszNumber : "", MAX_NUMBER_DIGITS+1);
+            m_pszRxNumber[MAX_NUMBER_DIGITS+1] = '\0';
+            m_bSmsTextNext = true;
+            return;
+        }
+        
+        // 'checkProvider()' text received
+        else if (strncmp(_pszLine, "+COPS:", 6) == 0)
+        {
+            // tokenise return
+            strtok(_pszLine, "+: ");                        // command
+            strtok(NULL, ", ");                             // mode
+            strtok(NULL, ", ");                             // format
+            char *pszText = strtok(NULL, "\",");
+            
+            if (pszText != NULL)
+            {
+                strncpy(m_pszProviderText, pszText, PROVIDER_TEXT_SIZE);
+                m_pszProviderText[PROVIDER_TEXT_SIZE] = '\0';
+            }
+            return;
+        }
+        
+        // message sent (the transaction completes with the 'OK' that follows)
+        else if (strncmp(_pszLine, "+CMGS:", 6) == 0)
+        {
+            m_bCmgsSeen = true;
+        }
+        
+        // voice call received
+        else if (strncmp(_pszLine, "RING", 4) == 0)
+        {
+            DEBUG_PRINTLN("read - voice call received");
+            m_rxEventQueue.try_push(EGE_CALL_RCV);
+        }
+        
+        // match response of active transaction
+        if (m_bAtActive == true)
+        {
+            if ( (m_at.m_pszExpect != NULL) &&
+                 (strncmp(_pszLine, m_at.m_pszExpect, strlen(m_at.m_pszExpect)) == 0) )
+            {
+                completeCommand(EAR_OK);
+            }
+            else if ( (strcmp(_pszLine, "ERROR") == 0) ||
+                      (strncmp(_pszLine, "+CMS ERROR", 10) == 0) ||
+                      (strncmp(_pszLine, "+CME ERROR", 10) == 0) )
+            {
+                completeCommand(EAR_ERROR);
+            }
+        }
+    }
+    
+    /// queue AT+CMGF, unless the module is (or will be, once the queued transactions ran) in the given format already
+    void pushSmsMode(eSmsMode _eMode)
+    {
+        if ( (m_eSmsMode != _eMode) &&
+             (pushCommand("AT+CMGF=", "OK", AT_TIMEOUT_MS, &GprsSms::onSmsModeDone, EAF_PARAM_INT, _eMode) == true) )
+        {
+            m_eSmsMode = _eMode;
+        }
+    }
+    
+    void onSmsModeDone(eAtResult _eResult)
+    {
+        if (_eResult != EAR_OK)
+        {
+            m_eSmsMode = ESM_UNKNOWN;
+        }
+    }
+    
+    /**
+      Builds the PDU header of the tx message: SMSC (the one stored on the SIM), SMS-SUBMIT header, destination
+      address, GSM 7-bit coding, user data length and, for parts of a concatenated SMS, the user data header.
+      The packed text follows the header when the PDU is written.
+    */
+    void buildPdu()
+    {
+        const char *pszNumber = m_rOutbox.number();
+        bool bInternational = (pszNumber[0] == '+');
+        if (bInternational == true)
+        {
+            pszNumber++;
+        }
+        
+        size_t uDigits = strlen(pszNumber);
+        size_t uSeptets = 0;
+        m_uTxPartLength = gsm7Fit(m_rOutbox.text(), (m_rOutbox.parts() > 1) ? MAX_PART_SIZE : MAX_SMS_SIZE, uSeptets);
+        
+        unsigned char *p = m_pduHeader;
+        *p++ = 0x00;                                        // SMSC from the SIM
+        *p++ = (m_rOutbox.parts() > 1) ? 0x41 : 0x01;            // SMS-SUBMIT, with user data header for concatenated parts
+        *p++ = 0x00;                                        // message reference (set by the module)
+        *p++ = (unsigned char)uDigits;
+        *p++ = (bInternational == true) ? 0x91 : 0x81;
+        for (size_t i = 0; i < uDigits; i += 2)             // digits as swapped nibbles, padded with 0xF
+        {
+            unsigned char uHigh = (i + 1 < uDigits) ? pszNumber[i + 1] - '0' : 0x0F;
+            *p++ = (unsigned char)((uHigh << 4) | ((pszNumber[i] - '0') & 0x0F));
+        }
+        
+        *p++ = 0x00;                                        // protocol identifier
+        *p++ = 0x00;                                        // data coding: GSM 7-bit default alphabet
+        
+        // user data length in septets (a 6 octet header takes 7 septets)
+        unsigned char *pUdl = p++;
+        if (m_rOutbox.parts() > 1)
+        {
+            uSeptets += 7;
+            *p++ = 0x05;                                    // header length
+            *p++ = 0x00;                                    // concatenated SMS, 8 bit reference
+            *p++ = 0x03;
+            *p++ = m_rOutbox.ref();
+            *p++ = m_rOutbox.parts();
+            *p++ = m_rOutbox.part();
+        }
+        
+        *pUdl = (unsigned char)uSeptets;
+        m_uPduHeaderSize = (unsigned char)(p - m_pduHeader);
+        m_uPduSize = (unsigned char)(pUdl + 1 - m_pduHeader + (uSeptets * 7 + 7) / 8);
+    }
+    
+    /// queue the transactions for sending the next part of the front outbox message (AT+CMGS takes the PDU size without the SMSC octet)
+    void sendNextMessage()
+    {
+        DEBUG_PRINT("sendMessage - ");
+        DEBUG_PRINTLN(m_rOutbox.number());
+        
+        // 'buildPdu()' has room for MAX_NUMBER_DIGITS digits (messages queued by 'pushTxMessageTxt()' are checked already)
+        if (validNumber(m_rOutbox.number()) == false)
+        {
+            DEBUG_PRINTLN("sendMessage - invalid number");
+            m_rOutbox.drop();
+            return;
+        }
+        
+        m_rOutbox.lockFront();
+        buildPdu();
+        pushSmsMode(ESM_PDU);
+        pushCommand("AT+CMGS=", ">", AT_PROMPT_TIMEOUT_MS, &GprsSms::onSendPromptDone, EAF_PARAM_INT | EAF_PROMPT, m_uPduSize - 1);
+    }
+    
+    /// '>' prompt received (or not), send the message text
+    void onSendPromptDone(eAtResult _eResult)
+    {
+        if (_eResult == EAR_OK)
+        {
+            pushCommand(NULL, "OK", AT_SEND_TIMEOUT_MS, &GprsSms::onSendDone, EAF_SMS_BODY, 0, true);
+        }
+        else
+        {
+            m_serial.write(0x1B);   // ESC, cancels message input
+            m_rOutbox.popPart(m_uTxPartLength, false);
+        }
+    }
+    
+    void onSendDone(eAtResult _eResult)
+    {
+        DEBUG_PRINTLN((_eResult == EAR_OK) ? "sendMessage - completed" : "sendMessage - failed");
+        
+        // journaled alerts are done once the module confirmed every part (alerts with a failed part stay in the journal)
+        bool bSent = (_eResult == EAR_OK) && (m_bCmgsSeen == true);
+        if ( (bSent == true) && (m_rOutbox.failed() == false) &&
+             (m_pJournal != NULL) && (m_rOutbox.journalOffset() != 0) && (m_rOutbox.journalOffset() != SmsOutbox::JOURNAL_PENDING) &&
+             (m_rOutbox.text()[m_uTxPartLength] == '\0') )
+        {
+            m_pJournal->ack(m_rOutbox.journalOffset(), m_rOutbox.journalSeq());
+        }
+        
+        m_rOutbox.popPart(m_uTxPartLength, bSent);
+    }
+    
+    /// periodic module test, reset module if it stops responding
+    void onTestDone(eAtResult /*_eResult*/)
+    {
+        if (m_iWaitFailCount > 3)
+        {
+            DEBUG_PRINTLN("update: cycling power...");
+            m_iWaitFailCount = 0;
+            powerDown();
+            powerUp();
+        }
+    }
+    
+    void onPowerUpTestDone(eAtResult _eResult)
+    {
+        if (_eResult != EAR_OK)
+        {
+            // switch on, turn echo off and wait a little for GPRS to initialise (ATE0 only counts as a failure if
+            // the module does not answer)
+            pushCommand(NULL, NULL, 3000, NULL, EAF_NONE, 0, true);
+            pushCommand("ATE0", "OK", 3000, NULL, EAF_NONE, 0, true);
+            pushPowerKeyPulse();
+        }
+    }
+    
+    void onPowerDownTestDone(eAtResult _eResult)
+    {
+        if (_eResult == EAR_OK)
+        {
+            pushPowerKeyPulse();
+        }
+    }
+    
   private:
     Stream					&m_serial;
     int						m_iPowerPin;
 	char					m_pszServiceText[SERVICE_TEXT_SIZE+1];
 	char					m_pszProviderText[PROVIDER_TEXT_SIZE+1];
-    char                    m_pScratch[SCRATCH_SIZE+1];                 ///< buffer used internally
-	unsigned long			m_uTxBusyTime;
+    LineReader<SCRATCH_SIZE> m_lineReader;                              ///< lines received from module
+	
+	Queue<sAtTransaction, AT_QUEUE_SIZE>	m_atQueue;					///< pending AT transactions
+	sAtTransaction			m_at;										///< active AT transaction
+	bool					m_bAtActive;
+	unsigned long			m_uAtStartTime;
+	unsigned int			m_uTxTextPos;								///< PDU octets written so far (0xFFFF when done)
+	unsigned char			m_pduHeader[PDU_HEADER_SIZE];				///< PDU of the message being sent, up to the packed text
+	unsigned char			m_uPduHeaderSize;
+	unsigned char			m_uPduSize;									///< PDU octets, including the SMSC octet
+	unsigned char			m_uTxPartLength;							///< characters of the outbox text in the part being sent
+	Gsm7Packer				m_packer;									///< packs the text of the message being sent
+	char					m_pszRxNumber[MAX_NUMBER_DIGITS+2];			///< number of the message being read
+	bool					m_bSmsTextNext;								///< next line is the text of the message being read
+	eSmsMode				m_eSmsMode;									///< message format once the queued transactions ran
+	unsigned char			m_uConcatRef;								///< reference number of the last concatenated SMS
 	
-	Queue<char, 8>          m_rxEventQueue;
-	Queue<sMessage, 4>		m_txMsgQueue;
-	Queue<sMessage, 4>		m_rxMsgQueue;
+	RingBuffer<char, 8>     m_rxEventQueue;							///< events of the lines from the module (new events are dropped while it is full)
+	SmsOutbox				&m_rOutbox;									///< messages to send, the front one is being sent
+	SmsJournal				*m_pJournal;								///< alerts that were not sent yet (may be NULL)
+	unsigned short			m_uRejectedCount;							///< messages that were not queued because of an invalid number
+	bool					m_bCmgsSeen;								///< '+CMGS:' received for the part being sent
+	RingBuffer<sMessage, 4>	m_rxMsgBuffer;
     
     int                     m_iWaitFailCount;
     unsigned long           m_uLastTestTime;
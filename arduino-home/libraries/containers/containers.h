@@ -1,15 +1,30 @@
 #ifndef CONTAINERS_H
 #define CONTAINERS_H
 #include <Arduino.h>
+#ifdef __AVR__
+#include <util/atomic.h>
+#endif
 
 
 
+/// block that runs with interrupts disabled on AVR (restores the previous interrupt state)
+#ifdef __AVR__
+#define CONTAINERS_ATOMIC       ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+#define CONTAINERS_ATOMIC
+#endif
+
+/// stops the compiler from moving memory accesses across this point
+#define CONTAINERS_BARRIER()    __asm__ __volatile__("" ::: "memory")
+
+
 /// Round up to next higher power of 2 (return s if it's already a power of 2).
 #define POW2SIZE(s) (((s-1) | ((s-1) >> 1) | ((s-1) >> 2) | ((s-1) >> 4) | ((s-1) >> 8)) + 1)
 
 
 
 /// ringbuffer queue. The ring buffer size will always be a power of 2 (pow2(S) <= size)
+/// Pushing to a full queue fails, it never overwrites unread items.
 template <typename T, size_t S>
 class Queue
 {
@@ -23,10 +38,30 @@ class Queue
     ~Queue()
     {}
     
-    void push(const T &_rData)
+    /// append item; returns false if the queue is full
+    bool push(const T &_rData)
     {
+        if (full() == true)
+        {
+            return false;
+        }
+        
         m_data[m_uEnd & m_uSizeMask] = _rData;
         m_uEnd++;
+        return true;
+    }
+    
+    /// insert in front of the queue, so that the item is popped next; returns false if the queue is full
+    bool pushFront(const T &_rData)
+    {
+        if (full() == true)
+        {
+            return false;
+        }
+        
+        m_uBegin--;
+        m_data[m_uBegin & m_uSizeMask] = _rData;
+        return true;
     }
     
     T &pop(T &_rData)
@@ -45,6 +80,17 @@ class Queue
         return m_uBegin == m_uEnd;
     }
     
+    bool full() const
+    {
+        return count() > m_uSizeMask;
+    }
+    
+    /// number of items in the queue
+    size_t count() const
+    {
+        return m_uEnd - m_uBegin;
+    }
+    
     size_t size() const {return m_uSizeMask+1;}
     
  private:
@@ -58,6 +104,288 @@ class Queue
 
 
 
+/// index type for RingBuffer: one byte (atomic on AVR) for up to 128 items, two bytes otherwise
+template <bool SMALL> struct RingIndex {typedef unsigned short type;};
+template <> struct RingIndex<true> {typedef unsigned char type;};
+
+
+/**
+  Lock-free single-producer/single-consumer ring buffer. The size will always be a power of 2 (pow2(S) <= size).
+  One side (e.g. an ISR) may only push and the other side (e.g. 'loop()') may only pop. Each index is written by
+  one side only and items are written before the index that publishes them, so no locking is needed; two byte
+  indices (more than 128 items) are accessed with interrupts disabled on AVR.
+  Pushing to a full buffer fails and is counted, it never overwrites unread items.
+  Large items can be filled in place with 'emplace()'/'commit()' and read in place with 'front()'/'pop()'.
+*/
+template <typename T, size_t S>
+class RingBuffer
+{
+ public:
+    typedef typename RingIndex<(POW2SIZE(S) <= 128)>::type index_t;
+    
+ public:
+    RingBuffer()
+        :m_uBegin(0),
+         m_uEnd(0),
+         m_uOverflowCount(0)
+    {}
+    
+    /// producer: copy item into the buffer; returns false (and counts an overflow) if the buffer is full
+    bool try_push(const T &_rData)
+    {
+        T *pSlot = emplace();
+        if (pSlot == NULL)
+        {
+            return false;
+        }
+        
+        *pSlot = _rData;
+        commit();
+        return true;
+    }
+    
+    /// producer: next free slot to be filled in place, or NULL (and counts an overflow) if the buffer is full
+    T *emplace()
+    {
+        index_t uEnd = m_uEnd;
+        if ((index_t)(uEnd - loadIndex(m_uBegin)) > SIZE_MASK)
+        {
+            if (m_uOverflowCount < 0xFFFF)
+            {
+                m_uOverflowCount++;
+            }
+            
+            return NULL;
+        }
+        
+        return &m_data[uEnd & SIZE_MASK];
+    }
+    
+    /// producer: publish the slot returned by 'emplace()'
+    void commit()
+    {
+        CONTAINERS_BARRIER();
+        storeIndex(m_uEnd, m_uEnd + 1);
+    }
+    
+    /// consumer: copy and remove the oldest item; returns false if the buffer is empty
+    bool try_pop(T &_rData)
+    {
+        T *pItem = front();
+        if (pItem == NULL)
+        {
+            return false;
+        }
+        
+        _rData = *pItem;
+        pop();
+        return true;
+    }
+    
+    /// consumer: oldest item (stays valid until 'pop()'), or NULL if the buffer is empty
+    T *front()
+    {
+        index_t uBegin = m_uBegin;
+        if (uBegin == loadIndex(m_uEnd))
+        {
+            return NULL;
+        }
+        
+        CONTAINERS_BARRIER();
+        return &m_data[uBegin & SIZE_MASK];
+    }
+    
+    /// consumer: remove the oldest item (call only if 'front()' returned an item)
+    void pop()
+    {
+        CONTAINERS_BARRIER();
+        storeIndex(m_uBegin, m_uBegin + 1);
+    }
+    
+    /// consumer: remove all items
+    void clear()
+    {
+        storeIndex(m_uBegin, loadIndex(m_uEnd));
+    }
+    
+    bool empty() const
+    {
+        return loadIndex(m_uBegin) == loadIndex(m_uEnd);
+    }
+    
+    /// number of items in the buffer (a snapshot if the other side is active)
+    size_t count() const
+    {
+        return (index_t)(loadIndex(m_uEnd) - loadIndex(m_uBegin));
+    }
+    
+    /// number of failed pushes since the last 'clearOverflowCount()'
+    unsigned short overflowCount() const {return m_uOverflowCount;}
+    void clearOverflowCount() {m_uOverflowCount = 0;}
+    
+    size_t size() const {return SIZE_MASK+1;}
+    
+ private:
+    static const index_t    SIZE_MASK = POW2SIZE(S)-1;
+    
+    static index_t loadIndex(const volatile index_t &_rIndex)
+    {
+        if (sizeof(index_t) == 1)
+        {
+            return _rIndex;
+        }
+        
+        index_t uIndex = 0;
+        CONTAINERS_ATOMIC
+        {
+            uIndex = _rIndex;
+        }
+        
+        return uIndex;
+    }
+    
+    static void storeIndex(volatile index_t &_rIndex, index_t _uValue)
+    {
+        if (sizeof(index_t) == 1)
+        {
+            _rIndex = _uValue;
+            return;
+        }
+        
+        CONTAINERS_ATOMIC
+        {
+            _rIndex = _uValue;
+        }
+    }
+    
+ private:
+    T                   m_data[POW2SIZE(S)];
+    volatile index_t    m_uBegin;
+    volatile index_t    m_uEnd;
+    volatile unsigned short m_uOverflowCount;
+};
+
+
+
+
+/**
+  Hashed timer wheel for N timers identified by their index (0 to N-1).
+  Each timer is linked into the slot of its deadline tick, so 'expire()' only looks at the slots of the ticks that
+  passed and at the current slot, not at all timers. Timers more than SLOTS ticks ahead stay in their slot for
+  further rounds. The wheel is safe across the millis() wrap. The slot count is a power of 2 (pow2(S) <= 255).
+*/
+template <size_t N, size_t S>
+class TimerWheel
+{
+ public:
+    typedef typename RingIndex<(N < 255)>::type index_t;
+    
+ public:
+    explicit TimerWheel(unsigned long _uTickMs)
+        :m_uTickMs(_uTickMs),
+         m_uTickStart(0),
+         m_uSlot(0)
+    {
+        memset(m_slots, 0, sizeof(m_slots));
+        memset(m_next, 0, sizeof(m_next));
+        memset(m_prev, 0, sizeof(m_prev));
+        memset(m_armed, 0, sizeof(m_armed));
+    }
+    
+    /// (re)arm timer '_uId' to expire at '_uDeadline' [ms]
+    void arm(size_t _uId, unsigned long _uDeadline)
+    {
+        cancel(_uId);
+        
+        unsigned long uAhead = ((long)(_uDeadline - m_uTickStart) > 0) ? (_uDeadline - m_uTickStart) / m_uTickMs : 0;
+        size_t uSlot = (m_uSlot + uAhead) & SLOT_MASK;
+        
+        m_deadlines[_uId] = _uDeadline;
+        m_prev[_uId] = 0;
+        m_next[_uId] = m_slots[uSlot];
+        if (m_slots[uSlot] != 0)
+        {
+            m_prev[m_slots[uSlot] - 1] = (index_t)(_uId + 1);
+        }
+        
+        m_slots[uSlot] = (index_t)(_uId + 1);
+        m_armed[_uId] = (unsigned char)(uSlot + 1);
+    }
+    
+    /// disarm timer '_uId' (does nothing if it is not armed)
+    void cancel(size_t _uId)
+    {
+        if (m_armed[_uId] == 0)
+        {
+            return;
+        }
+        
+        if (m_prev[_uId] != 0) m_next[m_prev[_uId] - 1] = m_next[_uId];
+        else m_slots[m_armed[_uId] - 1] = m_next[_uId];
+        
+        if (m_next[_uId] != 0) m_prev[m_next[_uId] - 1] = m_prev[_uId];
+        
+        m_armed[_uId] = 0;
+    }
+    
+    bool armed(size_t _uId) const {return m_armed[_uId] != 0;}
+    unsigned long deadline(size_t _uId) const {return m_deadlines[_uId];}
+    
+    /// disarms and returns the next timer that expired by '_uNow' [ms], or -1 if none (call until it returns -1)
+    int expire(unsigned long _uNow)
+    {
+        for (;;)
+        {
+            int iId = expireSlot(m_uSlot, _uNow);
+            if (iId >= 0)
+            {
+                return iId;
+            }
+            
+            // move on once the current tick has passed
+            if ((long)(_uNow - m_uTickStart) < (long)m_uTickMs)
+            {
+                return -1;
+            }
+            
+            m_uTickStart += m_uTickMs;
+            m_uSlot = (m_uSlot + 1) & SLOT_MASK;
+        }
+    }
+    
+    size_t size() const {return N;}
+    
+ private:
+    static const size_t     SLOT_MASK = POW2SIZE(S) - 1;
+    
+    /// disarms and returns a timer in '_uSlot' that expired by '_uNow', or -1
+    int expireSlot(size_t _uSlot, unsigned long _uNow)
+    {
+        for (index_t i = m_slots[_uSlot]; i != 0; i = m_next[i - 1])
+        {
+            if ((long)(_uNow - m_deadlines[i - 1]) >= 0)
+            {
+                cancel(i - 1);
+                return i - 1;
+            }
+        }
+        
+        return -1;
+    }
+    
+ private:
+    const unsigned long m_uTickMs;
+    unsigned long       m_uTickStart;                   ///< [ms] start of the current tick
+    size_t              m_uSlot;                        ///< slot of the current tick
+    index_t             m_slots[SLOT_MASK + 1];         ///< first timer (index+1) of each slot, 0 if empty
+    index_t             m_next[N];                      ///< next timer (index+1) in the same slot, 0 if last
+    index_t             m_prev[N];                      ///< previous timer (index+1) in the same slot, 0 if first
+    unsigned char       m_armed[N];                     ///< slot+1 of an armed timer, 0 if disarmed
+    unsigned long       m_deadlines[N];
+};
+
+
+
 
 #endif  // #ifndef CONTAINERS_H
 
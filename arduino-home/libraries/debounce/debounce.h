@@ -0,0 +1,115 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+#include <Arduino.h>
+#include <containers.h>
+
+
+
+/**
+  Debounces up to 8 digital inputs without waiting in interrupts.
+  The edge interrupt of an input only calls 'edge()', which timestamps the edge (every bounce restarts the settle
+  time). 'poll()' runs outside of interrupts: once an input has settled for the settle time, its level is read (a
+  direct port read on AVR) and the input is reported if it is at its active level. Inputs are independent, so edges
+  on several inputs at the same time are all reported.
+*/
+template <unsigned char N>
+class EdgeDebouncer
+{
+  public:
+    EdgeDebouncer(unsigned int _uSettleMs)
+        :m_uSettleMs(_uSettleMs),
+         m_uInputCount(0),
+         m_uPending(0)
+    {}
+
+    /// adds an input pin that is active at '_uActiveLevel' (HIGH or LOW), returns its index or -1 if full
+    int addInput(uint8_t _uPin, uint8_t _uActiveLevel)
+    {
+        if (m_uInputCount >= N)
+        {
+            return -1;
+        }
+
+        sInput &input = m_inputs[m_uInputCount];
+        input._uPin = _uPin;
+        input._uActiveLevel = _uActiveLevel;
+        input._uEdgeTime = 0;
+#ifdef __AVR__
+        input._pInputRegister = portInputRegister(digitalPinToPort(_uPin));
+        input._uBitMask = digitalPinToBitMask(_uPin);
+#endif
+        return m_uInputCount++;
+    }
+
+    /// records an edge of the input (call from its pin interrupt)
+    void edge(unsigned char _uInput)
+    {
+        m_inputs[_uInput]._uEdgeTime = millis();
+        m_uPending |= 1 << _uInput;
+    }
+
+    /// returns true if an input waits for its settle time (the caller has to keep polling)
+    bool pending() const {return m_uPending != 0;}
+
+    /// returns the bit mask of the inputs that settled at their active level since the last call
+    uint8_t poll()
+    {
+        uint8_t uActive = 0;
+        unsigned long uNow = millis();
+        for (unsigned char i = 0; i < m_uInputCount; i++)
+        {
+            bool bSettled = false;
+            CONTAINERS_ATOMIC
+            {
+                if ( ((m_uPending & (1 << i)) != 0) &&
+                     (uNow - m_inputs[i]._uEdgeTime >= m_uSettleMs) )
+                {
+                    m_uPending &= ~(1 << i);
+                    bSettled = true;
+                }
+            }
+
+            if ( (bSettled == true) && (level(i) == m_inputs[i]._uActiveLevel) )
+            {
+                uActive |= 1 << i;
+            }
+        }
+
+        return uActive;
+    }
+
+    /// drops pending edges
+    void clear() {m_uPending = 0;}
+
+  private:
+    struct sInput
+    {
+        uint8_t                 _uPin;
+        uint8_t                 _uActiveLevel;
+        volatile unsigned long  _uEdgeTime;         ///< [ms] time of the last edge
+#ifdef __AVR__
+        volatile uint8_t       *_pInputRegister;
+        uint8_t                 _uBitMask;
+#endif
+    };
+
+    uint8_t level(unsigned char _uInput) const
+    {
+#ifdef __AVR__
+        return ((*m_inputs[_uInput]._pInputRegister & m_inputs[_uInput]._uBitMask) != 0) ? HIGH : LOW;
+#else
+        return digitalRead(m_inputs[_uInput]._uPin);
+#endif
+    }
+
+  private:
+    const unsigned int      m_uSettleMs;
+    sInput                  m_inputs[N];
+    unsigned char           m_uInputCount;
+    volatile uint8_t        m_uPending;             ///< bit mask of the inputs that wait for their settle time
+};
+
+
+
+
+#endif  // #ifndef DEBOUNCE_H
@@ -21,6 +21,11 @@ struct sDeviceData
          _bTimeEvent(false),
          _bD2Event(false),
          _bD3Event(false),
+         _uD2Count(0),
+         _uD3Count(0),
+         _uEventSpan(0),
+         _uHeartbeat(0),
+         _uRetryCount(0),
          _uTimestamp(0)
 	{
         memset(_pszName, '\0', 10);
@@ -36,6 +41,11 @@ struct sDeviceData
          _bTimeEvent(_rValue._bTimeEvent),
          _bD2Event(_rValue._bD2Event),
          _bD3Event(_rValue._bD3Event),
+         _uD2Count(_rValue._uD2Count),
+         _uD3Count(_rValue._uD3Count),
+         _uEventSpan(_rValue._uEventSpan),
+         _uHeartbeat(_rValue._uHeartbeat),
+         _uRetryCount(_rValue._uRetryCount),
          _uTimestamp(_rValue._uTimestamp)
     {
         strncpy(_pszName, _rValue._pszName, 10);
@@ -55,18 +65,23 @@ struct sDeviceData
     bool              _bTimeEvent;
     bool              _bD2Event;
     bool              _bD3Event;
+    unsigned char     _uD2Count;        ///< D2 activations since the last update (saturates at 255)
+    unsigned char     _uD3Count;        ///< D3 activations since the last update (saturates at 255)
+    unsigned short    _uEventSpan;      ///< [s] time from the first to the last of these activations
+    unsigned short    _uHeartbeat;      ///< [s] current keepalive interval of the sensor (0 if unknown)
     
+    unsigned char     _uRetryCount;     ///< radio retransmissions since sensor start (saturates at 255)
     unsigned long     _uTimestamp;
 };
 
 
 
-/// creates a string from device data
-char *encodeDeviceData(char *_pszMessage, unsigned char _uSize, const sDeviceData &_rData)
+/// creates a display string from device data ('name,addr,prio x,bty Vb,chg Vc,temp C,count e,time,d2 count,d3 count,span s,retries r')
+char *formatDeviceData(char *_pszMessage, unsigned char _uSize, const sDeviceData &_rData)
 {
     _pszMessage[0] = '\0';
     snprintf(_pszMessage, _uSize,
-             "%s,%u,%ux,%uVb,%uVc,%uC,%ue,%u,%u,%u",
+             "%s,%u,%ux,%uVb,%uVc,%uC,%ue,%u,%u,%u,%us,%ur",
              _rData._pszName,
              _rData._uAddr,
              _rData._uPriority,
@@ -75,33 +90,350 @@ char *encodeDeviceData(char *_pszMessage, unsigned char _uSize, const sDeviceDat
              _rData._uTemperature,
              _rData._uEventCount,
              _rData._bTimeEvent ? 1 : 0,
-             _rData._bD2Event ? 1 : 0,
-             _rData._bD3Event ? 1 : 0);
+             _rData._uD2Count,
+             _rData._uD3Count,
+             _rData._uEventSpan,
+             _rData._uRetryCount);
     
     return _pszMessage;
 }
 
 
-/// creates a device data from a string
-sDeviceData &decodeDeviceData(sDeviceData &_rData, char *_pszMessage)
+
+/*
+  Binary radio frame for device data:
+    FLAG, LEN, PAYLOAD[LEN], CRC16 (big endian, CRC-16/CCITT over LEN and PAYLOAD)
+  with PAYLOAD (little endian) for EDF_STATUS and EDF_STATUS_NAME frames:
+    version << 4 | type, addr[2], event count[2], priority, bty voltage[2], chg voltage[2], temperature, event bits,
+    retry count, d2 count, d3 count, event span[2], heartbeat[2], name[0..9] (EDF_STATUS_NAME frames only, not '\0'
+    terminated)
+  and for EDF_ACK frames (base station to sensor):
+    version << 4 | type, addr[2], event count[2] (of the acknowledged status frame), link (RSSI of the status frame
+    at the base station [-dBm], 0 if unknown)
+  FLAG only appears at the start of a frame: FLAG and ESC bytes after it are sent as ESC, byte ^ 0x20, so a reader
+  can resync on any FLAG in a transparent radio stream.
+  Each version only appended fields to the previous one, so frames of older versions are still read:
+    1: status up to event bits (12 bytes), no acks
+    2: + retry count (13 bytes), acks without link (5 bytes)
+    3: + d2 count, d3 count, event span (17 bytes)
+    4: + heartbeat (19 bytes), acks with link (6 bytes)
+  Missing fields are decoded as defaults and acks are sent in the version of the acknowledged status frame, so the
+  base station can be updated first and the sensors one at a time. Frames of unknown versions are dropped and counted.
+*/
+const unsigned char     DEVICE_FRAME_FLAG           = 0x7E;
+const unsigned char     DEVICE_FRAME_ESC            = 0x7D;
+const unsigned char     DEVICE_FRAME_VERSION        = 4;
+const unsigned char     DEVICE_FRAME_MIN_SIZE       = 5;                                    ///< smallest payload (version 2 ack)
+const unsigned char     DEVICE_FRAME_ACK_SIZE       = 6;                                    ///< ack payload size
+const unsigned char     DEVICE_FRAME_STATUS_SIZE    = 19;                                   ///< status payload size without name
+const unsigned char     DEVICE_FRAME_PAYLOAD_SIZE   = DEVICE_FRAME_STATUS_SIZE + 9;         ///< maximum payload size
+const unsigned char     DEVICE_FRAME_MAX_SIZE       = 1 + 2 * (1 + DEVICE_FRAME_PAYLOAD_SIZE + 2);  ///< worst case encoded size
+
+enum eDeviceFrameType
 {
-    strncpy(_rData._pszName, strtok(_pszMessage, ","), 10);
-	_rData._pszName[9] = '\0';
-	
-    _rData._uAddr = atoi(strtok(NULL, ","));
-    _rData._uPriority = atoi(strtok(NULL, ","));
-    _rData._uBtyVoltage = atoi(strtok(NULL, ","));
-    _rData._uChgVoltage = atoi(strtok(NULL, ","));
-    _rData._uTemperature = atoi(strtok(NULL, ","));
-    _rData._uEventCount = atoi(strtok(NULL, ","));
-    _rData._bTimeEvent = atoi(strtok(NULL, ",")) == 1;
-    _rData._bD2Event = atoi(strtok(NULL, ",")) == 1;
-    _rData._bD3Event = atoi(strtok(NULL, ",")) == 1;
-    
-    return _rData;
+    EDF_STATUS = 1,             ///< status update
+    EDF_STATUS_NAME,            ///< status update with sensor name
+    EDF_ACK,                    ///< status update received by the base station
+};
+
+enum eDeviceEventBits
+{
+    EDE_TIME = 0x01,
+    EDE_D2 = 0x02,
+    EDE_D3 = 0x04,
+};
+
+
+/// status payload size without name of the given frame version (0 if the version is unknown)
+inline unsigned char deviceFrameStatusSize(unsigned char _uVersion)
+{
+    static const unsigned char sizes[DEVICE_FRAME_VERSION] = {12, 13, 17, DEVICE_FRAME_STATUS_SIZE};
+    return ( (_uVersion >= 1) && (_uVersion <= DEVICE_FRAME_VERSION) ) ? sizes[_uVersion - 1] : 0;
+}
+
+
+/// ack payload size of the given frame version (0 if the version has no acks)
+inline unsigned char deviceFrameAckSize(unsigned char _uVersion)
+{
+    return ( (_uVersion < 2) || (_uVersion > DEVICE_FRAME_VERSION) ) ? 0 : (_uVersion < 4) ? 5 : DEVICE_FRAME_ACK_SIZE;
+}
+
+
+/// writes one frame byte, escaped if required
+inline unsigned char putDeviceFrameByte(unsigned char *_pFrame, unsigned char _uPos, unsigned char _uByte)
+{
+    if ( (_uByte == DEVICE_FRAME_FLAG) ||
+         (_uByte == DEVICE_FRAME_ESC) )
+    {
+        _pFrame[_uPos++] = DEVICE_FRAME_ESC;
+        _uByte ^= 0x20;
+    }
+    
+    _pFrame[_uPos++] = _uByte;
+    return _uPos;
+}
+
+
+/// frames the payload (buffer must hold DEVICE_FRAME_MAX_SIZE bytes) and returns the frame size
+unsigned char encodeFrame(unsigned char *_pFrame, const unsigned char *_pPayload, unsigned char _uLen)
+{
+    unsigned short uCrc = crc16Update(0xFFFF, _uLen);
+    unsigned char n = 0;
+    _pFrame[n++] = DEVICE_FRAME_FLAG;
+    n = putDeviceFrameByte(_pFrame, n, _uLen);
+    
+    for (unsigned char i = 0; i < _uLen; i++)
+    {
+        uCrc = crc16Update(uCrc, _pPayload[i]);
+        n = putDeviceFrameByte(_pFrame, n, _pPayload[i]);
+    }
+    
+    n = putDeviceFrameByte(_pFrame, n, uCrc >> 8);
+    n = putDeviceFrameByte(_pFrame, n, uCrc & 0xFF);
+    return n;
+}
+
+
+/// creates a binary frame from device data (buffer must hold DEVICE_FRAME_MAX_SIZE bytes) and returns its size
+unsigned char encodeDeviceFrame(unsigned char *_pFrame, const sDeviceData &_rData, bool _bName)
+{
+    unsigned char payload[DEVICE_FRAME_PAYLOAD_SIZE];
+    unsigned char uLen = 0;
+    
+    payload[uLen++] = (DEVICE_FRAME_VERSION << 4) | (_bName ? EDF_STATUS_NAME : EDF_STATUS);
+    payload[uLen++] = _rData._uAddr & 0xFF;
+    payload[uLen++] = _rData._uAddr >> 8;
+    payload[uLen++] = _rData._uEventCount & 0xFF;
+    payload[uLen++] = _rData._uEventCount >> 8;
+    payload[uLen++] = _rData._uPriority;
+    payload[uLen++] = _rData._uBtyVoltage & 0xFF;
+    payload[uLen++] = _rData._uBtyVoltage >> 8;
+    payload[uLen++] = _rData._uChgVoltage & 0xFF;
+    payload[uLen++] = _rData._uChgVoltage >> 8;
+    payload[uLen++] = _rData._uTemperature;
+    payload[uLen++] = (_rData._bTimeEvent ? EDE_TIME : 0) | (_rData._bD2Event ? EDE_D2 : 0) | (_rData._bD3Event ? EDE_D3 : 0);
+    payload[uLen++] = _rData._uRetryCount;
+    payload[uLen++] = _rData._uD2Count;
+    payload[uLen++] = _rData._uD3Count;
+    payload[uLen++] = _rData._uEventSpan & 0xFF;
+    payload[uLen++] = _rData._uEventSpan >> 8;
+    payload[uLen++] = _rData._uHeartbeat & 0xFF;
+    payload[uLen++] = _rData._uHeartbeat >> 8;
+    
+    if (_bName == true)
+    {
+        for (unsigned char i = 0; (i < 9) && (_rData._pszName[i] != '\0'); i++)
+        {
+            payload[uLen++] = _rData._pszName[i];
+        }
+    }
+    
+    return encodeFrame(_pFrame, payload, uLen);
+}
+
+
+/// creates an ack frame for the status frame with the given address and event count and returns its size ('_uLink'
+/// is the RSSI [-dBm] the status frame was received with, 0 if unknown; '_uVersion' is the version of the status
+/// frame, 0 is returned if that version has no acks)
+unsigned char encodeAckFrame(unsigned char *_pFrame, unsigned short _uAddr, unsigned short _uEventCount, unsigned char _uLink,
+                             unsigned char _uVersion = DEVICE_FRAME_VERSION)
+{
+    unsigned char payload[DEVICE_FRAME_ACK_SIZE] =
+    {
+        (unsigned char)((_uVersion << 4) | EDF_ACK),
+        (unsigned char)(_uAddr & 0xFF), (unsigned char)(_uAddr >> 8),
+        (unsigned char)(_uEventCount & 0xFF), (unsigned char)(_uEventCount >> 8),
+        _uLink
+    };
+    
+    unsigned char uSize = deviceFrameAckSize(_uVersion);
+    return (uSize > 0) ? encodeFrame(_pFrame, payload, uSize) : 0;
 }
 
 
+/**
+  Non-blocking reader for device data and ack frames.
+  Only consumes the bytes that are available when 'poll()' is called. Frames with a bad length, CRC, version or
+  type are dropped and counted (unknown versions are counted separately as well). Frames of older versions are
+  accepted. The last valid frame stays valid until the next byte is read.
+*/
+class DeviceFrameReader
+{
+ public:
+    DeviceFrameReader(Stream &_rSerial)
+        :m_serial(_rSerial),
+         m_iPos(-1),
+         m_bEscape(false),
+         m_uErrorCount(0),
+         m_uVersionErrorCount(0)
+    {}
+    
+    /// read available bytes until a frame is complete; returns true if a valid frame was read (see 'type()')
+    bool poll()
+    {
+        while (m_serial.available() > 0)
+        {
+            if (put(m_serial.read()) == true)
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    /// read available bytes until a status frame is complete; returns true and fills '_rData' if one was read (acks are skipped)
+    bool poll(sDeviceData &_rData)
+    {
+        while (poll() == true)
+        {
+            if (type() != EDF_ACK)
+            {
+                decode(_rData);
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    /// process one received byte; returns true if it completed a valid frame
+    bool put(unsigned char _uByte)
+    {
+        if (_uByte == DEVICE_FRAME_FLAG)
+        {
+            if (m_iPos > 0)
+            {
+                m_uErrorCount++;    // incomplete frame
+            }
+            
+            m_iPos = 0;
+            m_bEscape = false;
+            return false;
+        }
+        
+        if (m_iPos < 0)
+        {
+            return false;           // waiting for start of frame
+        }
+        
+        if (_uByte == DEVICE_FRAME_ESC)
+        {
+            m_bEscape = true;
+            return false;
+        }
+        
+        if (m_bEscape == true)
+        {
+            _uByte ^= 0x20;
+            m_bEscape = false;
+        }
+        
+        // length, payload, CRC
+        m_frame[m_iPos++] = _uByte;
+        if ( (m_frame[0] < DEVICE_FRAME_MIN_SIZE) ||
+             (m_frame[0] > DEVICE_FRAME_PAYLOAD_SIZE) )
+        {
+            m_uErrorCount++;
+            m_iPos = -1;
+            return false;
+        }
+        
+        if (m_iPos < m_frame[0] + 3)
+        {
+            return false;
+        }
+        
+        m_iPos = -1;
+        
+        unsigned short uCrc = 0xFFFF;
+        for (int i = 0; i < m_frame[0] + 1; i++)
+        {
+            uCrc = crc16Update(uCrc, m_frame[i]);
+        }
+        
+        if (uCrc != ((m_frame[m_frame[0] + 1] << 8) | m_frame[m_frame[0] + 2]))
+        {
+            m_uErrorCount++;
+            return false;
+        }
+        
+        unsigned char uType = type();
+        unsigned char uStatusSize = deviceFrameStatusSize(version());
+        if (uStatusSize == 0)
+        {
+            m_uErrorCount++;
+            m_uVersionErrorCount++;
+            return false;
+        }
+        
+        if ( ( (uType == EDF_ACK) && (m_frame[0] != deviceFrameAckSize(version())) ) ||
+             ( (uType != EDF_ACK) && ( (uType < EDF_STATUS) || (uType > EDF_STATUS_NAME) || (m_frame[0] < uStatusSize) ||
+                                       (m_frame[0] > uStatusSize + 9) ) ) )
+        {
+            m_uErrorCount++;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    /// copy the last valid frame to '_rData' (the name is left empty if the frame has none, fields that the frame
+    /// version has no room for are set to defaults)
+    sDeviceData &decode(sDeviceData &_rData) const
+    {
+        const unsigned char *p = m_frame + 2;
+        unsigned char uStatusSize = deviceFrameStatusSize(version());
+        _rData._uAddr = p[0] | (p[1] << 8);
+        _rData._uEventCount = p[2] | (p[3] << 8);
+        _rData._uPriority = p[4];
+        _rData._uBtyVoltage = p[5] | (p[6] << 8);
+        _rData._uChgVoltage = p[7] | (p[8] << 8);
+        _rData._uTemperature = p[9];
+        _rData._bTimeEvent = (p[10] & EDE_TIME) != 0;
+        _rData._bD2Event = (p[10] & EDE_D2) != 0;
+        _rData._bD3Event = (p[10] & EDE_D3) != 0;
+        _rData._uRetryCount = (uStatusSize > 12) ? p[11] : 0;
+        _rData._uD2Count = (uStatusSize > 13) ? p[12] : _rData._bD2Event ? 1 : 0;
+        _rData._uD3Count = (uStatusSize > 13) ? p[13] : _rData._bD3Event ? 1 : 0;
+        _rData._uEventSpan = (uStatusSize > 13) ? p[14] | (p[15] << 8) : 0;
+        _rData._uHeartbeat = (uStatusSize > 17) ? p[16] | (p[17] << 8) : 0;       // 0 falls back to the default timeout
+        
+        unsigned char uNameLen = m_frame[0] - uStatusSize;
+        memcpy(_rData._pszName, p + uStatusSize - 1, uNameLen);
+        _rData._pszName[uNameLen] = '\0';
+        
+        return _rData;
+    }
+    
+    /// type and version of the last valid frame
+    eDeviceFrameType type() const {return (eDeviceFrameType)(m_frame[1] & 0x0F);}
+    unsigned char version() const {return m_frame[1] >> 4;}
+    
+    /// address and event count of the last valid frame (status or ack)
+    unsigned short addr() const {return m_frame[2] | (m_frame[3] << 8);}
+    unsigned short eventCount() const {return m_frame[4] | (m_frame[5] << 8);}
+    
+    /// link reported by the last valid ack frame (RSSI at the base station [-dBm], 0 if unknown)
+    unsigned char link() const {return (m_frame[0] > 5) ? m_frame[6] : 0;}
+    
+    /// number of frames dropped (bad length, CRC, version or type)
+    unsigned short errorCount() const {return m_uErrorCount;}
+    
+    /// number of frames dropped because of an unknown version (sent by newer firmware)
+    unsigned short versionErrorCount() const {return m_uVersionErrorCount;}
+    
+ private:
+    Stream                  &m_serial;
+    unsigned char           m_frame[1 + DEVICE_FRAME_PAYLOAD_SIZE + 2];     ///< LEN, PAYLOAD, CRC
+    int                     m_iPos;                                         ///< next frame byte (-1 while waiting for FLAG)
+    bool                    m_bEscape;
+    unsigned short          m_uErrorCount;
+    unsigned short          m_uVersionErrorCount;
+};
+
+
+
 /// device config reading and storing
 class DeviceConfig
 {
@@ -143,6 +475,13 @@ class DeviceConfig
             m_config._uPriority = 0;
             m_config._pszName[0] = '\0';
         }
+        
+        // runtime counters, not part of the stored config
+        m_config._uRetryCount = 0;
+        m_config._uD2Count = 0;
+        m_config._uD3Count = 0;
+        m_config._uEventSpan = 0;
+        m_config._uHeartbeat = 0;
     }
     
     
@@ -221,20 +560,20 @@ class DeviceConfig
         bool bConfigChanged = false;
         digitalWrite(m_iStatusPin, HIGH);
         
-        // read command lines until a empty line is received
-        char pszCmdBuffer[256];
-        unsigned int n = ::readln(m_serial, pszCmdBuffer, 255, _uWaitTime, false);
-        while (n > 0)
+        // read command lines until no line is received for _uWaitTime
+        LineReader<255> lineReader(m_serial, _uWaitTime);
+        for (unsigned long t = millis(); millis() - t < _uWaitTime;)
         {
-            pszCmdBuffer[n] = '\0';
-            bConfigChanged |= processConfigCommand(pszCmdBuffer);
-            
-            n = ::readln(m_serial, pszCmdBuffer, 255, _uWaitTime, false);
+            if (lineReader.readln() > 0)
+            {
+                bConfigChanged |= processConfigCommand(lineReader.line());
+                t = millis();
+            }
         }
         
         // flush all remaining rx data from radio
         digitalWrite(m_iStatusPin, LOW);
-        ::flush(m_serial);
+        lineReader.discard();
         return bConfigChanged;
     }
     
@@ -0,0 +1,214 @@
+#ifndef FIXEDPOINT_H
+#define FIXEDPOINT_H
+#include <Arduino.h>
+
+
+
+/// Q16 factor for scaling ADC counts (computed at compile time, no floating point code is generated at run time)
+constexpr unsigned long adcScaleQ16(double _dUnitsPerCount)
+{
+    return (unsigned long)(_dUnitsPerCount * 65536.0 + 0.5);
+}
+
+/// Q16 factor for an ADC input behind a voltage divider, in [mV] per count
+constexpr unsigned long adcMilliVoltsQ16(double _dVccMilliVolts, double _dDivider)
+{
+    return adcScaleQ16(_dVccMilliVolts / 1023.0 / _dDivider);
+}
+
+/// scale ADC counts (0 to 1023) with a Q16 factor from 'adcScaleQ16()' (factors up to 4M, i.e. 64 units per count)
+inline unsigned long scaleAdc(unsigned int _uCounts, unsigned long _uScaleQ16)
+{
+    return ((unsigned long)_uCounts * _uScaleQ16 + 0x8000ul) >> 16;
+}
+
+
+
+/**
+  Exponential moving average with a smoothing factor of 1/2^SHIFT, kept in Q(SHIFT) (input values must fit in
+  31-SHIFT bits). The first value initialises the average.
+*/
+template <unsigned char SHIFT>
+class EmaFilter
+{
+  public:
+    EmaFilter()
+        :m_iAcc(0),
+         m_bValid(false)
+    {}
+
+    /// add a value and return the new (rounded) average
+    long update(long _iValue)
+    {
+        if (m_bValid == false)
+        {
+            reset(_iValue);
+        }
+        else
+        {
+            m_iAcc += _iValue - (m_iAcc >> SHIFT);
+        }
+
+        return value();
+    }
+
+    void reset(long _iValue)
+    {
+        m_iAcc = _iValue << SHIFT;
+        m_bValid = true;
+    }
+
+    long value() const {return (m_iAcc + (1l << SHIFT >> 1)) >> SHIFT;}
+    bool valid() const {return m_bValid;}
+
+  private:
+    long                m_iAcc;             ///< average << SHIFT
+    bool                m_bValid;
+};
+
+
+
+/**
+  Tracks the maximum of the values; the maximum decays towards the current value by 1/2^SHIFT per update
+  (SHIFT 0 disables the decay). The first value initialises the maximum.
+*/
+template <unsigned char SHIFT>
+class MaxTracker
+{
+  public:
+    MaxTracker()
+        :m_iAcc(0),
+         m_bValid(false)
+    {}
+
+    long update(long _iValue)
+    {
+        long iValue = _iValue << SHIFT;
+        if ( (m_bValid == false) || (iValue > m_iAcc) )
+        {
+            m_iAcc = iValue;
+            m_bValid = true;
+        }
+        else if (SHIFT > 0)
+        {
+            m_iAcc += (iValue - m_iAcc) >> SHIFT;
+        }
+
+        return value();
+    }
+
+    void reset(long _iValue)
+    {
+        m_iAcc = _iValue << SHIFT;
+        m_bValid = true;
+    }
+
+    long value() const {return m_iAcc >> SHIFT;}
+
+  private:
+    long                m_iAcc;             ///< maximum << SHIFT
+    bool                m_bValid;
+};
+
+
+
+/**
+  Tracks the minimum of the values; the minimum decays towards the current value by 1/2^SHIFT per update
+  (SHIFT 0 disables the decay). The first value initialises the minimum.
+*/
+template <unsigned char SHIFT>
+class MinTracker
+{
+  public:
+    MinTracker()
+        :m_iAcc(0),
+         m_bValid(false)
+    {}
+
+    long update(long _iValue)
+    {
+        long iValue = _iValue << SHIFT;
+        if ( (m_bValid == false) || (iValue < m_iAcc) )
+        {
+            m_iAcc = iValue;
+            m_bValid = true;
+        }
+        else if (SHIFT > 0)
+        {
+            m_iAcc += (iValue - m_iAcc) >> SHIFT;
+        }
+
+        return value();
+    }
+
+    void reset(long _iValue)
+    {
+        m_iAcc = _iValue << SHIFT;
+        m_bValid = true;
+    }
+
+    long value() const {return m_iAcc >> SHIFT;}
+
+  private:
+    long                m_iAcc;             ///< minimum << SHIFT
+    bool                m_bValid;
+};
+
+
+
+/**
+  Hysteresis comparator against a tracked reference: while high, the reference follows the (decaying) maximum and
+  the comparator goes low once the value falls '_iFall' below it; while low, the reference follows the minimum and
+  the comparator goes high once the value rises '_iRise' above it. Starts high at the first value.
+*/
+template <unsigned char DECAY_SHIFT>
+class TrackingComparator
+{
+  public:
+    TrackingComparator(long _iFall, long _iRise)
+        :m_iFall(_iFall),
+         m_iRise(_iRise),
+         m_bHigh(true)
+    {}
+
+    /// add a value, returns true if the state changed
+    bool update(long _iValue)
+    {
+        if (m_bHigh == true)
+        {
+            if (m_max.update(_iValue) - _iValue > m_iFall)
+            {
+                m_bHigh = false;
+                m_min.reset(_iValue);
+                return true;
+            }
+        }
+        else
+        {
+            if (_iValue - m_min.update(_iValue) > m_iRise)
+            {
+                m_bHigh = true;
+                m_max.reset(_iValue);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool high() const {return m_bHigh;}
+    long reference() const {return (m_bHigh == true) ? m_max.value() : m_min.value();}
+
+  private:
+    const long              m_iFall;
+    const long              m_iRise;
+    bool                    m_bHigh;
+    MaxTracker<DECAY_SHIFT> m_max;
+    MinTracker<0>           m_min;
+};
+
+
+
+
+#endif  // #ifndef FIXEDPOINT_H
+
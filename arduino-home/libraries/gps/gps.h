@@ -1,34 +1,41 @@
-
+#ifndef GPS_H
+#define GPS_H
 #include <Arduino.h>
-#include <serialio.h>
 
 
+/**
+  GPS module with a streaming NMEA parser.
+  Bytes are parsed as they arrive, without a line buffer: the checksum is accumulated while the fields of RMC and GGA
+  sentences (of any talker) are decoded into pending values, which are only taken over once the '*hh' checksum of the
+  sentence matched. Positions are fixed point in 1e-7 degrees (north and east are positive).
+*/
 class Gps
 {
  public:
     Gps(Stream &_rSerial, int _iSleepPin)
         :m_serial(_rSerial),
          m_iSleepPin(_iSleepPin),
-         m_bSleeping(false)
+         m_bSleeping(false),
+         m_eState(ENS_IDLE),
+         m_uErrorCount(0)
     {
-        m_pszTime[0] = '\0';
-        m_pszLatitude[0] = '\0';
-        m_pszLongitude[0] = '\0';
-        
+        memset(&m_fix, 0, sizeof(m_fix));
+        memset(&m_pending, 0, sizeof(m_pending));
+
         pinMode(m_iSleepPin, OUTPUT);
         digitalWrite(m_iSleepPin, HIGH);
-        
+
         setup();
     }
-    
+
     void setup()
     {
         m_serial.print("$PMTK220,1000*1F\r\n");         // set GPS update rate to 1000ms
         delay(200);
-        m_serial.print("$PGCMD,16,1,0,0,0,0*6B\r\n");   // enable only RMC string
+        m_serial.print("$PMTK314,0,1,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0*28\r\n");   // enable only RMC and GGA strings
         delay(200);
     }
-    
+
     /// sleep or wake-up GPS
     void sleep(bool _bState)
     {
@@ -42,53 +49,343 @@ class Gps
             digitalWrite(m_iSleepPin, LOW);
         }
     }
-    
-    /// read and process all data from GPS (returns true if new data was received)
+
+    /// process the available bytes from GPS (does not wait), returns true if an RMC or GGA sentence was received
     bool read()
     {
         bool bRx = false;
-        int n = 0;
-        while ((n = readln(m_serial, m_pszNmea, 255, 10)) > 0)
+        while (m_serial.available() > 0)
+        {
+            bRx |= put(m_serial.read());
+        }
+
+        return bRx;
+    }
+
+    /// process one received byte, returns true if it completed a valid RMC or GGA sentence
+    bool put(char _ch)
+    {
+        if (_ch == '$')
         {
-            m_pszNmea[n] = '\0';
-            
-            // decode RMC string
-            if (strncmp(m_pszNmea, "$GPRMC", 6) == 0)
+            if (m_eState != ENS_IDLE)
             {
-                strncpy(m_pszTime, m_pszNmea+7, 6);
-                m_pszTime[6] = '\0';
-                    
-                m_pszLatitude[0] = m_pszNmea[30];
-                strncpy(m_pszLatitude+1, m_pszNmea+20, 10);
-                m_pszLatitude[10] = '\0';
-                    
-                m_pszLongitude[0] = m_pszNmea[43];
-                strncpy(m_pszLongitude+1, m_pszNmea+32, 11);
-                m_pszLongitude[11] = '\0';
-                
-                bRx = true;
+                m_uErrorCount++;    // incomplete sentence
             }
+
+            m_eState = ENS_FIELD;
+            m_uChecksum = 0;
+            m_uLength = 0;
+            m_uType = 0;
+            m_uField = 0;
+            m_pending._uFlags = 0;
+            beginField();
+            return false;
+        }
+
+        switch (m_eState)
+        {
+            case ENS_FIELD:
+                if ( (++m_uLength > NMEA_MAX_LENGTH) || (_ch == '\r') || (_ch == '\n') )
+                {
+                    m_uErrorCount++;    // too long or no checksum
+                    m_eState = ENS_IDLE;
+                }
+                else if (_ch == '*')
+                {
+                    endField();
+                    m_eState = ENS_CHECKSUM_HI;
+                }
+                else
+                {
+                    m_uChecksum ^= (unsigned char)_ch;
+                    if (_ch == ',')
+                    {
+                        endField();
+                        m_uField++;
+                        beginField();
+                    }
+                    else
+                    {
+                        fieldChar(_ch);
+                    }
+                }
+                return false;
+
+            case ENS_CHECKSUM_HI:
+            case ENS_CHECKSUM_LO:
+            {
+                int iDigit = hexDigit(_ch);
+                if (iDigit < 0)
+                {
+                    m_uErrorCount++;
+                    m_eState = ENS_IDLE;
+                    return false;
+                }
+
+                if (m_eState == ENS_CHECKSUM_HI)
+                {
+                    m_uChecksum ^= iDigit << 4;
+                    m_eState = ENS_CHECKSUM_LO;
+                    return false;
+                }
+
+                m_eState = ENS_IDLE;
+                if ((m_uChecksum ^ iDigit) != 0)
+                {
+                    m_uErrorCount++;
+                    return false;
+                }
+
+                return commit();
+            }
+
+            default:
+                return false;       // waiting for the start of a sentence
         }
-        
-        return bRx;
     }
-    
+
     bool sleeping() const {return m_bSleeping;}
-    const char *timeString() const {return m_pszTime;}
-    const char *latitudeString() const {return m_pszLatitude;}
-    const char *longitudeString() const {return m_pszLongitude;}
-    
+
+    /// RMC status is active (the position is valid)
+    bool valid() const {return (m_fix._uFlags & ENF_VALID) != 0;}
+
+    /// latitude and longitude of the last sentence that had a position [1e-7 deg]
+    long latitude() const {return m_fix._iLatitude;}
+    long longitude() const {return m_fix._iLongitude;}
+
+    /// UTC time of day [s] and date (ddmmyy) of the last sentences that had them
+    unsigned long time() const {return m_fix._uTime;}
+    unsigned long date() const {return m_fix._uDate;}
+
+    /// fix quality (0 none, 1 GPS, 2 DGPS, ...) and number of satellites used, from the last GGA sentence
+    unsigned char fixQuality() const {return m_fix._uQuality;}
+    unsigned char satellites() const {return m_fix._uSatellites;}
+
+    /// number of sentences dropped (bad checksum, missing checksum, too long or incomplete)
+    unsigned short errorCount() const {return m_uErrorCount;}
+
  private:
-    Stream     &m_serial;
-    int        m_iSleepPin;
-    bool       m_bSleeping;
-    
-    char       m_pszNmea[256];
-    char       m_pszTime[7];
-    char       m_pszLatitude[11];
-    char       m_pszLongitude[12];
-};
+    static const unsigned char  NMEA_MAX_LENGTH = 82;       ///< maximum sentence length from '$' to the end
+    static const unsigned char  FRACTION_DIGITS = 5;        ///< fraction digits kept of a field
+
+    enum eNmeaState
+    {
+        ENS_IDLE = 0,           ///< waiting for '$'
+        ENS_FIELD,              ///< in the comma separated fields
+        ENS_CHECKSUM_HI,
+        ENS_CHECKSUM_LO
+    };
+
+    /// sentence types (last 3 characters of the address field)
+    enum eNmeaType
+    {
+        ENT_RMC = ((unsigned long)'R' << 16) | ('M' << 8) | 'C',
+        ENT_GGA = ((unsigned long)'G' << 16) | ('G' << 8) | 'A'
+    };
+
+    /// values of a sentence that were received
+    enum eNmeaFlags
+    {
+        ENF_VALID = 0x01,       ///< RMC status is 'A'
+        ENF_STATUS = 0x02,
+        ENF_TIME = 0x04,
+        ENF_DATE = 0x08,
+        ENF_QUALITY = 0x10,     ///< fix quality
+        ENF_LATITUDE = 0x20,
+        ENF_LONGITUDE = 0x40
+    };
+
+    struct sFix
+    {
+        long                _iLatitude;
+        long                _iLongitude;
+        unsigned long       _uTime;
+        unsigned long       _uDate;
+        unsigned char       _uQuality;
+        unsigned char       _uSatellites;
+        unsigned char       _uFlags;        ///< eNmeaFlags
+    };
+
+    static int hexDigit(char _ch)
+    {
+        if ( (_ch >= '0') && (_ch <= '9') ) return _ch - '0';
+        if ( (_ch >= 'A') && (_ch <= 'F') ) return _ch - 'A' + 10;
+        if ( (_ch >= 'a') && (_ch <= 'f') ) return _ch - 'a' + 10;
+        return -1;
+    }
+
+    void beginField()
+    {
+        m_uInteger = 0;
+        m_uFraction = 0;
+        m_uFractionDigits = 0;
+        m_bFraction = false;
+        m_bEmpty = true;
+        m_cLetter = '\0';
+    }
+
+    void fieldChar(char _ch)
+    {
+        m_bEmpty = false;
+        if (m_uField == 0)
+        {
+            m_uType = ((m_uType << 8) | (unsigned char)_ch) & 0xFFFFFFul;
+        }
+        else if ( (_ch >= '0') && (_ch <= '9') )
+        {
+            if (m_bFraction == false)
+            {
+                m_uInteger = m_uInteger * 10 + (_ch - '0');
+            }
+            else if (m_uFractionDigits < FRACTION_DIGITS)
+            {
+                m_uFraction = m_uFraction * 10 + (_ch - '0');
+                m_uFractionDigits++;
+            }
+        }
+        else if (_ch == '.')
+        {
+            m_bFraction = true;
+        }
+        else
+        {
+            m_cLetter = _ch;
+        }
+    }
+
+    /// (d)ddmm.mmmmm of the current field in 1e-7 degrees
+    long coordinate() const
+    {
+        unsigned long uFraction = m_uFraction;
+        for (unsigned char i = m_uFractionDigits; i < FRACTION_DIGITS; i++)
+        {
+            uFraction *= 10;
+        }
+
+        // 1e-5 minutes are 5/3 of 1e-7 degrees (rounded to the nearest unit)
+        unsigned long uMinutes = (m_uInteger % 100) * 100000ul + uFraction;
+        return (long)((m_uInteger / 100) * 10000000ul + (uMinutes * 5 + 1) / 3);
+    }
+
+    /// stores the current field of an RMC or GGA sentence in the pending values
+    void endField()
+    {
+        if ( (m_bEmpty == true) || (m_uField == 0) )
+        {
+            return;
+        }
+
+        // field number of the GGA fields in an RMC sentence (time and position are at the same place plus one)
+        unsigned char uField = m_uField;
+        if (m_uType == ENT_RMC)
+        {
+            if (uField == 2)
+            {
+                m_pending._uFlags |= ENF_STATUS | ((m_cLetter == 'A') ? ENF_VALID : 0);
+                return;
+            }
+
+            if (uField == 9)
+            {
+                m_pending._uDate = m_uInteger;
+                m_pending._uFlags |= ENF_DATE;
+                return;
+            }
+
+            if ( (uField > 2) && (uField < 7) )
+            {
+                uField--;
+            }
+            else if (uField != 1)
+            {
+                return;
+            }
+        }
+        else if (m_uType != ENT_GGA)
+        {
+            return;
+        }
 
+        switch (uField)
+        {
+            case 1:
+                m_pending._uTime = (m_uInteger / 10000) * 3600ul + ((m_uInteger / 100) % 100) * 60 + m_uInteger % 100;
+                m_pending._uFlags |= ENF_TIME;
+                break;
+            case 2:
+                m_pending._iLatitude = coordinate();
+                m_pending._uFlags |= ENF_LATITUDE;
+                break;
+            case 3:
+                if (m_cLetter == 'S') m_pending._iLatitude = -m_pending._iLatitude;
+                break;
+            case 4:
+                m_pending._iLongitude = coordinate();
+                m_pending._uFlags |= ENF_LONGITUDE;
+                break;
+            case 5:
+                if (m_cLetter == 'W') m_pending._iLongitude = -m_pending._iLongitude;
+                break;
+            case 6:
+                m_pending._uQuality = (unsigned char)m_uInteger;
+                m_pending._uFlags |= ENF_QUALITY;
+                break;
+            case 7:
+                m_pending._uSatellites = (unsigned char)m_uInteger;
+                break;
+        }
+    }
+
+    /// takes over the pending values of a valid sentence, returns true for RMC and GGA sentences
+    bool commit()
+    {
+        if ( (m_uType != ENT_RMC) && (m_uType != ENT_GGA) )
+        {
+            return false;
+        }
+
+        unsigned char uFlags = m_pending._uFlags;
+        if ((uFlags & (ENF_LATITUDE | ENF_LONGITUDE)) == (ENF_LATITUDE | ENF_LONGITUDE))
+        {
+            m_fix._iLatitude = m_pending._iLatitude;
+            m_fix._iLongitude = m_pending._iLongitude;
+        }
+
+        if ((uFlags & ENF_TIME) != 0) m_fix._uTime = m_pending._uTime;
+        if ((uFlags & ENF_DATE) != 0) m_fix._uDate = m_pending._uDate;
+        if ((uFlags & ENF_STATUS) != 0) m_fix._uFlags = (m_fix._uFlags & ~ENF_VALID) | (uFlags & ENF_VALID);
+        if (m_uType == ENT_GGA)
+        {
+            m_fix._uQuality = ((uFlags & ENF_QUALITY) != 0) ? m_pending._uQuality : 0;
+            m_fix._uSatellites = m_pending._uSatellites;
+        }
+
+        return true;
+    }
+
+ private:
+    Stream             &m_serial;
+    int                 m_iSleepPin;
+    bool                m_bSleeping;
+
+    // parser state
+    eNmeaState          m_eState;
+    unsigned char       m_uChecksum;            ///< XOR of the sentence, then XORed with the received checksum
+    unsigned char       m_uLength;
+    unsigned long       m_uType;                ///< last 3 characters of the address field (eNmeaType)
+    unsigned char       m_uField;               ///< index of the current field (0 is the address field)
+    unsigned long       m_uInteger;             ///< integer digits of the current field
+    unsigned long       m_uFraction;            ///< first FRACTION_DIGITS fraction digits of the current field
+    unsigned char       m_uFractionDigits;
+    bool                m_bFraction;
+    bool                m_bEmpty;
+    char                m_cLetter;              ///< last non numeric character of the current field
+
+    sFix                m_pending;              ///< values of the current sentence
+    sFix                m_fix;                  ///< values of the valid sentences
+    unsigned short      m_uErrorCount;
+};
 
 
 
+#endif  // #ifndef GPS_H
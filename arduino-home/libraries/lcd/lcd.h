@@ -3,55 +3,65 @@
 #include <Arduino.h>
 #include <stdio.h>
 #include <stdarg.h>
-
-
-/// Round up to next higher power of 2 (return x if it's already a power of 2).
-size_t pow2ceil(size_t i)
-{
-    --i;
-    i |= i >> 1;
-    i |= i >> 2;
-    i |= i >> 4;
-    i |= i >> 8;
-    
-    return i+1;
-}
+#include <containers.h>
 
 
 /**
- class for maintaining scrolling text on a LCD
+ class for maintaining scrolling text on a LCD (see 'StaticLcdScreen' for the text buffers)
+ The screen keeps a copy of what is displayed and only sends cursor moves and characters that changed. Output is
+ queued and sent a few bytes at a time by 'update()', so writing text never blocks (except for 'setup()',
+ 'reset()' and 'flush()').
+ View 0 is the scrolling log written by 'writeLine()'. Further views are added with 'addView()' and only format the
+ lines that are displayed, when they are displayed, so they show live data without keeping a copy in RAM.
 */
 class LcdScreen
 {
   public:
-    LcdScreen(Stream &_serial, unsigned int _uWidth, unsigned int _uHeight)
+    /// formats view line '_uLine' into '_pszText' (not called for lines past the end) and returns the number of
+    /// view lines ('_pszText' is NULL if only the number of lines is requested)
+    typedef unsigned int (*ViewFunc)(unsigned int _uLine, char *_pszText, size_t _uSize);
+    
+  public:
+    static const unsigned char  COLUMNS = 16;               ///< visible LCD columns
+    static const unsigned char  ROWS = 2;                   ///< visible LCD rows
+    static const unsigned char  TX_QUEUE_SIZE = 64;         ///< queued output bytes (a full redraw needs 36 bytes)
+    static const unsigned char  TX_BURST = 8;               ///< max bytes sent per 'update()'
+    static const unsigned char  CURSOR_GAP = 2;             ///< shorter runs of unchanged characters are rewritten instead of moving the cursor
+    static const unsigned long  COMMAND_DELAY_MS = 20;      ///< [ms] LCD settle time after a backlight command
+    static const unsigned char  MAX_VIEWS = 4;              ///< views in addition to the log
+    
+  protected:
+    /// '_pBuffer' holds '_uHeightMask+1' log lines and '_pViewRows' holds ROWS view lines, all '_uWidth+1' wide
+    LcdScreen(Stream &_serial, char *_pBuffer, char *_pViewRows, unsigned int _uWidth, unsigned int _uHeightMask)
         :m_serial(_serial),
-         m_uBufWidth(0),
-         m_uBufHeightMask(0),
-         m_pBuffer(NULL),
-         m_uBufferSize(0),
+         m_uBufWidth(_uWidth),
+         m_uBufHeightMask(_uHeightMask),
+         m_pBuffer(_pBuffer),
+         m_pViewRows(_pViewRows),
          m_uLineCount(0),
          m_iX(0),
          m_iY(0),
          m_bBlink(false),
-         m_uBlinkMillis(0)
+         m_uBlinkMillis(0),
+         m_cMarker('\0'),
+         m_bDirty(false),
+         m_iBacklight(-1),
+         m_uHoldMillis(0),
+         m_uViewCount(0),
+         m_uView(0)
     {
-        m_uBufWidth = max(16, _uWidth);
-        m_uBufHeightMask = max(4, pow2ceil(_uHeight))-1;
-        
-        m_uBufferSize = (unsigned long)m_uBufWidth * (unsigned long)(m_uBufHeightMask+1);
-        m_pBuffer = (char*)malloc(m_uBufferSize);
-        memset(m_pBuffer, ' ', m_uBufferSize);
-        
-        setup();
     }
-
-    virtual ~LcdScreen()
+    
+  public:
+    /// clear the log
+    void clear()
     {
-        free(m_pBuffer);
+        memset(m_pBuffer, ' ', (unsigned long)(m_uBufWidth + 1) * (m_uBufHeightMask + 1));
+        m_uLineCount = 0;
+        m_bDirty = true;
     }
 
-    /// setup LCD
+    /// setup LCD (blocking, drops queued output)
     void setup()
     {
         m_serial.write(0x7C); // set LCD width (1)
@@ -68,101 +78,295 @@ class LcdScreen
         m_serial.write(0x7C); // set LCD brightness (1)
         m_serial.write(140);  // set LCD brightness (2 : 128 - off; 157 - fully on)
         delay(20);
+        
+        // LCD is clear now, redraw on the next 'update()'
+        m_txQueue.clear();
+        memset(m_display, ' ', sizeof(m_display));
+        m_iBacklight = -1;
+        m_bDirty = true;
+    }
+    
+    /// reset LCD to 9600 baud and default settings (only works during the LCD splash screen, right after power on)
+    void reset()
+    {
+        m_serial.write(0x12); // reset (Ctrl-R)
+        delay(200);
+        setup();
     }
     
-    /// sets the backlight brightness (0 - 29)
+    /// sets the backlight brightness (0 - 29, sent by 'update()', only the last value is sent)
     void setBacklight(unsigned char _uValue)
     {
-        m_serial.write(0x7C);           // set LCD brightness (1)
-        m_serial.write(128 + _uValue);  // set LCD brightness (2 : 128 - off; 157 - fully on)
-        delay(20);
+        m_iBacklight = _uValue;
     }
     
-    /// update text on LCD based on x and y coordinates
+    /// update text on LCD based on x and y coordinates (y counts lines up from the bottom, sent by 'update()')
     void scroll(int _ix, int _iy)
     {
         if (_ix < 0) m_iX = 0;
-        else if (_ix > m_uBufWidth-16) m_iX = m_uBufWidth-16;
+        else if (_ix > m_uBufWidth-COLUMNS) m_iX = m_uBufWidth-COLUMNS;
         else m_iX = _ix;
         
+        int iMaxY = m_uBufHeightMask-1;
+        if (m_uView > 0)
+        {
+            unsigned int uLines = m_views[m_uView-1](0, NULL, 0);
+            iMaxY = (uLines > ROWS) ? uLines - ROWS : 0;
+        }
+        
         if (_iy < 0) m_iY = 0;
-        else if (_iy > m_uBufHeightMask-1) m_iY = m_uBufHeightMask-1;
+        else if (_iy > iMaxY) m_iY = iMaxY;
         else m_iY = _iy;
         
-        // display bottom two lines
-        unsigned int i1 = (m_uLineCount-2u-m_iY) & m_uBufHeightMask;
-        unsigned int i2 = (m_uLineCount-1u-m_iY) & m_uBufHeightMask;
-        
-        // write line 1
-        m_serial.write(0xFE);
-        m_serial.write(0x80);
-        m_serial.write((unsigned char*)m_pBuffer + (unsigned long)i1 * m_uBufWidth + (unsigned long)m_iX, 16);
-        delay(50);
-        
-        // write line 2
-        m_serial.write(0xFE);
-        m_serial.write(0x80 | 0x40);
-        m_serial.write((unsigned char*)m_pBuffer + (unsigned long)i2 * m_uBufWidth + (unsigned long)m_iX, 16);
-        delay(50);
+        m_bDirty = true;
     }
     
     /// write a new line to LCD and scrolls previous line up
 	void writeLine(const char *_pszFmt, ...)
 	{
         // clear line
-        char *pLcdBufLine = m_pBuffer + (unsigned long)(m_uLineCount & m_uBufHeightMask) * m_uBufWidth;
+        char *pLcdBufLine = m_pBuffer + (unsigned long)(m_uLineCount & m_uBufHeightMask) * (m_uBufWidth+1);
         memset(pLcdBufLine, ' ', m_uBufWidth);
 
         // fill line with variable format string
 		va_list ap;
 		va_start(ap, _pszFmt);
-        int n = vsnprintf(pLcdBufLine, m_uBufWidth, _pszFmt, ap);
+        int n = vsnprintf(pLcdBufLine, m_uBufWidth+1, _pszFmt, ap);
 		va_end(ap);
         
         // replace string terminating character '\0' with a ' '
-        n = min(m_uBufWidth-1, n);
+        n = min(m_uBufWidth, n);
         pLcdBufLine[n] = ' ';
         
         // scroll text
         m_uLineCount++;
-        scroll(m_iX, m_iY);
+        if (m_uView == 0)
+        {
+            scroll(m_iX, m_iY);
+        }
 	}
     
-    // indicate activity on LCD
+    /// add a view (returns false if there are already MAX_VIEWS views)
+    bool addView(ViewFunc _fpView)
+    {
+        if (m_uViewCount >= MAX_VIEWS)
+        {
+            return false;
+        }
+        
+        m_views[m_uViewCount] = _fpView;
+        m_uViewCount++;
+        return true;
+    }
+    
+    /// show view '_uView' from its first line (0 - log, 1 to 'viewCount()'-1 - added views)
+    void setView(unsigned char _uView)
+    {
+        m_uView = (_uView < viewCount()) ? _uView : 0;
+        scroll(0, (m_uView > 0) ? m_uBufHeightMask : 0);
+    }
+    
+    /// redraw the current view if it is a live view (call when its data changed)
+    void refresh()
+    {
+        if (m_uView > 0)
+        {
+            scroll(m_iX, m_iY);
+        }
+    }
+    
+    // indicate activity on LCD (marker in the top right corner)
     void blink()
     {
         if (millis() > m_uBlinkMillis)
         {
-            m_serial.write(0xFE);
-            m_serial.write(0x8F);
-            delay(20);
-    
-            if (m_bBlink == true) m_serial.write('O');
-            else m_serial.write('*');
-            delay(10);
+            m_cMarker = (m_bBlink == true) ? 'O' : '*';
+            m_bDirty = true;
             
             m_bBlink = !m_bBlink;
             m_uBlinkMillis = millis() + 500;
         }
     }
     
+    /// send queued output and queue the next changes (call often, sends at most TX_BURST bytes)
+    void update()
+    {
+        // send queued bytes without blocking on the serial tx buffer
+        int n = min((int)TX_BURST, m_serial.availableForWrite());
+        unsigned char uByte = 0;
+        while ( (n > 0) && (m_txQueue.try_pop(uByte) == true) )
+        {
+            m_serial.write(uByte);
+            n--;
+        }
+        
+        if ( (m_txQueue.empty() == false) ||
+             ((long)(millis() - m_uHoldMillis) < 0) )
+        {
+            return;
+        }
+        
+        // commands are sent on their own and give the LCD time to process them
+        if (m_iBacklight >= 0)
+        {
+            m_txQueue.try_push(0x7C);                                   // set LCD brightness (1)
+            m_txQueue.try_push((unsigned char)(128 + m_iBacklight));    // set LCD brightness (2 : 128 - off; 157 - fully on)
+            m_iBacklight = -1;
+            m_uHoldMillis = millis() + COMMAND_DELAY_MS;
+            return;
+        }
+        
+        if (m_bDirty == true)
+        {
+            m_bDirty = render();
+        }
+    }
+    
+    /// true while output is queued or pending
+    bool busy() const
+    {
+        return (m_txQueue.empty() == false) || (m_bDirty == true) || (m_iBacklight >= 0);
+    }
+    
+    /// send all pending output (blocking)
+    void flush()
+    {
+        while (busy() == true)
+        {
+            update();
+        }
+    }
+    
     unsigned int width() const {return m_uBufWidth;}
     unsigned int height() const {return m_uBufHeightMask+1;}
     unsigned int x() const {return m_iX;}
     unsigned int y() const {return m_iY;}
     unsigned int lineCount() const {return m_uLineCount;}
+    unsigned char view() const {return m_uView;}
+    unsigned char viewCount() const {return m_uViewCount + 1;}
+    
+  protected:
+    /// character that should be displayed at '_uCol' of '_pszRow' (row '_uRow')
+    char cell(const char *_pszRow, unsigned char _uRow, unsigned char _uCol) const
+    {
+        if ( (_uRow == 0) && (_uCol == COLUMNS-1) && (m_cMarker != '\0') )
+        {
+            return m_cMarker;
+        }
+        
+        return _pszRow[_uCol];
+    }
+    
+    /// queue cursor moves and characters that differ from the display, returns true if the queue ran out of space
+    bool render()
+    {
+        unsigned int uViewLines = (m_uView > 0) ? m_views[m_uView-1](0, NULL, 0) : 0;
+        for (unsigned char r = 0; r < ROWS; r++)
+        {
+            // display bottom lines
+            const char *pszRow = NULL;
+            if (m_uView == 0)
+            {
+                unsigned int uLine = (m_uLineCount - ROWS + r - m_iY) & m_uBufHeightMask;
+                pszRow = m_pBuffer + (unsigned long)uLine * (m_uBufWidth+1) + (unsigned long)m_iX;
+            }
+            else
+            {
+                // format view lines on demand
+                char *pszViewRow = m_pViewRows + (unsigned long)r * (m_uBufWidth+1);
+                memset(pszViewRow, ' ', m_uBufWidth);
+                pszViewRow[m_uBufWidth] = '\0';
+                
+                unsigned int uLine = uViewLines - ROWS + r - m_iY;
+                if (uLine < uViewLines)
+                {
+                    m_views[m_uView-1](uLine, pszViewRow, m_uBufWidth+1);
+                    pszViewRow[strlen(pszViewRow)] = ' ';
+                }
+                
+                pszRow = pszViewRow + m_iX;
+            }
+            
+            unsigned char c = 0;
+            while (c < COLUMNS)
+            {
+                if (cell(pszRow, r, c) == m_display[r][c])
+                {
+                    c++;
+                    continue;
+                }
+                
+                // extend the run over short gaps (rewriting a character is cheaper than moving the cursor)
+                unsigned char uEnd = c + 1;
+                for (unsigned char i = c + 1; (i < COLUMNS) && (i - uEnd < CURSOR_GAP); i++)
+                {
+                    if (cell(pszRow, r, i) != m_display[r][i])
+                    {
+                        uEnd = i + 1;
+                    }
+                }
+                
+                if (m_txQueue.size() - m_txQueue.count() < 2u + uEnd - c)
+                {
+                    return true;
+                }
+                
+                m_txQueue.try_push(0xFE);                               // set cursor (1)
+                m_txQueue.try_push((unsigned char)(0x80 | (r * 0x40) | c));  // set cursor (2)
+                for (; c < uEnd; c++)
+                {
+                    m_display[r][c] = cell(pszRow, r, c);
+                    m_txQueue.try_push(m_display[r][c]);
+                }
+            }
+        }
+        
+        return false;
+    }
     
   private:
     Stream             &m_serial;
     unsigned int       m_uBufWidth;
     unsigned int       m_uBufHeightMask;
-    char               *m_pBuffer;
-    unsigned long      m_uBufferSize;
+    char               *m_pBuffer;              ///< log lines (with room for the string terminator)
+    char               *m_pViewRows;            ///< displayed view lines (with room for the string terminator)
     unsigned int       m_uLineCount;
     unsigned int       m_iX;
     unsigned int       m_iY;
     bool               m_bBlink;
     unsigned long      m_uBlinkMillis;
+    char               m_cMarker;               ///< activity marker ('\0' if not shown)
+    char               m_display[ROWS][COLUMNS];    ///< characters on the LCD (including queued output)
+    bool               m_bDirty;                ///< text, scroll position or marker changed since the last render
+    int                m_iBacklight;            ///< backlight value to send (-1 if none)
+    unsigned long      m_uHoldMillis;           ///< [ms] no output before this time (LCD busy with a command)
+    RingBuffer<unsigned char, TX_QUEUE_SIZE>  m_txQueue;
+    ViewFunc           m_views[MAX_VIEWS];
+    unsigned char      m_uViewCount;
+    unsigned char      m_uView;                 ///< displayed view (0 - log)
+};
+
+
+
+
+/**
+ LcdScreen with statically allocated text buffers: a log of HEIGHT lines (rounded up to a power of 2) that are WIDTH
+ characters wide (WIDTH >= 16, HEIGHT >= 2)
+*/
+template <unsigned int WIDTH, unsigned int HEIGHT>
+class StaticLcdScreen : public LcdScreen
+{
+  public:
+    /// NOTE: call 'setup()' or 'reset()' once the serial port is open
+    explicit StaticLcdScreen(Stream &_serial)
+        :LcdScreen(_serial, m_buffer[0], m_viewRows[0], WIDTH, POW2SIZE(HEIGHT)-1)
+    {
+        clear();
+    }
+    
+  private:
+    char                m_buffer[POW2SIZE(HEIGHT)][WIDTH+1];
+    char                m_viewRows[ROWS][WIDTH+1];
 };
 
 
@@ -171,8 +375,13 @@ class LcdScreen
 class LcdAnimator
 {
   public:
-    LcdAnimator(LcdScreen &_rLcd, int _iUpDownAnalogPin, int _iLeftRightAnalogPin)
+    /// reads an analog pin (e.g. a cached sample instead of a blocking 'analogRead()')
+    typedef int (*AnalogReadFunc)(uint8_t _uPin);
+
+  public:
+    LcdAnimator(LcdScreen &_rLcd, int _iUpDownAnalogPin, int _iLeftRightAnalogPin, AnalogReadFunc _fpRead = analogRead)
         :m_rLcd(_rLcd),
+         m_fpRead(_fpRead),
          m_uLightOffTime(0),
          m_bBackLightOn(false),
          m_bBlink(false),
@@ -229,23 +438,38 @@ class LcdAnimator
     {
         if (m_bLeftRightDown == false)
         {
-            int i = analogRead(m_iLeftRightAnalogPin);
+            int i = m_fpRead(m_iLeftRightAnalogPin);
+            // scrolling past the left or right edge switches to the previous or next view
             if (i < 300)
             {
                 m_bLeftRightDown = true;
                 setBackLightOn(millis() + 4000);
-                m_rLcd.scroll((int)m_rLcd.x() - 1, (int)m_rLcd.y());
+                if (m_rLcd.x() == 0)
+                {
+                    m_rLcd.setView((m_rLcd.view() + m_rLcd.viewCount() - 1) % m_rLcd.viewCount());
+                }
+                else
+                {
+                    m_rLcd.scroll((int)m_rLcd.x() - 1, (int)m_rLcd.y());
+                }
             }
             else if (i > 700)
             {
                 m_bLeftRightDown = true;
                 setBackLightOn(millis() + 4000);
-                m_rLcd.scroll((int)m_rLcd.x() + 1, (int)m_rLcd.y());
+                if (m_rLcd.x() + LcdScreen::COLUMNS >= m_rLcd.width())
+                {
+                    m_rLcd.setView((m_rLcd.view() + 1) % m_rLcd.viewCount());
+                }
+                else
+                {
+                    m_rLcd.scroll((int)m_rLcd.x() + 1, (int)m_rLcd.y());
+                }
             }
         }
         else
         {
-            int i = analogRead(m_iLeftRightAnalogPin);
+            int i = m_fpRead(m_iLeftRightAnalogPin);
             if ((i > 300) && (i < 700))
             {
                 m_bLeftRightDown = false;
@@ -258,7 +482,7 @@ class LcdAnimator
     {
         if (m_bUpDownDown == false)
         {
-            int i = analogRead(m_iUpDownAnalogPin);
+            int i = m_fpRead(m_iUpDownAnalogPin);
             if (i < 300)
             {
                 m_bUpDownDown = true;
@@ -274,7 +498,7 @@ class LcdAnimator
         }
         else
         {
-            int i = analogRead(m_iUpDownAnalogPin);
+            int i = m_fpRead(m_iUpDownAnalogPin);
             if ((i > 300) && (i < 700))
             {
                 m_bUpDownDown = false;
@@ -285,6 +509,7 @@ class LcdAnimator
     
   protected:
     LcdScreen           &m_rLcd;
+    AnalogReadFunc      m_fpRead;
     unsigned long       m_uLightOffTime;
     bool                m_bBackLightOn;
     bool                m_bBlink;
@@ -0,0 +1,198 @@
+#ifndef SENSORREGISTRY_H
+#define SENSORREGISTRY_H
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <deviceconfig.h>
+#include <containers.h>
+
+
+
+/// sensor fields that are checked on every update and status scan or reported (10 bytes, the names are kept in EEPROM)
+struct sSensorStatus
+{
+    static const unsigned long  TIME_MASK = 0x1FFFFF;        ///< timestamps are 21 bits [s] (24 days)
+
+    sSensorStatus()
+        :_uAddr(0),
+         _uEventCount(0xFFFF),
+         _uBtyVoltage(0),
+         _uTemperature(0),
+         _uEvents(0),
+         _uTimestamp(0)
+    {
+    }
+
+    /// copy the status fields of a sensor update
+    void set(const sDeviceData &_rData)
+    {
+        _uAddr = _rData._uAddr;
+        _uEventCount = _rData._uEventCount;
+        _uBtyVoltage = _rData._uBtyVoltage;
+        _uTemperature = _rData._uTemperature;
+        _uEvents = (_rData._bTimeEvent ? EDE_TIME : 0) | (_rData._bD2Event ? EDE_D2 : 0) | (_rData._bD3Event ? EDE_D3 : 0);
+        setTime(seconds(_rData._uTimestamp));
+    }
+
+    bool d2Event() const {return (_uEvents & EDE_D2) != 0;}
+    bool d3Event() const {return (_uEvents & EDE_D3) != 0;}
+
+    /// true until the sensor was reported (timed out), see 'clearTime()'
+    bool hasTime() const {return time() != 0;}
+    void clearTime() {setTime(0);}
+
+    /// [s] time since the last update at '_uNow' [ms] (wraps after 24 days, far beyond the longest sensor timeout of
+    /// 2.5 heartbeats of at most 18 hours)
+    unsigned long age(unsigned long _uNow) const {return (seconds(_uNow) - time()) & TIME_MASK;}
+
+    /// 21 bit timestamp [s] of '_uMs' (never 0, which marks reported sensors)
+    static unsigned long seconds(unsigned long _uMs)
+    {
+        unsigned long uSeconds = (_uMs / 1000) & TIME_MASK;
+        return (uSeconds != 0) ? uSeconds : 1;
+    }
+
+    unsigned short    _uAddr;           ///< radio address
+    unsigned short    _uEventCount;
+    unsigned short    _uBtyVoltage;
+    unsigned char     _uTemperature;
+
+  private:
+    static const unsigned char  EVENT_MASK = EDE_TIME | EDE_D2 | EDE_D3;
+
+    unsigned long time() const {return ((unsigned long)(_uEvents >> 3) << 16) | _uTimestamp;}
+
+    void setTime(unsigned long _uSeconds)
+    {
+        _uTimestamp = (unsigned short)(_uSeconds & 0xFFFF);
+        _uEvents = (_uEvents & EVENT_MASK) | (unsigned char)((_uSeconds >> 16) << 3);
+    }
+
+    unsigned char     _uEvents;         ///< eDeviceEventBits of the last update (bits 0-2) and bits 16-20 of the time (bits 3-7)
+    unsigned short    _uTimestamp;      ///< [s] bits 0-15 of the time of the last update (0 once the sensor was reported)
+};
+
+
+
+/**
+  Sensors of the base station keyed by their 16 bit radio address.
+  Sensors are stored densely in the order they first reported (index 0 to 'count()'-1), so scans only touch known
+  sensors. An open addressed hash table (linear probing, at most 80% full) maps addresses to indices. Names are only
+  needed for reports and are kept in EEPROM (NAME_SIZE bytes per sensor from '_uNameBase'; rewriting the same name
+  does not write), so a sensor takes 10 bytes of status and a byte or two of hash table in RAM. Sensors are never
+  removed.
+*/
+template <size_t N>
+class SensorRegistry
+{
+  public:
+    typedef typename RingIndex<(N < 255)>::type slot_t;
+
+    static const size_t     NAME_SIZE = 10;                 ///< same as sDeviceData::_pszName
+
+  public:
+    SensorRegistry(unsigned short _uNameBase)
+        :m_uNameBase(_uNameBase),
+         m_uCount(0),
+         m_uDroppedCount(0)
+    {
+        memset(m_slots, 0, sizeof(m_slots));
+    }
+
+    /// index of the sensor with the given address, or -1 if it is unknown
+    int find(unsigned short _uAddr) const
+    {
+        for (size_t h = hash(_uAddr); m_slots[h] != 0; h = (h + 1) & HASH_MASK)
+        {
+            if (m_status[m_slots[h] - 1]._uAddr == _uAddr)
+            {
+                return m_slots[h] - 1;
+            }
+        }
+
+        return -1;
+    }
+
+    /// index of the sensor with the given address, added if it is unknown; -1 (and counts a drop) if the registry is full
+    int add(unsigned short _uAddr)
+    {
+        size_t h = hash(_uAddr);
+        for (; m_slots[h] != 0; h = (h + 1) & HASH_MASK)
+        {
+            if (m_status[m_slots[h] - 1]._uAddr == _uAddr)
+            {
+                return m_slots[h] - 1;
+            }
+        }
+
+        if (m_uCount >= N)
+        {
+            if (m_uDroppedCount < 0xFFFF)
+            {
+                m_uDroppedCount++;
+            }
+
+            return -1;
+        }
+
+        m_status[m_uCount] = sSensorStatus();
+        m_status[m_uCount]._uAddr = _uAddr;
+        EEPROM.update(m_uNameBase + m_uCount * NAME_SIZE, '\0');
+        m_uCount++;
+        m_slots[h] = (slot_t)m_uCount;
+        return m_uCount - 1;
+    }
+
+    sSensorStatus &status(size_t _uIndex) {return m_status[_uIndex];}
+    const sSensorStatus &status(size_t _uIndex) const {return m_status[_uIndex];}
+
+    /// reads the name of the sensor to '_pszName' (NAME_SIZE bytes) and returns it
+    char *name(size_t _uIndex, char *_pszName) const
+    {
+        for (size_t i = 0; i < NAME_SIZE; i++)
+        {
+            _pszName[i] = EEPROM.read(m_uNameBase + _uIndex * NAME_SIZE + i);
+        }
+
+        _pszName[NAME_SIZE-1] = '\0';
+        return _pszName;
+    }
+
+    /// stores the name of the sensor (only the bytes that changed are written)
+    void setName(size_t _uIndex, const char *_pszName)
+    {
+        bool bEnd = false;
+        for (size_t i = 0; i < NAME_SIZE; i++)
+        {
+            bEnd |= (i == NAME_SIZE-1) || (_pszName[i] == '\0');
+            EEPROM.update(m_uNameBase + _uIndex * NAME_SIZE + i, bEnd ? '\0' : _pszName[i]);
+        }
+    }
+
+    /// number of known sensors
+    size_t count() const {return m_uCount;}
+    size_t capacity() const {return N;}
+
+    /// number of sensors that were not added because the registry was full
+    unsigned short droppedCount() const {return m_uDroppedCount;}
+
+  private:
+    static const size_t     HASH_MASK = POW2SIZE(N + N / 4 + 1) - 1;
+
+    static size_t hash(unsigned short _uAddr)
+    {
+        return (_uAddr ^ (_uAddr >> 8)) & HASH_MASK;
+    }
+
+  private:
+    const unsigned short m_uNameBase;                       ///< EEPROM address of the names
+    sSensorStatus       m_status[N];
+    slot_t              m_slots[HASH_MASK + 1];             ///< index+1 of the sensor, 0 if empty
+    size_t              m_uCount;
+    unsigned short      m_uDroppedCount;
+};
+
+
+
+
+#endif  // #ifndef SENSORREGISTRY_H
+
@@ -102,5 +102,139 @@ inline unsigned int readln(Stream &_rSerial, char *_pBuf, unsigned int _uBufSize
 }
 
 
+/// update CRC-16/CCITT (polynomial 0x1021, start with 0xFFFF) with one byte
+inline unsigned short crc16Update(unsigned short _uCrc, unsigned char _uByte)
+{
+    _uCrc ^= (unsigned short)_uByte << 8;
+    for (unsigned char i = 0; i < 8; i++)
+    {
+        _uCrc = (_uCrc & 0x8000) ? (_uCrc << 1) ^ 0x1021 : _uCrc << 1;
+    }
+    
+    return _uCrc;
+}
+
+
+/**
+  Non-blocking line reader.
+  Keeps its own line buffer and only consumes the bytes that are available when 'poll()' is called, so it never waits
+  on the stream. A line is complete when NL or CR is received, when the buffer is full, or when a partial line has
+  been idle for the idle time. Leading NL and CR characters are ignored.
+  The completed line stays in the buffer (and may be modified, e.g. with 'strtok') until the next 'poll()'.
+*/
+template <unsigned int S>
+class LineReader
+{
+ public:
+    enum eLineEvent
+    {
+        ELE_NONE = 0,       ///< no complete line yet
+        ELE_LINE,           ///< line terminated by NL/CR or a full buffer
+        ELE_IDLE,           ///< partial line that has been idle for the idle time
+    };
+
+ public:
+    LineReader(Stream &_rSerial, unsigned long _uIdleTimeMs)
+        :m_serial(_rSerial),
+         m_uIdleTimeMs(_uIdleTimeMs),
+         m_uLength(0),
+         m_uLastRxTime(0),
+         m_bReady(false)
+    {
+        m_pszLine[0] = '\0';
+    }
+
+    /// read available bytes and return ELE_LINE/ELE_IDLE if a line is ready (never waits for more bytes)
+    eLineEvent poll()
+    {
+        if (m_bReady == true)
+        {
+            clear();
+        }
+
+        if (m_serial.available() > 0)
+        {
+            m_uLastRxTime = millis();
+
+            do
+            {
+                int ch = m_serial.read();
+
+                // stop if NL or CR characters are received
+                if ( (ch == '\n') ||
+                     (ch == '\r') )
+                {
+                    if (m_uLength > 0)  // ignores NL & CR if no other characters have been received
+                    {
+                        m_bReady = true;
+                        return ELE_LINE;
+                    }
+                }
+                else
+                {
+                    m_pszLine[m_uLength] = ch;
+                    m_uLength++;
+                    m_pszLine[m_uLength] = '\0';
+
+                    if (m_uLength >= S)
+                    {
+                        m_bReady = true;
+                        return ELE_LINE;
+                    }
+                }
+            } while (m_serial.available() > 0);
+        }
+        else if ( (m_uLength > 0) &&
+                  (millis() - m_uLastRxTime >= m_uIdleTimeMs) )
+        {
+            m_bReady = true;
+            return ELE_IDLE;
+        }
+
+        return ELE_NONE;
+    }
+
+    /// poll and return the length of the line if one is ready, otherwise 0
+    unsigned int readln()
+    {
+        return (poll() != ELE_NONE) ? m_uLength : 0;
+    }
+
+    /// drop the current line
+    void clear()
+    {
+        m_uLength = 0;
+        m_pszLine[0] = '\0';
+        m_bReady = false;
+    }
+
+    /// drop the current line and all bytes that are available right now
+    void discard()
+    {
+        clear();
+        while (m_serial.available() > 0)
+        {
+            m_serial.read();
+        }
+    }
+
+    /// current line (the partial line if no line is ready), always '\0' terminated
+    char *line() {return m_pszLine;}
+    const char *line() const {return m_pszLine;}
+    unsigned int length() const {return m_uLength;}
+    bool ready() const {return m_bReady;}
+    unsigned long lastRxTime() const {return m_uLastRxTime;}
+    Stream &stream() {return m_serial;}
+
+ private:
+    Stream              &m_serial;
+    unsigned long       m_uIdleTimeMs;
+    char                m_pszLine[S+1];
+    unsigned int        m_uLength;
+    unsigned long       m_uLastRxTime;
+    bool                m_bReady;
+};
+
+
 
 #endif  // #ifndef LIBSERIALIO_H
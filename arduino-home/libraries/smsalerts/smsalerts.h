@@ -0,0 +1,274 @@
+#ifndef SMSALERTS_H
+#define SMSALERTS_H
+#include <Arduino.h>
+#include <stdarg.h>
+#include <celshield.h>
+
+
+
+/**
+  Outbound SMS alert stage in front of GprsSms.
+  Alerts for the same recipient are merged into one digest text (one line per alert, most urgent first), which is
+  queued with the priority of its most urgent alert once it is due: alarms right away, other alerts when the first
+  of them is '_uWindowMs' old and the tx queue is empty, so that alerts keep merging while the modem is busy.
+  Each recipient has a token bucket: a digest takes one token and tokens are refilled one per '_uRefillMs'. The
+  last token is reserved for digests with an alarm. Digests wait (and keep merging) while there are no tokens.
+  A full digest makes room for more urgent alerts by dropping its least urgent ones; other alerts are dropped.
+  Up to R recipients with digests of up to S characters are tracked.
+*/
+template <size_t R, size_t S>
+class SmsAlerts
+{
+  public:
+    static const size_t     MAX_ALERTS = 16;            ///< alerts (lines) per digest
+    static const size_t     LINE_SIZE = 64;             ///< characters per alert
+
+  public:
+    SmsAlerts(GprsSms &_rGprs, unsigned long _uWindowMs, unsigned char _uBucketSize, unsigned long _uRefillMs)
+        :m_rGprs(_rGprs),
+         m_uWindowMs(_uWindowMs),
+         m_uRefillMs(_uRefillMs),
+         m_uBucketSize(_uBucketSize),
+         m_uMergedCount(0),
+         m_uDroppedCount(0)
+    {
+        memset(m_recipients, 0, sizeof(m_recipients));
+    }
+
+    /// creates an alert (using variable argument list) for the given number; returns false (and counts a drop) if it was dropped
+    bool push(const char *_pszNumber, eSmsPriority _ePriority, const char *_pszFmt, ...)
+    {
+        char pszLine[LINE_SIZE];
+        va_list ap;
+        va_start(ap, _pszFmt);
+        vsnprintf(pszLine, sizeof(pszLine), _pszFmt, ap);
+        va_end(ap);
+
+        sRecipient *pRecipient = recipient(_pszNumber);
+        if ( (pRecipient == NULL) || (insert(*pRecipient, _ePriority, pszLine) == false) )
+        {
+            countDrop();
+            return false;
+        }
+
+        return true;
+    }
+
+    /// refill token buckets and queue the digests that are due, most urgent first
+    void update()
+    {
+        for (size_t i = 0; i < R; i++)
+        {
+            refill(m_recipients[i]);
+        }
+
+        for (unsigned char p = ESP_ALARM; p <= ESP_REPLY; p++)
+        {
+            for (size_t i = 0; i < R; i++)
+            {
+                sRecipient &r = m_recipients[i];
+                if ( (r.m_uAlerts > 0) && (r.m_priorities[0] == p) && (due(r) == true) )
+                {
+                    send(r);
+                }
+            }
+        }
+    }
+
+    /// returns true if alerts are waiting to be sent
+    bool pending() const
+    {
+        for (size_t i = 0; i < R; i++)
+        {
+            if (m_recipients[i].m_uAlerts > 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// number of alerts that were merged into a digest with other alerts
+    unsigned short mergedCount() const {return m_uMergedCount;}
+
+    /// number of alerts that were dropped (digest full, or no recipient slot)
+    unsigned short droppedCount() const {return m_uDroppedCount;}
+
+  private:
+    struct sRecipient
+    {
+        char            m_pszNumber[GprsSms::MAX_NUMBER_DIGITS+2];
+        char            m_pszDigest[S+1];                   ///< alert lines separated by '\n', most urgent first
+        unsigned char   m_priorities[MAX_ALERTS];           ///< eSmsPriority of each line
+        unsigned char   m_uAlerts;
+        unsigned char   m_uTokens;
+        unsigned long   m_uFirstTime;                       ///< [ms] time of the oldest alert in the digest
+        unsigned long   m_uRefillTime;                      ///< [ms] time of the last token refill
+    };
+
+    /// recipient with the given number; takes over a slot without alerts for new numbers (NULL if all are busy or the
+    /// number is too long to be kept in full)
+    sRecipient *recipient(const char *_pszNumber)
+    {
+        if (strlen(_pszNumber) >= sizeof(m_recipients[0].m_pszNumber))
+        {
+            return NULL;
+        }
+
+        sRecipient *pIdle = NULL;
+        for (size_t i = 0; i < R; i++)
+        {
+            sRecipient &r = m_recipients[i];
+            if (strcmp(r.m_pszNumber, _pszNumber) == 0)
+            {
+                return &r;
+            }
+            else if ( (pIdle == NULL) && (r.m_uAlerts == 0) )
+            {
+                pIdle = &r;
+            }
+        }
+
+        if (pIdle != NULL)
+        {
+            strcpy(pIdle->m_pszNumber, _pszNumber);
+            pIdle->m_uTokens = m_uBucketSize;
+            pIdle->m_uRefillTime = millis();
+        }
+
+        return pIdle;
+    }
+
+    /// inserts a line behind the lines of the same or higher urgency, dropping less urgent lines to make room
+    bool insert(sRecipient &_rRecipient, unsigned char _uPriority, const char *_pszLine)
+    {
+        size_t uLineLen = strlen(_pszLine);
+        if (uLineLen + 1 > S)
+        {
+            return false;
+        }
+
+        for (;;)
+        {
+            size_t uLen = strlen(_rRecipient.m_pszDigest);
+            bool bFull = (_rRecipient.m_uAlerts >= MAX_ALERTS) || (uLen + uLineLen + 1 > S);
+            if (bFull == false)
+            {
+                break;
+            }
+
+            // drop the last (least urgent, newest) line if it is less urgent than the new one
+            if (_rRecipient.m_priorities[_rRecipient.m_uAlerts - 1] <= _uPriority)
+            {
+                return false;
+            }
+
+            char *pszLast = strrchr(_rRecipient.m_pszDigest, '\n');
+            if (pszLast != NULL) *pszLast = '\0';
+            else _rRecipient.m_pszDigest[0] = '\0';
+
+            _rRecipient.m_uAlerts--;
+            countDrop();
+        }
+
+        // find the line to insert before
+        size_t uLine = 0;
+        char *pszPos = _rRecipient.m_pszDigest;
+        for (; (uLine < _rRecipient.m_uAlerts) && (_rRecipient.m_priorities[uLine] <= _uPriority); uLine++)
+        {
+            pszPos = strchr(pszPos, '\n');
+            pszPos = (pszPos != NULL) ? pszPos + 1 : _rRecipient.m_pszDigest + strlen(_rRecipient.m_pszDigest);
+        }
+
+        // insert line (with a separator before the following line, or after the previous one when appending)
+        size_t uTail = strlen(pszPos);
+        if (_rRecipient.m_uAlerts == 0)
+        {
+            memcpy(pszPos, _pszLine, uLineLen + 1);
+            _rRecipient.m_uFirstTime = millis();
+        }
+        else if (uLine < _rRecipient.m_uAlerts)
+        {
+            memmove(pszPos + uLineLen + 1, pszPos, uTail + 1);
+            memcpy(pszPos, _pszLine, uLineLen);
+            pszPos[uLineLen] = '\n';
+        }
+        else
+        {
+            *pszPos++ = '\n';
+            memcpy(pszPos, _pszLine, uLineLen + 1);
+        }
+
+        if (_rRecipient.m_uAlerts > 0)
+        {
+            m_uMergedCount++;
+        }
+
+        memmove(_rRecipient.m_priorities + uLine + 1, _rRecipient.m_priorities + uLine, _rRecipient.m_uAlerts - uLine);
+        _rRecipient.m_priorities[uLine] = _uPriority;
+        _rRecipient.m_uAlerts++;
+        return true;
+    }
+
+    void refill(sRecipient &_rRecipient)
+    {
+        unsigned long uNow = millis();
+        while ( (_rRecipient.m_uTokens < m_uBucketSize) && (uNow - _rRecipient.m_uRefillTime >= m_uRefillMs) )
+        {
+            _rRecipient.m_uTokens++;
+            _rRecipient.m_uRefillTime += m_uRefillMs;
+        }
+
+        if (_rRecipient.m_uTokens >= m_uBucketSize)
+        {
+            _rRecipient.m_uRefillTime = uNow;
+        }
+    }
+
+    /// returns true if the digest may be queued now
+    bool due(const sRecipient &_rRecipient) const
+    {
+        if (_rRecipient.m_priorities[0] == ESP_ALARM)
+        {
+            return (_rRecipient.m_uTokens > 0) &&
+                   (m_rGprs.canQueueTxMessage(_rRecipient.m_pszNumber, _rRecipient.m_pszDigest, ESP_ALARM) == true);
+        }
+
+        unsigned char uReserve = (m_uBucketSize > 1) ? 1 : 0;
+        return (_rRecipient.m_uTokens > uReserve) &&
+               (millis() - _rRecipient.m_uFirstTime >= m_uWindowMs) &&
+               (m_rGprs.hasTxMessages() == false);
+    }
+
+    void send(sRecipient &_rRecipient)
+    {
+        m_rGprs.pushTxMessageTxt(_rRecipient.m_pszNumber, _rRecipient.m_pszDigest, (eSmsPriority)_rRecipient.m_priorities[0]);
+
+        _rRecipient.m_uTokens--;
+        _rRecipient.m_pszDigest[0] = '\0';
+        _rRecipient.m_uAlerts = 0;
+    }
+
+    void countDrop()
+    {
+        if (m_uDroppedCount < 0xFFFF)
+        {
+            m_uDroppedCount++;
+        }
+    }
+
+  private:
+    GprsSms             &m_rGprs;
+    const unsigned long m_uWindowMs;
+    const unsigned long m_uRefillMs;
+    const unsigned char m_uBucketSize;
+    sRecipient          m_recipients[R];
+    unsigned short      m_uMergedCount;
+    unsigned short      m_uDroppedCount;
+};
+
+
+
+
+#endif  // #ifndef SMSALERTS_H
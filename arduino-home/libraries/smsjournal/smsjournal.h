@@ -0,0 +1,348 @@
+#ifndef SMSJOURNAL_H
+#define SMSJOURNAL_H
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <serialio.h>
+#include <containers.h>
+#ifdef __AVR__
+#include <avr/eeprom.h>
+#endif
+
+
+
+/// true when the EEPROM can take the next byte without waiting (a byte write takes 3.4ms on AVR)
+#ifdef __AVR__
+#define SMSJOURNAL_EEPROM_READY()   eeprom_is_ready()
+#else
+#define SMSJOURNAL_EEPROM_READY()   true
+#endif
+
+
+/**
+  Persistent journal of SMS alerts that were not sent yet, kept in an EEPROM region that is used as an append-only
+  ring. Records are never rewritten, only appended, so each byte of the region is written once per round:
+    MAGIC, LEN, SEQ (little endian), PRIORITY, number '\0' text (LEN bytes), CRC-16 (big endian, over LEN..text)
+  A record is acknowledged by overwriting its magic byte (pending -> sent), which is the only second write.
+  'begin()' finds the newest valid record after a reset; the pending records are then read back in sequence order
+  with 'nextPending()' and 'read()'. A pending record that is overwritten a round later is counted as lost.
+  Writes are buffered (one record and a few acks) and written by 'update()' one byte at a time when the EEPROM is
+  ready, so appending does not block the main loop. The next record can be appended once the previous one is written
+  (see 'ready()'), callers try again later.
+*/
+class SmsJournal
+{
+  public:
+    static const unsigned char  MAGIC_PENDING = 0xA5;
+    static const unsigned char  MAGIC_SENT = 0x5A;
+    static const size_t         HEADER_SIZE = 5;                ///< magic, length, sequence number, priority
+    static const size_t         MAX_RECORD_SIZE = HEADER_SIZE + 255 + 2;
+    static const size_t         ACK_QUEUE_SIZE = 8;
+
+  public:
+    /// journal in the EEPROM bytes from '_uBase' to '_uBase+_uSize-1' (_uSize < 64K)
+    SmsJournal(unsigned short _uBase, unsigned short _uSize)
+        :m_uBase(_uBase),
+         m_uSize(_uSize),
+         m_uWrite(0),
+         m_uNextSeq(0),
+         m_uRecordSize(0),
+         m_uRecordPos(0),
+         m_uRecordOffset(0),
+         m_uLostCount(0)
+    {
+    }
+
+    /// find the newest record; the next record is appended behind it (call once after a reset, before appending)
+    void begin()
+    {
+        bool bFound = false;
+        unsigned short uNewestSeq = 0;
+        for (unsigned short o = 0; o < m_uSize;)
+        {
+            unsigned short uSize = recordSize(o);
+            if (uSize == 0)
+            {
+                o++;
+                continue;
+            }
+
+            unsigned short uSeq = readSeq(o);
+            if ( (bFound == false) || ((short)(uSeq - uNewestSeq) > 0) )
+            {
+                bFound = true;
+                uNewestSeq = uSeq;
+                m_uWrite = o + uSize;
+            }
+
+            o += uSize;
+        }
+
+        m_uNextSeq = bFound ? uNewestSeq + 1 : 0;
+    }
+
+    /// appends a pending record and returns its offset+1 (0 if it is too long or the journal is not 'ready()');
+    /// '_rSeq' returns its sequence number
+    unsigned short append(unsigned char _uPriority, const char *_pszNumber, const char *_pszText, unsigned short &_rSeq)
+    {
+        size_t uNumberSize = strlen(_pszNumber) + 1;
+        size_t uTextLen = strlen(_pszText);
+        size_t uSize = HEADER_SIZE + uNumberSize + uTextLen + 2;
+        if ( (uNumberSize + uTextLen > 255) || (uSize > m_uSize) || (ready() == false) )
+        {
+            return 0;
+        }
+
+        // records do not wrap, the rest of the region is used again next round
+        if (m_uWrite + uSize > m_uSize)
+        {
+            m_uWrite = 0;
+        }
+
+        countOverwrites(m_uWrite, uSize);
+
+        // build record
+        _rSeq = m_uNextSeq++;
+        m_record[0] = MAGIC_PENDING;
+        m_record[1] = (unsigned char)(uNumberSize + uTextLen);
+        m_record[2] = (unsigned char)(_rSeq & 0xFF);
+        m_record[3] = (unsigned char)(_rSeq >> 8);
+        m_record[4] = _uPriority;
+        memcpy(m_record + HEADER_SIZE, _pszNumber, uNumberSize);
+        memcpy(m_record + HEADER_SIZE + uNumberSize, _pszText, uTextLen);
+
+        unsigned short uCrc = 0xFFFF;
+        for (size_t i = 1; i < uSize - 2; i++)
+        {
+            uCrc = crc16Update(uCrc, m_record[i]);
+        }
+
+        m_record[uSize - 2] = (unsigned char)(uCrc >> 8);
+        m_record[uSize - 1] = (unsigned char)(uCrc & 0xFF);
+
+        m_uRecordOffset = m_uWrite;
+        m_uRecordSize = (unsigned short)uSize;
+        m_uRecordPos = 1;
+        m_uWrite += uSize;
+
+        update();
+        return m_uRecordOffset + 1;
+    }
+
+    /// marks the record (offset+1 and sequence number returned by 'append()') as sent
+    void ack(unsigned short _uOffset, unsigned short _uSeq)
+    {
+        // record still being written (its magic byte is written last)
+        if ( (m_uRecordSize > 0) && (_uOffset - 1 == m_uRecordOffset) )
+        {
+            m_record[0] = MAGIC_SENT;
+            return;
+        }
+
+        if (m_ackQueue.full() == true)
+        {
+            flush();
+        }
+
+        sAck ack = {(unsigned short)(_uOffset - 1), _uSeq};
+        m_ackQueue.push(ack);
+        update();
+    }
+
+    /// writes buffered bytes while the EEPROM is ready
+    void update()
+    {
+        while ( (busy() == true) && (SMSJOURNAL_EEPROM_READY()) )
+        {
+            if (m_uRecordSize > 0)
+            {
+                // record body first, the magic byte last (a record is only valid once it is complete)
+                unsigned short uPos = (m_uRecordPos < m_uRecordSize) ? m_uRecordPos : 0;
+                EEPROM.update(m_uBase + m_uRecordOffset + uPos, m_record[uPos]);
+                m_uRecordPos++;
+                if (m_uRecordPos > m_uRecordSize)
+                {
+                    m_uRecordSize = 0;
+                }
+            }
+            else
+            {
+                sAck ack;
+                m_ackQueue.pop(ack);
+                if ( (EEPROM.read(m_uBase + ack.m_uOffset) == MAGIC_PENDING) && (readSeq(ack.m_uOffset) == ack.m_uSeq) )
+                {
+                    EEPROM.update(m_uBase + ack.m_uOffset, MAGIC_SENT);
+                }
+            }
+        }
+    }
+
+    /// returns true if a record can be appended (the previous one is written)
+    bool ready() const
+    {
+        return m_uRecordSize == 0;
+    }
+
+    /// returns true while writes are buffered
+    bool busy() const
+    {
+        return (m_uRecordSize > 0) || (m_ackQueue.empty() == false);
+    }
+
+    /// writes all buffered bytes (blocking)
+    void flush()
+    {
+        while (busy() == true)
+        {
+            update();
+        }
+    }
+
+    /**
+      Finds the pending record that follows the one with sequence number '_rSeq' (the oldest one if '_bFirst' is
+      true); returns false if there are no more, otherwise '_rSeq' and '_rOffset' (offset+1) return the record.
+    */
+    bool nextPending(unsigned short &_rSeq, unsigned short &_rOffset, bool _bFirst) const
+    {
+        unsigned short uAfterAge = _bFirst ? 0xFFFF : (unsigned short)(m_uNextSeq - _rSeq);
+        bool bFound = false;
+        unsigned short uBestAge = 0;
+        for (unsigned short o = 0; o < m_uSize;)
+        {
+            unsigned short uSize = recordSize(o);
+            if (uSize == 0)
+            {
+                o++;
+                continue;
+            }
+
+            unsigned short uSeq = readSeq(o);
+            unsigned short uAge = m_uNextSeq - uSeq;     // older records are further behind the next sequence number
+            if ( (EEPROM.read(m_uBase + o) == MAGIC_PENDING) &&
+                 ( (_bFirst == true) || (uAge < uAfterAge) ) &&
+                 ( (bFound == false) || (uAge > uBestAge) ) )
+            {
+                bFound = true;
+                uBestAge = uAge;
+                _rSeq = uSeq;
+                _rOffset = o + 1;
+            }
+
+            o += uSize;
+        }
+
+        return bFound;
+    }
+
+    /// reads the record at '_uOffset' (offset+1); number and text are truncated to the buffer sizes (returns false then)
+    bool read(unsigned short _uOffset, unsigned char &_rPriority, char *_pszNumber, size_t _uNumberSize, char *_pszText, size_t _uTextSize) const
+    {
+        unsigned short o = m_uBase + _uOffset - 1;
+        unsigned char uLen = EEPROM.read(o + 1);
+        _rPriority = EEPROM.read(o + 4);
+
+        bool bComplete = true;
+        size_t i = 0;
+        size_t n = 0;
+        for (; (i < uLen) && (EEPROM.read(o + HEADER_SIZE + i) != '\0'); i++)
+        {
+            if (n + 1 < _uNumberSize) _pszNumber[n++] = EEPROM.read(o + HEADER_SIZE + i);
+            else bComplete = false;
+        }
+
+        _pszNumber[n] = '\0';
+
+        n = 0;
+        for (i++; i < uLen; i++)
+        {
+            if (n + 1 < _uTextSize) _pszText[n++] = EEPROM.read(o + HEADER_SIZE + i);
+            else bComplete = false;
+        }
+
+        _pszText[n] = '\0';
+        return bComplete;
+    }
+
+    /// number of pending records that were overwritten
+    unsigned short lostCount() const {return m_uLostCount;}
+
+  private:
+    struct sAck
+    {
+        unsigned short  m_uOffset;
+        unsigned short  m_uSeq;
+    };
+
+    /// size of the valid record at '_uOffset', or 0 if there is none
+    unsigned short recordSize(unsigned short _uOffset) const
+    {
+        unsigned char uMagic = EEPROM.read(m_uBase + _uOffset);
+        if ( ( (uMagic != MAGIC_PENDING) && (uMagic != MAGIC_SENT) ) ||
+             (_uOffset + HEADER_SIZE + 2 > m_uSize) )
+        {
+            return 0;
+        }
+
+        unsigned short uSize = HEADER_SIZE + EEPROM.read(m_uBase + _uOffset + 1) + 2;
+        if (_uOffset + uSize > m_uSize)
+        {
+            return 0;
+        }
+
+        unsigned short uCrc = 0xFFFF;
+        for (unsigned short i = 1; i < uSize - 2; i++)
+        {
+            uCrc = crc16Update(uCrc, EEPROM.read(m_uBase + _uOffset + i));
+        }
+
+        if ( (EEPROM.read(m_uBase + _uOffset + uSize - 2) != (uCrc >> 8)) ||
+             (EEPROM.read(m_uBase + _uOffset + uSize - 1) != (uCrc & 0xFF)) )
+        {
+            return 0;
+        }
+
+        return uSize;
+    }
+
+    unsigned short readSeq(unsigned short _uOffset) const
+    {
+        return EEPROM.read(m_uBase + _uOffset + 2) | ((unsigned short)EEPROM.read(m_uBase + _uOffset + 3) << 8);
+    }
+
+    /// counts the pending records that start in the bytes about to be overwritten
+    void countOverwrites(unsigned short _uOffset, size_t _uSize)
+    {
+        for (unsigned short o = _uOffset; o < _uOffset + _uSize;)
+        {
+            unsigned short uSize = recordSize(o);
+            if (uSize == 0)
+            {
+                o++;
+                continue;
+            }
+
+            if ( (EEPROM.read(m_uBase + o) == MAGIC_PENDING) && (m_uLostCount < 0xFFFF) )
+            {
+                m_uLostCount++;
+            }
+
+            o += uSize;
+        }
+    }
+
+  private:
+    const unsigned short    m_uBase;
+    const unsigned short    m_uSize;
+    unsigned short          m_uWrite;                       ///< offset of the next record
+    unsigned short          m_uNextSeq;
+    unsigned char           m_record[MAX_RECORD_SIZE];      ///< record being written
+    unsigned short          m_uRecordSize;                  ///< 0 if no record is being written
+    unsigned short          m_uRecordPos;                   ///< next byte of the record to write (the magic byte is written last)
+    unsigned short          m_uRecordOffset;
+    Queue<sAck, ACK_QUEUE_SIZE> m_ackQueue;                 ///< acks waiting to be written
+    unsigned short          m_uLostCount;
+};
+
+
+
+
+#endif  // #ifndef SMSJOURNAL_H
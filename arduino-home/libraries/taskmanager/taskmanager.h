@@ -4,6 +4,7 @@
 
 
 #include <Arduino.h>
+#include <avr/sleep.h>
 
 
 
@@ -21,14 +22,114 @@ void reset()
 /// checks tha available RAM
 int freeRam()
 {
+#ifdef __AVR__
     extern int __heap_start, *__brkval;
     int v;
     
     return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval);
+#else
+    return 0;   // no AVR heap/stack layout on the host
+#endif
 }
 
 
-///< simple task manager class that help split program into small tasks with three priority levels
+/**
+  Execution time statistics: call count, min/max/mean time and a log2 histogram ([us]).
+  Bucket i counts durations of 2^i to 2^(i+1)-1 us (bucket 0 also counts 0us, the last bucket everything longer).
+*/
+class TaskStats
+{
+public:
+    static const int    BUCKETS = 16;
+    
+public:
+    TaskStats()
+    {
+        reset();
+    }
+    
+    void reset()
+    {
+        m_uCount = 0;
+        m_uMinUs = 0xFFFFFFFF;
+        m_uMaxUs = 0;
+        m_uTotalUs = 0;
+        memset(m_uHist, 0, sizeof(m_uHist));
+    }
+    
+    void add(unsigned long _uUs)
+    {
+        // halve totals before they overflow (keeps the mean)
+        if (m_uTotalUs + _uUs < m_uTotalUs)
+        {
+            m_uTotalUs /= 2;
+            m_uCount /= 2;
+        }
+        
+        m_uCount++;
+        m_uTotalUs += _uUs;
+        if (_uUs < m_uMinUs) m_uMinUs = _uUs;
+        if (_uUs > m_uMaxUs) m_uMaxUs = _uUs;
+        
+        int i = 0;
+        for (unsigned long v = _uUs >> 1; (v > 0) && (i < BUCKETS-1); v >>= 1)
+        {
+            i++;
+        }
+        
+        if (m_uHist[i] < 0xFFFF)
+        {
+            m_uHist[i]++;
+        }
+    }
+    
+    /// print one line: count, min, mean, max and histogram
+    void print(Print &_rOut) const
+    {
+        _rOut.print(m_uCount);
+        _rOut.print(' ');
+        _rOut.print(minUs());
+        _rOut.print(' ');
+        _rOut.print(meanUs());
+        _rOut.print(' ');
+        _rOut.print(m_uMaxUs);
+        _rOut.print(" |");
+        
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            _rOut.print(' ');
+            _rOut.print(m_uHist[i]);
+        }
+        
+        _rOut.println();
+    }
+    
+    unsigned long count() const {return m_uCount;}
+    unsigned long minUs() const {return (m_uCount > 0) ? m_uMinUs : 0;}
+    unsigned long maxUs() const {return m_uMaxUs;}
+    unsigned long meanUs() const {return (m_uCount > 0) ? m_uTotalUs / m_uCount : 0;}
+    unsigned short bucket(int _i) const {return m_uHist[_i];}
+    
+private:
+    unsigned long       m_uCount;
+    unsigned long       m_uMinUs;
+    unsigned long       m_uMaxUs;
+    unsigned long       m_uTotalUs;
+    unsigned short      m_uHist[BUCKETS];
+};
+
+
+/**
+  Deadline driven task manager with three priority levels.
+  Tasks are registered with a period and/or a ready predicate:
+  - periodic tasks are kept in a min-heap ordered by deadline (priority breaks ties) and only run when due;
+  - tasks with a ready predicate run whenever the predicate returns true;
+  - tasks without either run on every pass.
+  Each 'run()' executes the due tasks in deadline order, followed by the ready tasks in priority order. If nothing
+  ran, the MCU can idle-sleep until the next interrupt (the 1ms timer tick or UART input).
+  Define TASKMANAGER_PROFILE before including this file to record per task and per pass execution times.
+*/
+template <int MAX_TASKS = 8>
 class TaskManager
 {
 public:
@@ -39,67 +140,298 @@ public:
         ETP_LOW,
         ETP_COUNT    ///< number of priority values
     };
-    
-protected:
-    const static int    MAX_TASKS = 8;
+
     typedef void        (*TaskFunc)();
-    
+    typedef bool        (*ReadyFunc)();     ///< returns true if the task has work
+
+protected:
+    struct sTask
+    {
+        TaskFunc            m_fpTask;
+        ReadyFunc           m_fpReady;
+        unsigned long       m_uPeriodMs;        ///< 0 if the task is not periodic
+        unsigned long       m_uDeadline;        ///< [ms] next due time of periodic tasks
+        unsigned char       m_uPriority;
+        bool                m_bPolled;          ///< task runs when ready (or on every pass if there is no ready predicate)
+        bool                m_bRan;             ///< task already ran during the current pass
+#ifdef TASKMANAGER_PROFILE
+        const char          *m_pszName;
+        TaskStats           m_stats;
+#endif
+    };
+
 public:
     TaskManager()
+        :m_uNumTasks(0),
+         m_uHeapSize(0),
+         m_uNumPolled(0),
+         m_bIdleSleep(false)
+    {
+    }
+
+    /// add task that runs every '_uPeriodMs' (if > 0) and/or when '_fpReady' returns true; tasks without either run on every pass
+    bool addTask(TaskFunc _fpTask, ePriority _ePriority, unsigned long _uPeriodMs = 0, ReadyFunc _fpReady = NULL, const char *_pszName = NULL)
+    {
+        if (m_uNumTasks >= MAX_TASKS)
+        {
+            return false; // failed
+        }
+
+        unsigned char id = m_uNumTasks;
+        sTask &task = m_tasks[id];
+        task.m_fpTask = _fpTask;
+        task.m_fpReady = _fpReady;
+        task.m_uPeriodMs = _uPeriodMs;
+        task.m_uDeadline = millis();
+        task.m_uPriority = _ePriority;
+        task.m_bPolled = (_fpReady != NULL) || (_uPeriodMs == 0);
+        task.m_bRan = false;
+#ifdef TASKMANAGER_PROFILE
+        task.m_pszName = (_pszName != NULL) ? _pszName : "-";
+#else
+        (void)_pszName;     // only kept for the statistics
+#endif
+        m_uNumTasks++;
+
+        if (_uPeriodMs > 0)
+        {
+            m_heap[m_uHeapSize] = id;
+            m_uHeapSize++;
+            siftUp(m_uHeapSize - 1);
+        }
+
+        // keep polled tasks sorted by priority
+        if (task.m_bPolled == true)
+        {
+            size_t i = m_uNumPolled;
+            while ( (i > 0) && (m_tasks[m_polled[i-1]].m_uPriority > task.m_uPriority) )
+            {
+                m_polled[i] = m_polled[i-1];
+                i--;
+            }
+
+            m_polled[i] = id;
+            m_uNumPolled++;
+        }
+
+        return true;  // success
+    }
+
+    /// idle-sleep the MCU when no task ran during a pass
+    void setIdleSleep(bool _bIdleSleep)
+    {
+        m_bIdleSleep = _bIdleSleep;
+    }
+
+    /// run all due and ready tasks once
+    void run()
+    {
+#ifdef TASKMANAGER_PROFILE
+        const unsigned long uStartUs = micros();
+#endif
+        const unsigned long uNow = millis();
+        bool bRan = false;
+
+        // due tasks (a task re-armed during this pass is not due again before the next pass)
+        while ( (m_uHeapSize > 0) &&
+                ((long)(uNow - m_tasks[m_heap[0]].m_uDeadline) >= 0) )
+        {
+            sTask &task = m_tasks[m_heap[0]];
+            execute(task);
+            task.m_bRan = true;
+            bRan = true;
+
+            // re-arm, skipping missed periods
+            task.m_uDeadline += task.m_uPeriodMs;
+            if ((long)(uNow - task.m_uDeadline) >= 0)
+            {
+                task.m_uDeadline = uNow + task.m_uPeriodMs;
+            }
+
+            siftDown(0);
+        }
+
+        // ready tasks
+        for (size_t i = 0; i < m_uNumPolled; i++)
+        {
+            sTask &task = m_tasks[m_polled[i]];
+            if ( (task.m_bRan == false) &&
+                 ((task.m_fpReady == NULL) || (task.m_fpReady() == true)) )
+            {
+                execute(task);
+                bRan = true;
+            }
+
+            task.m_bRan = false;
+        }
+
+#ifdef TASKMANAGER_PROFILE
+        if (bRan == true)
+        {
+            m_loopStats.add(micros() - uStartUs);
+        }
+#endif
+        
+        if ( (bRan == false) &&
+             (m_bIdleSleep == true) )
+        {
+            idle();
+        }
+    }
+
+    /// time until the next periodic task is due ([ms], 0 if a task is due now or there are no periodic tasks)
+    unsigned long timeToNextDeadline()
     {
-        memset(m_uNumTasks, 0, sizeof(size_t) * ETP_COUNT);
-        memset(m_uRunCount, 0, sizeof(size_t) * ETP_COUNT);
+        if (m_uHeapSize == 0)
+        {
+            return 0;
+        }
+
+        long dt = (long)(m_tasks[m_heap[0]].m_uDeadline - millis());
+        return (dt > 0) ? (unsigned long)dt : 0;
     }
+
+    size_t taskCount() const {return m_uNumTasks;}
+    
+#ifdef TASKMANAGER_PROFILE
+    /// execution time of each task and of passes that ran at least one task
+    const TaskStats &taskStats(size_t _i) const {return m_tasks[_i].m_stats;}
+    const char *taskName(size_t _i) const {return m_tasks[_i].m_pszName;}
+    const TaskStats &loopStats() const {return m_loopStats;}
     
-    bool addTask(TaskFunc _fpTask, ePriority _ePriority)
+    void resetStats()
     {
-        if (m_uNumTasks[_ePriority] < MAX_TASKS)
+        for (size_t i = 0; i < m_uNumTasks; i++)
         {
-            size_t &taskCount = m_uNumTasks[_ePriority];
-            m_tasks[_ePriority][taskCount] = _fpTask;
-            taskCount++;
-            
-            return true;  // success
+            m_tasks[i].m_stats.reset();
         }
         
-        return false; // failed
+        m_loopStats.reset();
     }
     
-    void run()
+    /// print a table of task statistics (count, min, mean, max [us] and log2 histogram)
+    void printStats(Print &_rOut) const
     {
-        runTask(ETP_HIGH);
-        runTask(ETP_HIGH);
-        runTask(ETP_NORMAL);
-        runTask(ETP_HIGH);
-        runTask(ETP_HIGH);
-        runTask(ETP_NORMAL);
-        runTask(ETP_LOW);
+        _rOut.println("task: count min mean max [us] | log2 histogram");
+        for (size_t i = 0; i < m_uNumTasks; i++)
+        {
+            _rOut.print(m_tasks[i].m_pszName);
+            _rOut.print(": ");
+            m_tasks[i].m_stats.print(_rOut);
+        }
+        
+        _rOut.print("run: ");
+        m_loopStats.print(_rOut);
     }
-	
-private:
-    void runTask(ePriority _ePriority)
+    
+    /// short summary for a text message ('name count mean/max' per task, times in [us])
+    char *formatStats(char *_pszBuf, size_t _uSize) const
     {
-        if (m_uNumTasks[_ePriority] > 0)
+        size_t n = 0;
+        _pszBuf[0] = '\0';
+        
+        for (size_t i = 0; (i <= m_uNumTasks) && (n < _uSize); i++)
         {
-            size_t &taskCount = m_uRunCount[_ePriority];
-            m_tasks[_ePriority][taskCount]();
+            const TaskStats &stats = (i < m_uNumTasks) ? m_tasks[i].m_stats : m_loopStats;
+            int iLen = snprintf(_pszBuf + n, _uSize - n, "%s %lu %lu/%lu\n",
+                                (i < m_uNumTasks) ? m_tasks[i].m_pszName : "run",
+                                stats.count(), stats.meanUs(), stats.maxUs());
+            if (iLen < 0)
+            {
+                break;
+            }
             
-            taskCount++;
-            if (taskCount >= m_uNumTasks[_ePriority])
+            n += iLen;
+        }
+        
+        return _pszBuf;
+    }
+#endif
+
+private:
+    void execute(sTask &_rTask)
+    {
+#ifdef TASKMANAGER_PROFILE
+        unsigned long t = micros();
+        _rTask.m_fpTask();
+        _rTask.m_stats.add(micros() - t);
+#else
+        _rTask.m_fpTask();
+#endif
+    }
+    
+    /// sleep until the next interrupt (timer tick or UART)
+    void idle()
+    {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sleep_cpu();
+        sleep_disable();
+    }
+
+    /// true if task _a should run before task _b
+    bool before(unsigned char _a, unsigned char _b) const
+    {
+        long dt = (long)(m_tasks[_a].m_uDeadline - m_tasks[_b].m_uDeadline);
+        return (dt < 0) || ((dt == 0) && (m_tasks[_a].m_uPriority < m_tasks[_b].m_uPriority));
+    }
+
+    void siftUp(size_t _i)
+    {
+        while (_i > 0)
+        {
+            size_t parent = (_i - 1) / 2;
+            if (before(m_heap[_i], m_heap[parent]) == false)
+            {
+                break;
+            }
+
+            swap(_i, parent);
+            _i = parent;
+        }
+    }
+
+    void siftDown(size_t _i)
+    {
+        for (;;)
+        {
+            size_t first = _i;
+            size_t left = 2 * _i + 1;
+            size_t right = left + 1;
+
+            if ( (left < m_uHeapSize) && (before(m_heap[left], m_heap[first]) == true) ) first = left;
+            if ( (right < m_uHeapSize) && (before(m_heap[right], m_heap[first]) == true) ) first = right;
+            if (first == _i)
             {
-                taskCount = 0;
+                break;
             }
+
+            swap(_i, first);
+            _i = first;
         }
     }
-	
+
+    void swap(size_t _i, size_t _j)
+    {
+        unsigned char tmp = m_heap[_i];
+        m_heap[_i] = m_heap[_j];
+        m_heap[_j] = tmp;
+    }
+
 private:
-    TaskFunc            m_tasks[ETP_COUNT][MAX_TASKS];    ///< high priority tasks
-    size_t              m_uNumTasks[ETP_COUNT];
-    size_t              m_uRunCount[ETP_COUNT];
+    sTask               m_tasks[MAX_TASKS];
+    unsigned char       m_heap[MAX_TASKS];          ///< periodic tasks, min-heap by deadline
+    unsigned char       m_polled[MAX_TASKS];        ///< ready/always tasks, sorted by priority
+    size_t              m_uNumTasks;
+    size_t              m_uHeapSize;
+    size_t              m_uNumPolled;
+    bool                m_bIdleSleep;
+#ifdef TASKMANAGER_PROFILE
+    TaskStats           m_loopStats;
+#endif
 };
 
 
 
 
 #endif //#ifndef LIBTASKMANAGER_H
-
@@ -8,96 +8,83 @@
 
 
 /** 
-  Class for generating xbee AT commands.
-  Use 'addCommand(...)' to add AT commands and the use 'executeCommands(...)' to send all the commands to the XBee.
+  Class for xbee AT commands in transparent mode.
+  'enterCommandMode()' sends the '+++' guard sequence, then 'query(...)' reads and 'command(...)' sets parameters (one
+  command per line, values in hex) until 'exitCommandMode()'.
 */
 class XBeeCmd
 {
-  private:
-    static const int BUF_SIZE = 128; ///< command buffer size (there is no checking for overflow when adding too many commands)
+  public:
+    static const unsigned long  DEFAULT_GUARD_TIME_MS = 1000;   ///< factory guard time (GT)
+    static const unsigned long  RESPONSE_TIMEOUT_MS = 100;      ///< maximum time until a command response
     
   public:
     XBeeCmd(Stream &_serial)
         :m_serial(_serial)
     {
-        clearCommandBuffer();
     }
     
     virtual ~XBeeCmd()
     {
     }
     
-    /// clear current command buffer
-    void clearCommandBuffer()
-    {
-        m_pszCmdBuffer[0] = 'A';
-        m_pszCmdBuffer[1] = 'T';
-        m_pszCmdBuffer[2] = '\0';
-    }
-
-    /// add a single AT command
-    void addCommand(const char *_pszCmd)
+    /// send the '+++' sequence for the radio's guard time (GT) and return true if the radio replies 'OK'
+    bool enterCommandMode(unsigned long _uGuardTimeMs = DEFAULT_GUARD_TIME_MS)
     {
-        if (m_pszCmdBuffer[0] != '\0')
-        {
-            strcat(m_pszCmdBuffer, ",");
-        }
+        // flush and make sure the line is idle for the guard time before and after the sequence
+        flush();
+        delay(_uGuardTimeMs + _uGuardTimeMs/10);
         
-        strcat(m_pszCmdBuffer, _pszCmd);
+        m_serial.print("+++");
+        return readOk(_uGuardTimeMs + _uGuardTimeMs/10 + RESPONSE_TIMEOUT_MS);
     }
     
-    /// add a single at command with a string parameter
-    void addCommand(const char *_pszCmd, const char *_pszParam)
+    /// leave command mode (changed parameters, like the baud rate, are applied now)
+    bool exitCommandMode()
     {
-        addCommand(_pszCmd);
-        strcat(m_pszCmdBuffer, _pszParam);
+        return command("CN");
     }
     
-    /// add a single at command with a integer parameter
-    void addCommand(const char *_pszCmd, int _iParam)
+    /// read a parameter value (hex) and return true if the radio replied with a value
+    bool query(const char *_pszCmd, unsigned long &_rValue)
     {
-        addCommand(_pszCmd);
-        itoa(_iParam, m_pszItoaBuf, 16);
-        strcat(m_pszCmdBuffer, m_pszItoaBuf);
-    }
-    
-    /// add a single at command with a integer parameter
-    void addCommand(const char *_pszCmd, unsigned short _uParam)
-    {
-        addCommand(_pszCmd);
-        itoa(_uParam, m_pszItoaBuf, 16);
-        strcat(m_pszCmdBuffer, m_pszItoaBuf);
-    }
-    
-    /// execute commands in command buffer and return true if successfull
-    bool executeCommands()
-    {
-        // start
-        enterAtCommandMode();
+        m_serial.print("AT");
+        m_serial.print(_pszCmd);
+        m_serial.print('\r');
+        
+        char buf[20];
+        unsigned int n = readln(buf, sizeof(buf) - 1, RESPONSE_TIMEOUT_MS, false);
+        buf[n] = '\0';
         
-        // read response
-        char buf[2];
-        int n = read(buf, 2);
         if ( (n == 0) ||
-             (buf[0] != 'O') )
+             (isxdigit(buf[0]) == 0) )
         {
-            return false;
-        } 
-
-        // write command        
-        for (size_t i = 0; m_pszCmdBuffer[i]!='\0'; i++)
-        {
-            m_serial.write(m_pszCmdBuffer[i]);
-            delay(50);
+            return false;   // no response or ERROR
         }
         
-        m_serial.write('\r');
-        clearCommandBuffer();
-        flush();
-        
+        _rValue = strtoul(buf, NULL, 16);
         return true;
     }
     
+    /// execute command without a parameter and return true if the radio replied 'OK'
+    bool command(const char *_pszCmd)
+    {
+        m_serial.print("AT");
+        m_serial.print(_pszCmd);
+        m_serial.print('\r');
+        return readOk(RESPONSE_TIMEOUT_MS);
+    }
+    
+    /// set a parameter (hex) and return true if the radio replied 'OK'
+    bool command(const char *_pszCmd, unsigned long _uParam)
+    {
+        m_serial.print("AT");
+        m_serial.print(_pszCmd);
+        m_serial.print(_uParam, HEX);
+        m_serial.print('\r');
+        return readOk(RESPONSE_TIMEOUT_MS);
+    }
+    
     /// return stream being used for XBee IO
     Stream &stream()
     {
@@ -124,26 +111,324 @@ class XBeeCmd
     
     
   protected:
-    void enterAtCommandMode()
+    bool readOk(unsigned long _uTimeOutMs)
     {
-        // wait and flush to make sure rx buffer is clean before we program
-        delay(1100);
-        flush();
-        
-        m_serial.print("+");
-        delay(100);
-        m_serial.print("+");
-        delay(100);
-        m_serial.print("+");
-        
-        delay(1100);
+        char buf[3];
+        unsigned int n = readln(buf, sizeof(buf), _uTimeOutMs, false);
+        return (n == 2) && (buf[0] == 'O') && (buf[1] == 'K');
     }
  
     
    private:
     Stream        &m_serial;
-    char          m_pszCmdBuffer[BUF_SIZE];
-    char          m_pszItoaBuf[8];
+};
+
+
+/**
+  XBee API mode (AP=2) frame parser and builder for 802.15.4 (series 1) radios.
+  A frame is 0x7E, length[2], API id, frame data, checksum (0xFF minus the sum of API id and frame data). After the
+  start delimiter, 0x7E, 0x7D, 0x11 and 0x13 are sent as 0x7D, byte ^ 0x20.
+  'poll()' only reads the bytes that are available and never waits; a received frame stays valid until the next
+  'poll()'. Requests return their frame id (never 0), which the matching TX status or AT response carries.
+*/
+class XBeeApi
+{
+  public:
+    static const unsigned int   RX_FRAME_SIZE = 110;            ///< maximum API id and frame data size (RF payload is at most 100 bytes)
+    static const unsigned short BROADCAST_ADDR = 0xFFFF;
+    static const unsigned char  TX_OPT_NO_ACK = 0x01;           ///< TX request option: disable retries and acks
+    
+    enum eApiId
+    {
+        EXA_TX_REQUEST_16 = 0x01,
+        EXA_AT_COMMAND = 0x08,
+        EXA_RX_64 = 0x80,
+        EXA_RX_16 = 0x81,
+        EXA_AT_RESPONSE = 0x88,
+        EXA_TX_STATUS = 0x89,
+        EXA_MODEM_STATUS = 0x8A,
+    };
+    
+    enum eTxStatus
+    {
+        EXT_SUCCESS = 0,
+        EXT_NO_ACK,
+        EXT_CCA_FAILURE,
+        EXT_PURGED,
+    };
+    
+    enum eAtStatus
+    {
+        EXS_OK = 0,
+        EXS_ERROR,
+        EXS_INVALID_COMMAND,
+        EXS_INVALID_PARAM,
+    };
+    
+  public:
+    XBeeApi(Stream &_serial)
+        :m_serial(_serial),
+         m_iRxPos(-1),
+         m_uRxLength(0),
+         m_uRxSum(0),
+         m_bRxEscape(false),
+         m_uLength(0),
+         m_uTxSum(0),
+         m_uFrameId(0),
+         m_uErrorCount(0)
+    {
+        m_frame[0] = 0;
+    }
+    
+    /// read available bytes until a frame is complete; returns true if a valid frame was received
+    bool poll()
+    {
+        while (m_serial.available() > 0)
+        {
+            if (put(m_serial.read()) == true)
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    /// process one received byte; returns true if it completed a valid frame
+    bool put(unsigned char _uByte)
+    {
+        if (_uByte == START)
+        {
+            if (m_iRxPos > 0)
+            {
+                m_uErrorCount++;    // incomplete frame
+            }
+            
+            m_iRxPos = 0;
+            m_uRxLength = 0;
+            m_uRxSum = 0;
+            m_bRxEscape = false;
+            return false;
+        }
+        
+        if (m_iRxPos < 0)
+        {
+            return false;           // waiting for start delimiter
+        }
+        
+        if (_uByte == ESC)
+        {
+            m_bRxEscape = true;
+            return false;
+        }
+        
+        if (m_bRxEscape == true)
+        {
+            _uByte ^= 0x20;
+            m_bRxEscape = false;
+        }
+        
+        // length (MSB first)
+        if (m_iRxPos < 2)
+        {
+            m_uRxLength = (m_uRxLength << 8) | _uByte;
+            m_iRxPos++;
+            
+            if ( (m_iRxPos == 2) &&
+                 ( (m_uRxLength == 0) || (m_uRxLength > RX_FRAME_SIZE) ) )
+            {
+                m_uErrorCount++;
+                m_iRxPos = -1;
+            }
+            
+            return false;
+        }
+        
+        // API id and frame data
+        if ((unsigned int)m_iRxPos - 2 < m_uRxLength)
+        {
+            m_frame[m_iRxPos - 2] = _uByte;
+            m_uRxSum += _uByte;
+            m_iRxPos++;
+            return false;
+        }
+        
+        // checksum, and the fixed header of the API id (so the accessors never read beyond the frame)
+        m_iRxPos = -1;
+        if ( ((unsigned char)(m_uRxSum + _uByte) != 0xFF) || (m_uRxLength < headerSize(m_frame[0])) )
+        {
+            m_uErrorCount++;
+            return false;
+        }
+        
+        m_uLength = m_uRxLength;
+        return true;
+    }
+    
+    /// send data to a 16 bit address (returns frame id of the TX status, or 0 if '_uOptions' has TX_OPT_NO_ACK)
+    unsigned char sendTx16(unsigned short _uDestAddr, const void *_pData, unsigned char _uSize, unsigned char _uOptions = 0)
+    {
+        unsigned char uFrameId = (_uOptions & TX_OPT_NO_ACK) ? 0 : nextFrameId();
+        
+        beginFrame(EXA_TX_REQUEST_16, uFrameId, 3 + _uSize);
+        writeByte(_uDestAddr >> 8);
+        writeByte(_uDestAddr & 0xFF);
+        writeByte(_uOptions);
+        
+        const unsigned char *p = (const unsigned char*)_pData;
+        for (unsigned char i = 0; i < _uSize; i++)
+        {
+            writeByte(p[i]);
+        }
+        
+        endFrame();
+        return uFrameId;
+    }
+    
+    /// send local AT command (applied immediately, no command mode); returns the frame id of the AT response
+    unsigned char sendAtCommand(const char *_pszCmd, const unsigned char *_pParam = NULL, unsigned char _uParamSize = 0)
+    {
+        unsigned char uFrameId = nextFrameId();
+        
+        beginFrame(EXA_AT_COMMAND, uFrameId, 2 + _uParamSize);
+        writeByte(_pszCmd[0]);
+        writeByte(_pszCmd[1]);
+        
+        for (unsigned char i = 0; i < _uParamSize; i++)
+        {
+            writeByte(_pParam[i]);
+        }
+        
+        endFrame();
+        return uFrameId;
+    }
+    
+    /// send local AT command with a 16 bit parameter
+    unsigned char sendAtCommand(const char *_pszCmd, unsigned short _uParam)
+    {
+        unsigned char param[2] = {(unsigned char)(_uParam >> 8), (unsigned char)(_uParam & 0xFF)};
+        return sendAtCommand(_pszCmd, param, 2);
+    }
+    
+    /// read frames until the AT response with the given frame id is received (other frames are dropped); returns false on time out
+    bool waitForAtResponse(unsigned char _uFrameId, unsigned long _uTimeOutMs)
+    {
+        for (unsigned long t = millis(); millis() - t < _uTimeOutMs;)
+        {
+            if ( (poll() == true) &&
+                 (apiId() == EXA_AT_RESPONSE) &&
+                 (atFrameId() == _uFrameId) )
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    /// received frame
+    unsigned char apiId() const {return m_frame[0];}
+    const unsigned char *frameData() const {return m_frame + 1;}
+    unsigned int frameLength() const {return m_uLength - 1;}
+    
+    /// received EXA_RX_16 frame
+    unsigned short rxSourceAddr() const {return (m_frame[1] << 8) | m_frame[2];}
+    unsigned char rxRssi() const {return m_frame[3];}                               ///< [-dBm]
+    bool rxBroadcast() const {return (m_frame[4] & 0x06) != 0;}
+    const unsigned char *rxData() const {return m_frame + 5;}
+    unsigned int rxLength() const {return m_uLength - 5;}
+    
+    /// received EXA_TX_STATUS frame
+    unsigned char txFrameId() const {return m_frame[1];}
+    eTxStatus txStatus() const {return (eTxStatus)m_frame[2];}
+    
+    /// received EXA_AT_RESPONSE frame
+    unsigned char atFrameId() const {return m_frame[1];}
+    bool atCommandIs(const char *_pszCmd) const {return (m_frame[2] == _pszCmd[0]) && (m_frame[3] == _pszCmd[1]);}
+    eAtStatus atStatus() const {return (eAtStatus)m_frame[4];}
+    const unsigned char *atData() const {return m_frame + 5;}
+    unsigned int atDataLength() const {return m_uLength - 5;}
+    
+    /// number of received frames dropped (bad length or checksum, or shorter than the header of their API id)
+    unsigned short errorCount() const {return m_uErrorCount;}
+    
+    Stream &stream() {return m_serial;}
+    
+  private:
+    static const unsigned char  START = 0x7E;
+    static const unsigned char  ESC = 0x7D;
+    
+    /// size of API id and fixed frame data of received frames
+    static unsigned int headerSize(unsigned char _uApiId)
+    {
+        switch (_uApiId)
+        {
+            case EXA_RX_16:         return 5;       // API id, source address, RSSI, options
+            case EXA_AT_RESPONSE:   return 5;       // API id, frame id, command, status
+            case EXA_TX_STATUS:     return 3;       // API id, frame id, status
+            default:                return 1;
+        }
+    }
+    
+    unsigned char nextFrameId()
+    {
+        m_uFrameId++;
+        if (m_uFrameId == 0)
+        {
+            m_uFrameId = 1;
+        }
+        
+        return m_uFrameId;
+    }
+    
+    /// write start delimiter, length, API id and frame id ('_uSize' is the size of the data after the frame id)
+    void beginFrame(unsigned char _uApiId, unsigned char _uFrameId, unsigned int _uSize)
+    {
+        unsigned int uLength = _uSize + 2;
+        
+        m_serial.write(START);
+        writeEscaped(uLength >> 8);
+        writeEscaped(uLength & 0xFF);
+        
+        m_uTxSum = 0;
+        writeByte(_uApiId);
+        writeByte(_uFrameId);
+    }
+    
+    void endFrame()
+    {
+        writeEscaped(0xFF - m_uTxSum);
+    }
+    
+    void writeByte(unsigned char _uByte)
+    {
+        m_uTxSum += _uByte;
+        writeEscaped(_uByte);
+    }
+    
+    void writeEscaped(unsigned char _uByte)
+    {
+        if ( (_uByte == START) || (_uByte == ESC) ||
+             (_uByte == 0x11) || (_uByte == 0x13) )
+        {
+            m_serial.write(ESC);
+            _uByte ^= 0x20;
+        }
+        
+        m_serial.write(_uByte);
+    }
+    
+  private:
+    Stream              &m_serial;
+    unsigned char       m_frame[RX_FRAME_SIZE];     ///< API id and frame data of the last received frame
+    int                 m_iRxPos;                   ///< position in the frame being received (-1 while waiting for start)
+    unsigned int        m_uRxLength;
+    unsigned char       m_uRxSum;
+    bool                m_bRxEscape;
+    unsigned int        m_uLength;                  ///< length of the last received frame
+    unsigned char       m_uTxSum;
+    unsigned char       m_uFrameId;
+    unsigned short      m_uErrorCount;
 };
 
 
@@ -154,97 +439,111 @@ class XBeeCmd
 */
 class FioXBee
 {
+  private:
+    static const unsigned long  API_RESPONSE_TIMEOUT_MS = 200;      ///< local AT command response time in API mode
+    static const unsigned short GUARD_TIME_MS = 0x64;               ///< guard time (GT) programmed into the radio [ms]
+    static const size_t         BASE_SETTING_COUNT = 13;
+    
+    struct sSetting
+    {
+        const char          *m_pszCmd;
+        unsigned short      m_uValue;
+    };
+    
   public:
     /// the sleep pin has to be pulled down with a external resistor to keep it low while arduino is resetting (sleep is disabled if sleepPin < 0)
     FioXBee(Stream &_serial, unsigned long _uBaudRate, int _iSleepPin)
         :m_xBee(_serial),
          m_uBaudRate(_uBaudRate),
          m_iSleepPin(_iSleepPin),
-         m_bSleeping(false)
+         m_bSleeping(false),
+         m_bApiMode(false),
+         m_uChangeCount(0)
     {
     }
 
-    /// program xbee for Arduino/FIO program upload, IO, etc. 
+    /// program xbee for Arduino/FIO program upload, IO, etc. (only writes settings that differ)
     bool program(unsigned short _uMyAddr, unsigned short _uPanAddr)
     {
-        // setup sleep pin
-        if (m_iSleepPin >= 0)
+        const sSetting settings[] =
         {
-            pinMode(m_iSleepPin, OUTPUT);
-            digitalWrite(m_iSleepPin, LOW);
-        }
+            {"BD", getBaudRateCode(m_uBaudRate)},   // desired baudrate
+            {"ID", _uPanAddr},                      // PAN addr
+            {"MY", _uMyAddr},                       // XBee addr
+            {"DL", 0},                              // send to Prog/Central radio
+            {"D3", 5},
+            {"IC", 0},
+            {"RR", 0},
+            {"IU", 0},
+            {"IA", 0xFFFF},
+            {"RO", 0x10},
+            {"SM", (unsigned short)((m_iSleepPin >= 0) ? 2 : 0)},   // pin sleep mode
+            {"SO", 3},                              // disable on wake-up polling
+            {"AP", (unsigned short)(m_bApiMode ? 2 : 0)},           // API mode with escaped frames
+            {"GT", GUARD_TIME_MS},                  // short guard time for quick command mode at the next boot
+        };
         
-        // program xbee as fio radio
-        m_xBee.addCommand("RE");
-        m_xBee.addCommand("BD", getBaudRateCode(m_uBaudRate));  // desired baudrate
-        m_xBee.addCommand("ID", _uPanAddr);   // PAN addr
-        m_xBee.addCommand("MY", _uMyAddr);    // XBee addr
-        m_xBee.addCommand("DL", "0");         // send to Prog/Central radio
-        m_xBee.addCommand("D3", "5");
-        m_xBee.addCommand("IC", "0");
-        m_xBee.addCommand("RR", "0");    
-        m_xBee.addCommand("IU", "0");
-        m_xBee.addCommand("IA", "FFFF");
-        m_xBee.addCommand("RO", "10");
-        m_xBee.addCommand("SM", (m_iSleepPin >= 0) ? "2" : "0");          // pin sleep mode
-        m_xBee.addCommand("SO", "3");          // disable on wake-up polling
-        m_xBee.addCommand("WR");
-        m_xBee.addCommand("CN");
-        
-        if (m_xBee.executeCommands() == false)
-        {  
-            return false;
-        }
-
-        // setup sleep pin
-        if (m_iSleepPin >= 0)
-        {
-            digitalWrite(m_iSleepPin, m_bSleeping ? HIGH : LOW);
-        }
-        
-        return true;  // success
+        return programSettings(settings, sizeof(settings)/sizeof(settings[0]));
     }
     
-    /// program xbee for Arduino/Programmer program upload, IO, etc. 
+    /// program xbee for Arduino/Programmer program upload, IO, etc. (only writes settings that differ)
     bool program(unsigned short _uPanAddr)
     {
-        // setup sleep pin
-        if (m_iSleepPin >= 0)
-        {
-            pinMode(m_iSleepPin, OUTPUT);
-            digitalWrite(m_iSleepPin, LOW);
-        }
+        sSetting settings[BASE_SETTING_COUNT];
+        baseSettings(settings, _uPanAddr);
+        return programSettings(settings, BASE_SETTING_COUNT);
+    }
+
+    /// program the base radio settings of 'program(_uPanAddr)' with API mode AT commands, which avoids the command mode guard
+    /// times; returns false if the radio does not answer in API mode (see 'setApiMode()')
+    bool programApi(XBeeApi &_rApi, unsigned short _uPanAddr)
+    {
+        sSetting settings[BASE_SETTING_COUNT];
+        baseSettings(settings, _uPanAddr);
         
-        // program xbee as fio radio
-        m_xBee.addCommand("RE");
-        m_xBee.addCommand("BD", getBaudRateCode(m_uBaudRate));  // desired baudrate
-        m_xBee.addCommand("ID", _uPanAddr);   // PAN addr
-        m_xBee.addCommand("MY", "0");          // XBee addr
-        m_xBee.addCommand("DL", "FFFF");       // broadcast to all radios
-        m_xBee.addCommand("D3", "3");
-        m_xBee.addCommand("IC", "8");
-        m_xBee.addCommand("RR", "6");    
-        m_xBee.addCommand("IU", "0");
-        m_xBee.addCommand("IA", "0");
-        m_xBee.addCommand("RO", "10");
-        m_xBee.addCommand("SM", (m_iSleepPin >= 0) ? "2" : "0");          // pin sleep mode
-        m_xBee.addCommand("WR");
-        m_xBee.addCommand("CN");
-        
-        if (m_xBee.executeCommands() == false)
+        m_uChangeCount = 0;
+        for (size_t i = 0; i < BASE_SETTING_COUNT; i++)
         {
-            return false;   // failed
+            // query current value (big endian)
+            unsigned char uFrameId = _rApi.sendAtCommand(settings[i].m_pszCmd);
+            if (_rApi.waitForAtResponse(uFrameId, API_RESPONSE_TIMEOUT_MS) == false)
+            {
+                return false;
+            }
+            
+            unsigned long uValue = 0;
+            for (unsigned int j = 0; j < _rApi.atDataLength(); j++)
+            {
+                uValue = (uValue << 8) | _rApi.atData()[j];
+            }
+            
+            if ( (_rApi.atStatus() == XBeeApi::EXS_OK) &&
+                 (uValue == settings[i].m_uValue) )
+            {
+                continue;
+            }
+            
+            // write new value
+            uFrameId = _rApi.sendAtCommand(settings[i].m_pszCmd, settings[i].m_uValue);
+            if ( (_rApi.waitForAtResponse(uFrameId, API_RESPONSE_TIMEOUT_MS) == false) ||
+                 (_rApi.atStatus() != XBeeApi::EXS_OK) )
+            {
+                return false;
+            }
+            
+            m_uChangeCount++;
         }
-
-        // setup sleep pin
-        if (m_iSleepPin >= 0)
+        
+        if (m_uChangeCount == 0)
         {
-            digitalWrite(m_iSleepPin, m_bSleeping ? HIGH : LOW);
+            return true;
         }
         
-        return true;  // success
+        unsigned char uFrameId = _rApi.sendAtCommand("WR");
+        return (_rApi.waitForAtResponse(uFrameId, API_RESPONSE_TIMEOUT_MS) == true) &&
+               (_rApi.atStatus() == XBeeApi::EXS_OK);
     }
-
+    
     /// go into sleep mode by setting sleep output pin to HIGH (sleep pin in configured as output in 'init()' during construction)
     /// (the sleep pin has to be pulled down with a external resistor to keep it low while arduino is resetting)
     void sleep(bool _bState)
@@ -283,11 +582,12 @@ class FioXBee
         return m_xBee.read(_pBuf, _uBufSize);
     }
     
-    // try to read until line is idle for _uTimeOutMs, until buffer is full, or until NL or CR is received; returns immediately if no bytes available and _bCheckAvailable == true
-    unsigned int readln(char *_pBuf, unsigned int _uBufSize, unsigned long _uTimeOutMs, bool _bCheckAvailable)
-    {
-        return m_xBee.readln(_pBuf, _uBufSize, _uTimeOutMs, _bCheckAvailable);
-    }
+    /// switch the radio to API mode (AP=2) with the next 'program(...)' (transparent mode otherwise)
+    void setApiMode(bool _bApiMode) {m_bApiMode = _bApiMode;}
+    bool apiMode() const {return m_bApiMode;}
+    
+    /// number of settings written by the last 'program...(...)' (0 if the radio already had the right configuration)
+    unsigned char changeCount() const {return m_uChangeCount;}
     
     unsigned long baudRate() const {return m_uBaudRate;}
     int sleepPin() const {return m_iSleepPin;}
@@ -295,7 +595,77 @@ class FioXBee
     bool sleeping() const {return m_bSleeping;}
     
   private:
-    int getBaudRateCode(unsigned long _uBaudRate)
+    /// base station profile, used in transparent and API mode
+    void baseSettings(sSetting *_pSettings, unsigned short _uPanAddr)
+    {
+        const sSetting settings[BASE_SETTING_COUNT] =
+        {
+            {"BD", getBaudRateCode(m_uBaudRate)},   // desired baudrate
+            {"ID", _uPanAddr},                      // PAN addr
+            {"MY", 0},                              // XBee addr
+            {"DL", 0xFFFF},                         // broadcast to all radios
+            {"D3", 3},
+            {"IC", 8},
+            {"RR", 6},
+            {"IU", 0},
+            {"IA", 0},
+            {"RO", 0x10},
+            {"SM", (unsigned short)((m_iSleepPin >= 0) ? 2 : 0)},   // pin sleep mode
+            {"AP", (unsigned short)(m_bApiMode ? 2 : 0)},           // API mode with escaped frames
+            {"GT", GUARD_TIME_MS},                  // short guard time for quick command mode at the next boot
+        };
+        
+        memcpy(_pSettings, settings, sizeof(settings));
+    }
+    
+    /// query each setting in command mode and only write (and store) the ones that differ; returns false if the radio does not respond
+    bool programSettings(const sSetting *_pSettings, size_t _uCount)
+    {
+        // setup sleep pin
+        if (m_iSleepPin >= 0)
+        {
+            pinMode(m_iSleepPin, OUTPUT);
+            digitalWrite(m_iSleepPin, LOW);
+        }
+        
+        // radios programmed before use the short guard time, new radios the factory guard time
+        m_uChangeCount = 0;
+        if ( (m_xBee.enterCommandMode(GUARD_TIME_MS) == false) &&
+             (m_xBee.enterCommandMode() == false) )
+        {
+            return false;   // failed
+        }
+        
+        bool bSuccess = true;
+        for (size_t i = 0; (i < _uCount) && (bSuccess == true); i++)
+        {
+            unsigned long uValue = 0;
+            if ( (m_xBee.query(_pSettings[i].m_pszCmd, uValue) == false) ||
+                 (uValue != _pSettings[i].m_uValue) )
+            {
+                bSuccess = m_xBee.command(_pSettings[i].m_pszCmd, _pSettings[i].m_uValue);
+                m_uChangeCount++;
+            }
+        }
+        
+        if ( (bSuccess == true) &&
+             (m_uChangeCount > 0) )
+        {
+            bSuccess = m_xBee.command("WR");
+        }
+        
+        m_xBee.exitCommandMode();
+        
+        // setup sleep pin
+        if (m_iSleepPin >= 0)
+        {
+            digitalWrite(m_iSleepPin, m_bSleeping ? HIGH : LOW);
+        }
+        
+        return bSuccess;
+    }
+    
+    unsigned short getBaudRateCode(unsigned long _uBaudRate)
     {
         if (_uBaudRate == 1200) return 0;
         else if (_uBaudRate == 2400) return 1;
@@ -309,10 +679,12 @@ class FioXBee
     }  
   
   private:
-    XBeeCmd        m_xBee;
-    unsigned long  m_uBaudRate;
-    int            m_iSleepPin;     ///< sleep pin is not used (sleep disabled) if m_iSleepPin < 0
-    bool           m_bSleeping;
+    XBeeCmd                     m_xBee;
+    unsigned long               m_uBaudRate;
+    int                         m_iSleepPin;     ///< sleep pin is not used (sleep disabled) if m_iSleepPin < 0
+    bool                        m_bSleeping;
+    bool                        m_bApiMode;
+    unsigned char               m_uChangeCount;
 };
 
 
@@ -5,6 +5,10 @@
 #include <xbee.h>
 #include <blink.h>
 #include <deviceconfig.h>
+#include <containers.h>
+#include <fixedpoint.h>
+#include <adcsampler.h>
+#include <debounce.h>
 
 
 
@@ -20,38 +24,82 @@
 #define              BTY_PIN                       A0
 #define              CHG_PIN                       A1
 #define              TMP_PIN                       A2
+#define              ADC_OVERSAMPLING              1                 ///< analog inputs are the mean of 4 conversions (in ADC noise reduction sleep)
 
 #define              RADIO_PAN_ID                  0x1235            ///< radio network id
 #define              RADIO_BAUD                    57600             ///< radio operating baud
-#define              OUTPUT_BUF_SIZE               64
+#define              OUTPUT_BUF_SIZE               DEVICE_FRAME_MAX_SIZE
+#define              EVENT_BUF_SIZE                8
+#define              DEBOUNCE_MS                   20                ///< [ms] sensor inputs have to stay high for this time after their last edge
+#define              SEND_RETRIES                  2                 ///< retransmissions when the base does not ack a message
+#define              ACK_TIMEOUT_MS                100               ///< [ms] time to wait for the base ack after each transmission
+#define              RETRY_JITTER_MS               50                ///< [ms] retransmissions are delayed randomly by up to this time
+#define              STARTUP_JITTER_MS             2000              ///< [ms] the first message is delayed randomly by up to this time
+#define              LINK_GOOD_RSSI                75                ///< [-dBm] messages the base receives at least this strong are a good link
+#define              LINK_GOOD_ACKS                4                 ///< heartbeat is doubled after this many good first time acks in a row
 
 
 // voltage constants
-#define              DEVICE_VCC                    3.3f             ///< [V] Fio supply voltage
-const float          BTY_DEVIDER                   = 10.0f / (10.0f + 10.0f);
-const float          BTY_RESOLUTION                = DEVICE_VCC / 1023.0f;
-const float          CHG_DEVIDER                   = 10.0f / (10.0f + 10.0f);
-const float          CHG_RESOLUTION                = DEVICE_VCC / 1023.0f;
-const float          TMP_RESOLUTION                = 100.0f * DEVICE_VCC / 1023.0f;
+#define              DEVICE_VCC                    3.3              ///< [V] Fio supply voltage
+#define              BTY_SAVE_CV                   370              ///< [V*100] heartbeat is doubled below this battery voltage
+#define              BTY_CRITICAL_CV               350              ///< [V*100] heartbeat is quadrupled below this battery voltage
+#define              BTY_DEVIDER                   (10.0 / (10.0 + 10.0))
+#define              CHG_DEVIDER                   (10.0 / (10.0 + 10.0))
+const unsigned long  BTY_CV_Q16                    = adcScaleQ16(100.0 * DEVICE_VCC / 1023.0 / BTY_DEVIDER);   ///< [V*100] per ADC count
+const unsigned long  CHG_CV_Q16                    = adcScaleQ16(100.0 * DEVICE_VCC / 1023.0 / CHG_DEVIDER);   ///< [V*100] per ADC count
+const unsigned long  TMP_C_Q16                     = adcScaleQ16(100.0 * DEVICE_VCC / 1023.0);                 ///< [C] per ADC count (10mV/C)
 
 
 // timer constants
 #define              DEVICE_CLOCK_HZ               F_CPU             ///< [Hz]
 #define              TMR_DESIRED_TIMEOUT_S         240               ///< DESIRED_TIMEOUT is the desired time period (in seconds) between timer events
+#define              TMR_JITTER_COUNT              2                 ///< timer events are moved randomly by up to +/- this many WDT ticks
 
 const float          TMR_OVERFLOW_S               = 8.0;             ///< should match WDT timeout (max 8s)
 const unsigned long  TMR_OVERFLOW_COUNT           = (unsigned long)((float)TMR_DESIRED_TIMEOUT_S / (float)TMR_OVERFLOW_S + 0.5f);
 
 
+// events queued by the WDT ISR and loop()
+enum eSensorEvent
+{
+    ESE_TIME = 0,                                         ///< timer count reached TMR_OVERFLOW_COUNT
+    ESE_D2,                                               ///< D2 activations are ready to be sent
+    ESE_D3,                                               ///< D3 activations are ready to be sent
+};
+
+
+// sensor inputs (debouncer input index, the event is ESE_D2 + index)
+enum eSensorInput
+{
+    ESI_D2 = 0,
+    ESI_D3,
+    ESI_ALL = (1 << ESI_D2) | (1 << ESI_D3)               ///< bit mask of all inputs
+};
+
+
+// activations of a sensor input since the last message
+struct sInputActivity
+{
+    unsigned char      _uCount;                           ///< saturates at 255
+    unsigned long      _uFirstTick;                       ///< WDT tick of the first activation
+    unsigned long      _uLastTick;                        ///< WDT tick of the last activation
+};
+
+
 // variables
-volatile bool          gSensorEventD2 = false;            /// set by ISR when D2 goes high
-volatile bool          gSensorEventD3 = false;            /// set by ISR when D3 goes high
-volatile bool          gTimeEvent = false;                /// set by ISR when timer count reaches TMR1_OVERFLOW_COUNT 
-volatile bool          gSensorEventsEnabled = false;      /// sensor events are ignored when flag is false
+RingBuffer<unsigned char, EVENT_BUF_SIZE> gSensorEvents;  /// events pushed by the WDT ISR and loop() and popped by loop()
+EdgeDebouncer<2>       gSensorInputs(DEBOUNCE_MS);        /// edges timestamped by the pin ISRs and confirmed by loop()
+sInputActivity         gInputActivity[2];                 /// activations counted by loop(), sent with the next message
+volatile unsigned char gSensorEventsEnabled = 0;          /// bit mask of the inputs (eSensorInput) that may trigger a message
 volatile unsigned long gTimeEventCounter = 0;             /// current timer ISR count
+volatile unsigned long gTimeEventCount = TMR_OVERFLOW_COUNT; /// timer ISR count of the next timer event (heartbeat with jitter)
+unsigned char          gLinkGoodCount = 0;                /// messages in a row the base acked at once and received well
+volatile unsigned long gWdtTicks = 0;                     /// WDT ISR count (the sensor's clock while it sleeps)
 
 FioXBee                *gRadio = NULL;
 DeviceConfig           *gDeviceConfig = NULL;
+DeviceFrameReader      *gAckReader = NULL;                /// reads ack frames sent back by the base
+AdcSampler             gAdc;                              /// converts the analog inputs while the CPU sleeps
 
 
 // reset func
@@ -66,90 +114,205 @@ ISR(WDT_vect)
     noInterrupts();
     
     // flag a timer event after TMR_OVERFLOW_COUNT number of ISR calls
+    gWdtTicks++;
     gTimeEventCounter++;
-    if (gTimeEventCounter >= TMR_OVERFLOW_COUNT)
+    if (gTimeEventCounter >= gTimeEventCount)
     {
-        gTimeEvent = true;
+        gSensorEvents.try_push(ESE_TIME);
         gTimeEventCounter = 0;
     }
     
-    gSensorEventsEnabled = true;
+    gSensorEventsEnabled = ESI_ALL;
     interrupts();
 }
 
 
-/// ISR for pin interrupt 0 (NOTE: we cannot use delay() here since the timers might be disabled)
+/// ISR for pin interrupt 0 (only timestamps the edge, 'loop()' confirms the activation once the input has settled)
 void interruptEvtD2()
 {
-    if (gSensorEventsEnabled == true)
-    {
-        // perform simple debouncing
-        gSensorEventD2 = true;
-        for (int i = 0; i < 512; i++)
-        {
-            gSensorEventD2 &= digitalRead(EVTD2_INT_PIN) == HIGH;
-        }
-        
-        if (gSensorEventD2 == true)
-        {
-            gSensorEventsEnabled = false; // disable sensor events until next timer event to limit the frequency of sensor events
-            gTimeEventCounter = 0;    // timer event is used as a keepalive and is not required when there are sensor events  
-        }
-    }
+    gSensorInputs.edge(ESI_D2);
 }
 
 
-/// ISR for pin interrupt 1 (NOTE: we cannot use delay() here since the timers might be disabled)
+/// ISR for pin interrupt 1 (only timestamps the edge, 'loop()' confirms the activation once the input has settled)
 void interruptEvtD3()
 {
-    if (gSensorEventsEnabled == true)
+    gSensorInputs.edge(ESI_D3);
+}
+
+
+/// counts the inputs that settled high and queues the events of counted inputs that may trigger a message
+/// NOTE: every activation is counted, but an input triggers at most one message per WDT tick (later activations are
+///       sent with the next message) which bounds the radio traffic of bursts
+void confirmSensorEvents()
+{
+    uint8_t uInputs = gSensorInputs.poll();
+    
+    // NOTE: interrupts are disabled since the WDT ISR pushes events and updates the ticks as well
+    noInterrupts();
+    uint8_t uReady = 0;
+    for (unsigned char i = 0; i < 2; i++)
     {
-        // perform simple debouncing
-        gSensorEventD3 = true;
-        for (int i = 0; i < 512; i++)
+        sInputActivity &activity = gInputActivity[i];
+        if ((uInputs & (1 << i)) != 0)
         {
-            gSensorEventD3 &= digitalRead(EVTD3_INT_PIN) == HIGH;
+            if (activity._uCount == 0)
+            {
+                activity._uFirstTick = gWdtTicks;
+            }
+            
+            activity._uLastTick = gWdtTicks;
+            if (activity._uCount < 255)
+            {
+                activity._uCount++;
+            }
         }
         
-        if (gSensorEventD3 == true)
+        if ( (activity._uCount > 0) && ((gSensorEventsEnabled & (1 << i)) != 0) )
         {
-            gSensorEventsEnabled = false; // disable sensor events until next timer event to limit the frequency of sensor events
-            gTimeEventCounter = 0;    // timer event is used as a keepalive and is not required when there are sensor events  
+            gSensorEvents.try_push(ESE_D2 + i);
+            uReady |= 1 << i;
         }
     }
+    
+    if (uReady != 0)
+    {
+        gSensorEventsEnabled &= ~uReady;    // these inputs trigger no message until next timer event
+        gTimeEventCounter = 0;              // timer event is used as a keepalive and is not required when there are sensor events
+    }
+    
+    interrupts();
 }
 
 
-/// creates radio message
-void createDeviceMsg(char *_pszMessage, unsigned char _uMsgSize, bool _bTimeEvent, bool _bD2Event, bool _bD3Event)
+/// returns the heartbeat [WDT ticks], stretched while the battery is low and while the link to the base is good
+unsigned long heartbeatCount(unsigned short _uBtyVoltage)
 {
-    float fBatteryVoltage = BTY_RESOLUTION * (float)analogRead(BTY_PIN) / BTY_DEVIDER;
-    float fChargeVoltage = CHG_RESOLUTION * (float)analogRead(CHG_PIN) / CHG_DEVIDER;
-    float fTemperature = TMP_RESOLUTION * (float)analogRead(TMP_PIN);
+    unsigned long uCount = TMR_OVERFLOW_COUNT;
+    if (_uBtyVoltage < BTY_CRITICAL_CV)
+    {
+        uCount *= 4;
+    }
+    else if (_uBtyVoltage < BTY_SAVE_CV)
+    {
+        uCount *= 2;
+    }
     
+    if (gLinkGoodCount >= LINK_GOOD_ACKS)
+    {
+        uCount *= 2;
+    }
+    
+    return uCount;
+}
+
+
+/// creates radio message with the input activations since the last message (binary frame, includes the sensor name
+/// if '_bName' is true) and returns its size
+unsigned char createDeviceMsg(unsigned char *_pMessage, bool _bName, bool _bTimeEvent)
+{
     sDeviceData &gDevice = gDeviceConfig->config();
-    gDevice._uBtyVoltage = (unsigned short)(fBatteryVoltage*100 + 0.5);
-    gDevice._uChgVoltage = (unsigned short)(fChargeVoltage*100 + 0.5);
-    gDevice._uTemperature = (unsigned char)(fTemperature + 0.5);
+    gDevice._uBtyVoltage = (unsigned short)scaleAdc(gAdc.sampleNoiseReduced(BTY_PIN, ADC_OVERSAMPLING), BTY_CV_Q16);
+    gDevice._uChgVoltage = (unsigned short)scaleAdc(gAdc.sampleNoiseReduced(CHG_PIN, ADC_OVERSAMPLING), CHG_CV_Q16);
+    gDevice._uTemperature = (unsigned char)scaleAdc(gAdc.sampleNoiseReduced(TMP_PIN, ADC_OVERSAMPLING), TMP_C_Q16);
+    
+    // next timer event after the heartbeat (the base times the sensor out based on it) moved randomly by a few ticks,
+    // so sensors that started together drift apart
+    unsigned long uHeartbeat = heartbeatCount(gDevice._uBtyVoltage);
+    gDevice._uHeartbeat = (unsigned short)(uHeartbeat * (unsigned long)TMR_OVERFLOW_S);
+    noInterrupts();
+    gTimeEventCount = uHeartbeat + random(-TMR_JITTER_COUNT, TMR_JITTER_COUNT + 1);
+    interrupts();
     gDevice._bTimeEvent = _bTimeEvent;
-    gDevice._bD2Event = _bD2Event;
-    gDevice._bD3Event = _bD3Event;
+    gDevice._bD2Event = gInputActivity[ESI_D2]._uCount > 0;
+    gDevice._bD3Event = gInputActivity[ESI_D3]._uCount > 0;
+    gDevice._uD2Count = gInputActivity[ESI_D2]._uCount;
+    gDevice._uD3Count = gInputActivity[ESI_D3]._uCount;
+    
+    // span from the first to the last activation of both inputs
+    unsigned long uFirst = 0, uLast = 0;
+    bool bActive = false;
+    for (unsigned char i = 0; i < 2; i++)
+    {
+        const sInputActivity &activity = gInputActivity[i];
+        if (activity._uCount > 0)
+        {
+            uFirst = ((bActive == false) || (activity._uFirstTick < uFirst)) ? activity._uFirstTick : uFirst;
+            uLast = ((bActive == false) || (activity._uLastTick > uLast)) ? activity._uLastTick : uLast;
+            bActive = true;
+        }
+    }
+    
+    gDevice._uEventSpan = (unsigned short)min((uLast - uFirst) * (unsigned long)TMR_OVERFLOW_S, 0xFFFFul);
+    memset(gInputActivity, 0, sizeof(gInputActivity));
     gDevice._uEventCount++;
     
-    encodeDeviceData(_pszMessage, _uMsgSize, gDevice);
+    return encodeDeviceFrame(_pMessage, gDevice, _bName);
+}
+
+
+/// waits up to ACK_TIMEOUT_MS for the base to ack the current message, returns true if the ack was received
+bool waitForAck()
+{
+    const sDeviceData &device = gDeviceConfig->config();
+    unsigned long uStart = millis();
+    while (millis() - uStart < ACK_TIMEOUT_MS)
+    {
+        if ( (gAckReader->poll() == true) &&
+             (gAckReader->type() == EDF_ACK) &&
+             (gAckReader->addr() == device._uAddr) &&
+             (gAckReader->eventCount() == device._uEventCount) )
+        {
+            return true;
+        }
+    }
+    
+    return false;
 }
 
 
-/// sends radio message (will send the message twice and then sleep the radio)
-void sendDeviceMessage(const char *_pszMessage)
+/// sends radio message (retransmits until the base acks or SEND_RETRIES is used up and then sleeps the radio)
+void sendDeviceMessage(const unsigned char *_pMessage, unsigned char _uSize)
 {
     // wake up radio
     gRadio->sleep(false);
     
-    // send message twice
-    gRadio->stream().println(_pszMessage);
-    waitAndFlash(50, 10, DEVICE_STATUS_LED_PIN);
-    gRadio->stream().println(_pszMessage);
+    // send message and wait for the ack, retries are counted and reported with the next message
+    sDeviceData &device = gDeviceConfig->config();
+    for (unsigned char i = 0; i <= SEND_RETRIES; i++)
+    {
+        if (i > 0)
+        {
+            // random backoff, so sensors whose messages collided do not collide again
+            delay(random(0, RETRY_JITTER_MS));
+            flash(10, DEVICE_STATUS_LED_PIN);
+            if (device._uRetryCount < 0xFF)
+            {
+                device._uRetryCount++;
+            }
+        }
+        
+        gRadio->stream().write(_pMessage, _uSize);
+        if (waitForAck() == true)
+        {
+            // a message that the base acked at once and received well counts as good link (see 'heartbeatCount()')
+            if ( (i == 0) && (gAckReader->link() > 0) && (gAckReader->link() <= LINK_GOOD_RSSI) )
+            {
+                if (gLinkGoodCount < 0xFF)
+                {
+                    gLinkGoodCount++;
+                }
+            }
+            else
+            {
+                gLinkGoodCount = 0;
+            }
+            
+            break;
+        }
+        
+        gLinkGoodCount = 0;
+    }
 
     // sleep radio and wait to make sure device is sleeping
     gRadio->sleep(true);
@@ -168,17 +331,25 @@ void sleepNow()
     byte oldADCSRA = ADCSRA;
     ADCSRA = 0;
     
-    // turn off brown-out enable in software
-    MCUCR = _BV (BODS) | _BV (BODSE);  // turn on brown-out enable select
-    MCUCR = _BV (BODS);        // this must be done within 4 clock cycles of above
-    
-    // go to sleep (will wake on interrupts)
+    // go to sleep (will wake on interrupts) unless an ISR queued work since loop() looked
     set_sleep_mode(SLEEP_MODE_PWR_SAVE);
-    sleep_enable();
-    sleep_mode();
+    noInterrupts();
+    if ( (gSensorEvents.empty() == true) && (gSensorInputs.pending() == false) )
+    {
+        sleep_enable();
+        
+        // turn off brown-out enable in software
+        MCUCR = _BV (BODS) | _BV (BODSE);  // turn on brown-out enable select
+        MCUCR = _BV (BODS);        // this must be done within 4 clock cycles of above
+        
+        interrupts();              // the instruction after 'sei' runs before any interrupt, so no wake up is lost
+        sleep_cpu();
 
-    // execution starts here when device wakes
-    sleep_disable();
+        // execution starts here when device wakes
+        sleep_disable();
+    }
+    
+    interrupts();
     
     // switch on ADC
     ADCSRA = oldADCSRA;
@@ -205,6 +376,8 @@ void setup()
     // setup sensor input pins
     pinMode(EVTD2_INT_PIN, INPUT_PULLUP);
     pinMode(EVTD3_INT_PIN, INPUT_PULLUP);
+    gSensorInputs.addInput(EVTD2_INT_PIN, HIGH);
+    gSensorInputs.addInput(EVTD3_INT_PIN, HIGH);
     
     attachInterrupt(EVTD2_INT_NO, interruptEvtD2, RISING);    
     attachInterrupt(EVTD3_INT_NO, interruptEvtD3, RISING);
@@ -212,6 +385,7 @@ void setup()
     // setup radio module
     Serial.begin(RADIO_BAUD);
     gRadio = new FioXBee(Serial, RADIO_BAUD, RADIO_SLEEP_PIN);
+    gAckReader = new DeviceFrameReader(Serial);
     
     // load device config
     gDeviceConfig = new DeviceConfig(Serial, DEVICE_STATUS_LED_PIN);
@@ -222,6 +396,9 @@ void setup()
     {
         gDeviceConfig->storeToEeprom();
     }
+    
+    // random jitter differs between sensors (seeded with a multiplicative hash of the address)
+    randomSeed(gDeviceConfig->config()._uAddr * 2654435761ul);
             
     // program radio module with new config
     waitAndFlash(1000, 200, DEVICE_STATUS_LED_PIN);
@@ -240,19 +417,21 @@ void setup()
     
     digitalWrite(DEVICE_STATUS_LED_PIN, LOW);
     
-    // output first message
-    char pszOutput[OUTPUT_BUF_SIZE];
-    createDeviceMsg(pszOutput, OUTPUT_BUF_SIZE, false, false, false);
-    sendDeviceMessage(pszOutput);
+    // output first message (with name) after a random delay, so sensors that power up together do not collide
+    delay(random(0, STARTUP_JITTER_MS));
+    unsigned char pOutput[OUTPUT_BUF_SIZE];
+    unsigned char uSize = createDeviceMsg(pOutput, true, false);
+    sendDeviceMessage(pOutput, uSize);
 
-    // wait and init event flags 
+    // wait and drop events from startup
     waitAndFlash(1000, 200, DEVICE_STATUS_LED_PIN);
-    gTimeEvent = false;
-    gSensorEventD2 = false;
-    gSensorEventD3 = false;
+    gSensorEvents.clear();
+    gSensorInputs.clear();
+    memset(gInputActivity, 0, sizeof(gInputActivity));
 
-    // turn on watchdog timer and enable interrupt
+    // turn on watchdog timer and enable interrupt (starting at a random phase of the first heartbeat)
     noInterrupts();
+    gTimeEventCounter = random(0, TMR_OVERFLOW_COUNT);
     MCUSR = 0;
     WDTCSR |= B00011000;
     WDTCSR = B01100001;                  // 8 Second Timeout
@@ -263,18 +442,29 @@ void setup()
 /// arduino loop (look for events and sleep device if nothing is going on)
 void loop()
 {
-    if ( (gTimeEvent == true) || (gSensorEventD2 == true)  || (gSensorEventD3 == true) )
+    confirmSensorEvents();
+    
+    // NOTE: inputs that are settling are waited for, so events of inputs that changed together are sent together
+    if ( (gSensorEvents.empty() == false) && (gSensorInputs.pending() == false) )
     {
-        // create message and send message
-        char pszOutput[OUTPUT_BUF_SIZE];
-        createDeviceMsg(pszOutput, OUTPUT_BUF_SIZE, gTimeEvent, gSensorEventD2, gSensorEventD3);          
-        sendDeviceMessage(pszOutput);
+        // collect all queued events into one message (it carries the activations of all inputs)
+        // NOTE: events that arrive while the message is sent stay queued for the next message
+        bool bEvents[3] = {false, false, false};
+        unsigned char uEvent = 0;
+        while (gSensorEvents.try_pop(uEvent) == true)
+        {
+            bEvents[uEvent] = true;
+        }
         
-        // reset events
-        // NOTE: radio can cause false sensor events, so reset events here 
-        gSensorEventD2 = false;
-        gSensorEventD3 = false;
-        gTimeEvent = false;
+        // create message and send message (the name is only repeated with keepalive messages)
+        unsigned char pOutput[OUTPUT_BUF_SIZE];
+        unsigned char uSize = createDeviceMsg(pOutput, bEvents[ESE_TIME], bEvents[ESE_TIME]);
+        sendDeviceMessage(pOutput, uSize);
+    }
+    else if (gSensorInputs.pending() == true)  // wait for the inputs to settle (idle sleep wakes on the next timer tick)
+    {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_mode();
     }
     else  // go to sleep
     {
@@ -1,13 +1,22 @@
 
  
 #include <stdio.h>
+#include <avr/pgmspace.h>
 #include <EEPROM.h>
 #include <xbee.h>
 #include <blink.h>
 #include <celshield.h>
+#include <smsalerts.h>
+#include <smsjournal.h>
 #include <lcd.h>
 #include <deviceconfig.h>
 #include <containers.h>
+#include <sensorregistry.h>
+#include <fixedpoint.h>
+#include <adcsampler.h>
+
+// define TASKMANAGER_PROFILE to record task execution times (STATS sms and serial dump); it costs about 580 bytes of
+// RAM, so it is off by default ('-DTASKMANAGER_PROFILE=ON' enables it in the host build)
 #include <taskmanager.h>
 
 
@@ -22,37 +31,67 @@
 #define              VIN_PIN                       A0
 #define              LEFTRIGHT_PIN                 A1
 #define              UPDOWN_PIN                    A2
+#define              VIN_OVERSAMPLING              2                 ///< Vin is the mean of 16 conversions per sweep
+#define              ADC_SWEEP_MS                  20                ///< [ms] analog inputs are sampled at this interval
 
 #define              RADIO_PAN_ID                  0x1235            ///< radio network id
 #define              RADIO_BAUD                    57600             ///< radio operating baud
 #define              GPRS_BAUD                     19200             ///< gprs shield operating baud
 
 #define              LCD_SERIAL                    Serial1
+#define              LCD_LOG_WIDTH                 40                ///< characters kept per LCD log line
+#define              LCD_LOG_LINES                 8                 ///< LCD log lines (sensor data is shown by the live views)
+#define              STATS_DUMP_INTERVAL_MS        60000             ///< task statistics are printed to serial at this interval
 #define              GPRS_SERIAL                   Serial2
 #define              RADIO_SERIAL                  Serial3
 
-#define              MAX_SENSORS                   16
-#define              SMS_WAIT_TIME                 1000ul            ///< [ms] time to wait between event sms calls
-#define              SENSOR_TIMEOUT                1000ul*600ul      ///< [ms] maximum time allowed between sensor status updates
+#define              MAX_SENSORS                   40                ///< sensors known to the base station (any radio address), about 12 bytes of RAM each
+#define              SMS_TEXT_SIZE                 306               ///< sensor reports are split into texts of this size (a 2 part concatenated SMS)
+#define              SMS_OUTBOX_SIZE               16                ///< messages waiting to be sent
+#define              SMS_OUTBOX_TEXT_SIZE          512               ///< bytes of numbers and texts of the messages waiting to be sent
+#define              SMS_JOURNAL_EEPROM_BASE       64                ///< EEPROM region of the alerts that were not sent yet (the phone number is at 0)
+#define              SMS_JOURNAL_EEPROM_SIZE       1024
+#define              SENSOR_NAMES_EEPROM_BASE      (SMS_JOURNAL_EEPROM_BASE + SMS_JOURNAL_EEPROM_SIZE)   ///< EEPROM region of the sensor names (10 bytes per sensor)
+#define              ALERT_WINDOW_MS               10000ul           ///< [ms] alerts (other than alarms) are merged into one sms for this long
+#define              ALERT_BUCKET_SIZE             4                 ///< alert sms that may be sent in a burst (the last one only for alarms)
+#define              ALERT_REFILL_MS               1000ul*60ul*5ul   ///< [ms] sustained rate of alert sms
+#define              ALERT_DIGEST_SIZE             240               ///< characters of merged alerts per sms (2 parts, fits a journal record)
+#define              SENSOR_TIMEOUT                1000ul*600ul      ///< [ms] maximum time allowed between status updates of sensors that do not report their heartbeat
+#define              SENSOR_TIMEOUT_HALF_BEATS     5                 ///< sensors that report their heartbeat time out after 2.5 heartbeats
+#define              SENSOR_TIMEOUT_TICK           1000ul*20ul       ///< [ms] timer wheel tick (32 ticks cover SENSOR_TIMEOUT, longer timeouts take more rounds)
 #define              MIN_SENSOR_VB                 360               ///< [V*100] minimum safe voltage for sensor batteries  
 
 
 // voltage constants
-#define              DEVICE_VCC                    5.0f                     ///< [V] Mega supply voltage
-const float          VIN_DEVIDER                   = 1.0f / 3.0f;
-const float          VIN_RESOLUTION                = DEVICE_VCC / 1023.0f;
+#define              DEVICE_VCC_MV                 5000.0                   ///< [mV] Mega supply voltage
+const unsigned long  VIN_MV_Q16                    = adcMilliVoltsQ16(DEVICE_VCC_MV, 1.0 / 3.0);
+#define              VIN_FALL_MV                   50                       ///< [mV] drop below the peak that flags a power failure
+#define              VIN_RISE_MV                   100                      ///< [mV] rise above the minimum that flags power restored
 
 
 // variables
 FioXBee                       *gRadio = NULL;
-LcdScreen                     *gLcd = NULL;
+StaticLcdScreen<LCD_LOG_WIDTH, LCD_LOG_LINES> gLcdScreen(LCD_SERIAL);
+LcdScreen                     *gLcd = &gLcdScreen;
 LcdAnimator                   *gLcdAnimator = NULL;
+AdcSampler                    gAdc;                                 ///< samples Vin and the joystick by interrupt
+StaticSmsOutbox<SMS_OUTBOX_SIZE, SMS_OUTBOX_TEXT_SIZE> gSmsOutbox;
+SmsJournal                    gSmsJournal(SMS_JOURNAL_EEPROM_BASE, SMS_JOURNAL_EEPROM_SIZE);
 GprsSms                       *gGprs = NULL;
-TaskManager                   gTaskManager;
+typedef SmsAlerts<2, ALERT_DIGEST_SIZE> BaseSmsAlerts;
+BaseSmsAlerts                 *gAlerts = NULL;                      ///< merges and rate limits alerts to the owner
+typedef TaskManager<11>       BaseTaskManager;
+BaseTaskManager               gTaskManager;
 
-Queue<sDeviceData, 8>         gDeviceDataQueue;                     ///< sensor status updates are queued until relevant processing task is run
+XBeeApi                       *gRadioApi = NULL;                    ///< radio API frames (used if gRadioApiMode is true)
+bool                          gRadioApiMode = false;                ///< radio is in API mode (AP=2), otherwise in transparent mode
+DeviceFrameReader             *gRadioFrames = NULL;                 ///< decodes sensor frames received by radio
+unsigned short                gRadioVersionErrors = 0;              ///< frames of unknown versions logged so far
+RingBuffer<sDeviceData, 8>    gDeviceDataQueue;                     ///< sensor status updates are queued until relevant processing task is run (full: dropped and counted)
 
-sDeviceData                   gDeviceData[MAX_SENSORS];             ///< keeps last update from all sensors (sensor addr-1 is used as the index)
+typedef SensorRegistry<MAX_SENSORS> BaseSensorRegistry;
+BaseSensorRegistry            gSensors(SENSOR_NAMES_EEPROM_BASE);   ///< keeps last update from all sensors
+TimerWheel<MAX_SENSORS, 32>   gSensorTimeouts(SENSOR_TIMEOUT_TICK); ///< sensor timeouts (timer id is the sensor index), re-armed by each update
 unsigned long                 gAlarmOffTime = 0;                    ///< time when alarm will be switched off, set when sensor event occurs
 unsigned short                gRxCounter = 0;                       ///< counts the number of messages received from sensors
 
@@ -62,119 +101,267 @@ bool                          gSensorLowVbSmsOn = true;             ///< sms sen
 bool                          gSensorTimeoutSmsOn = true;           ///< sms sensor timeout events if set to true
 bool                          gPowerFailureSmsOn = true;            ///< sms power failure events if set to true
 
-char                          gszPhoneNo[16] = {0};
+char                          gszPhoneNo[GprsSms::MAX_NUMBER_DIGITS+2] = {0};         ///< owner number (stored at EEPROM address 0)
+char                          gszSensorReportNo[GprsSms::MAX_NUMBER_DIGITS+2] = {0};  ///< number the SENSORS report is being sent to (empty if none)
+size_t                        gSensorReportNext = 0;                ///< first sensor of the next text of the SENSORS report
+
+
 
 
 
+/// returns VIN [mV] from the last ADC sweep
+unsigned int inputVoltage()
+{
+    return scaleAdc(gAdc.read(VIN_PIN), VIN_MV_Q16);
+}
 
 
-/// reads and returns VIN
-float inputVoltage()
+/// returns the joystick position from the last ADC sweep
+int readJoystick(uint8_t _uPin)
 {
-    return (float)analogRead(VIN_PIN) * VIN_RESOLUTION / VIN_DEVIDER;
+    return gAdc.read(_uPin);
 }
 
 
-/// reads VIN and returns a smoothed VIN
-float aveInputVoltage()
+/// queue valid sensor data for processing
+void queueSensorData(sDeviceData &_rData)
 {
-    static float gVinAve = inputVoltage();
+    char pszRadioRx[64];
+    Serial.println(formatDeviceData(pszRadioRx, sizeof(pszRadioRx), _rData));
     
-    float gVin = inputVoltage();
-    gVinAve = gVin * 0.001 + gVinAve * 0.999;
+    if ( (_rData._uAddr > 0) && (_rData._uAddr != 0xFFFF) &&
+         (_rData._uPriority > 0) && (_rData._uPriority < 16) )
+    {
+        _rData._uTimestamp = millis();
+        gDeviceDataQueue.try_push(_rData);
+        
+        gRxCounter++;
+        if (gRxCounter > 9999)
+        {
+            gRxCounter = 0;
+        }
+    }
+}
+
+
+/// acknowledge a status frame so the sensor can stop retransmitting (duplicates are acked again, the ack may have been lost)
+/// the ack is sent in the frame version of the sensor, sensors with version 1 firmware do not expect acks
+void ackSensorData(const sDeviceData &_rData, unsigned short _uRadioAddr, unsigned char _uRssi)
+{
+    unsigned char pAck[DEVICE_FRAME_MAX_SIZE];
+    unsigned char uSize = encodeAckFrame(pAck, _rData._uAddr, _rData._uEventCount, _uRssi, gRadioFrames->version());
+    if (uSize == 0)
+    {
+        return;
+    }
     
-    return gVinAve;
+    if (gRadioApiMode == true)
+    {
+        gRadioApi->sendTx16(_uRadioAddr, pAck, uSize);  // TX status is ignored by 'readFromRadio()'
+    }
+    else
+    {
+        RADIO_SERIAL.write(pAck, uSize);
+    }
+}
+
+
+/// returns the time allowed until the next status update of a sensor [ms] (follows the sensor's heartbeat)
+unsigned long sensorTimeout(const sDeviceData &_rData)
+{
+    return (_rData._uHeartbeat > 0) ? 1000ul * _rData._uHeartbeat * SENSOR_TIMEOUT_HALF_BEATS / 2 : SENSOR_TIMEOUT;
 }
 
 
 /// read and process all data from radio
 void readFromRadio()
 {
-    char pszRadioRx[48];
-    unsigned int n = 0;
-    while ((n = gRadio->readln(pszRadioRx, 47, 50, true)) > 0)
+    sDeviceData data;
+    if (gRadioApiMode == true)
     {
-        pszRadioRx[n] = '\0';
-        Serial.println(pszRadioRx);
-        
-        sDeviceData data;
-        decodeDeviceData(data, pszRadioRx);
-        if ( (data._uAddr > 0) && (data._uAddr < MAX_SENSORS) &&
-             (data._uPriority > 0) && (data._uPriority < 16) )
+        // API mode: sensor frames arrive inside RX frames that carry the sending radio's address and RSSI
+        while (gRadioApi->poll() == true)
         {
-            data._uTimestamp = millis();
-            gDeviceDataQueue.push(data);
-            
-            gRxCounter++;
-            if (gRxCounter > 9999)
+            if (gRadioApi->apiId() == XBeeApi::EXA_RX_16)
             {
-                gRxCounter = 0;
+                const unsigned char *pRx = gRadioApi->rxData();
+                for (unsigned int i = 0; i < gRadioApi->rxLength(); i++)
+                {
+                    if ( (gRadioFrames->put(pRx[i]) == false) ||
+                         (gRadioFrames->type() == EDF_ACK) )
+                    {
+                        continue;
+                    }
+                    
+                    gRadioFrames->decode(data);
+                    Serial.print("radio ");
+                    Serial.print(gRadioApi->rxSourceAddr());
+                    Serial.print(" -");
+                    Serial.print(gRadioApi->rxRssi());
+                    Serial.println("dBm");
+                    
+                    // only accept data from the radio that owns the sensor address
+                    if (data._uAddr == gRadioApi->rxSourceAddr())
+                    {
+                        ackSensorData(data, gRadioApi->rxSourceAddr(), gRadioApi->rxRssi());
+                        queueSensorData(data);
+                    }
+                }
             }
         }
     }
+    else
+    {
+        while (gRadioFrames->poll(data) == true)
+        {
+            ackSensorData(data, data._uAddr, 0);  // no RSSI in transparent mode
+            queueSensorData(data);
+        }
+    }
+    
+    // frames of newer sensor firmware are dropped, log them so that a base station that needs updating shows up
+    if (gRadioFrames->versionErrorCount() != gRadioVersionErrors)
+    {
+        gRadioVersionErrors = gRadioFrames->versionErrorCount();
+        Serial.print("radio frame version unknown, dropped ");
+        Serial.println(gRadioVersionErrors);
+    }
+}
+
+
+/// returns true if radio data has been received
+bool radioHasData()
+{
+    return RADIO_SERIAL.available() > 0;
+}
+
+
+/// returns true if sensor updates are waiting to be processed
+bool sensorUpdatesQueued()
+{
+    return gDeviceDataQueue.empty() == false;
+}
+
+
+/// returns true if GPRS data has been received
+bool gprsHasData()
+{
+    return GPRS_SERIAL.available() > 0;
+}
+
+
+/// returns true if GPRS messages or events are waiting to be processed
+bool gprsHasEvents()
+{
+    return (gGprs->hasRxMessages() == true) || (gGprs->hasRxEvents() == true);
 }
 
 
 /// Gprs read task
 void readGprsQuick()
 {
-    gGprs->update(500);
+    gGprs->update();
 }
 
 
-/// builds text string for given device data structure
-void buildSensorString(char *_pszBuf, size_t _uBufSize, sDeviceData &_data)
+/// builds text string for the given sensor
+void buildSensorString(char *_pszBuf, size_t _uBufSize, size_t _uSensor)
 {
-    if (_data._uAddr > 0)
+    const sSensorStatus &sensor = gSensors.status(_uSensor);
+    char pszName[BaseSensorRegistry::NAME_SIZE];
+    gSensors.name(_uSensor, pszName);
+    if (sensor.hasTime() == true)
     {
-        if (_data._uTimestamp > 0)
+        unsigned long dt = sensor.age(millis());
+        
+        if (sensor._uTemperature > 0)
         {
-            unsigned long dt = (millis() - _data._uTimestamp) / 1000ul;
-            
-            if (_data._uTemperature > 0)
-            {
-                snprintf(_pszBuf, _uBufSize, "%s,%dVb,%dC,%us\n", _data._pszName, _data._uBtyVoltage, _data._uTemperature, dt);
-            }
-            else
-            {
-                snprintf(_pszBuf, _uBufSize, "%s,%dVb,%us\n", _data._pszName, _data._uBtyVoltage, dt);
-            }
+            snprintf(_pszBuf, _uBufSize, "%s,%dVb,%dC,%lus\n", pszName, sensor._uBtyVoltage, sensor._uTemperature, dt);
         }
         else
         {
-            if (_data._uTemperature > 0)
-            {
-                snprintf(_pszBuf, _uBufSize, "%s,%dVb,%dC,-\n", _data._pszName, _data._uBtyVoltage, _data._uTemperature);
-            }
-            else
-            {
-                snprintf(_pszBuf, _uBufSize, "%s,%dVb,-\n", _data._pszName, _data._uBtyVoltage);
-            }
+            snprintf(_pszBuf, _uBufSize, "%s,%dVb,%lus\n", pszName, sensor._uBtyVoltage, dt);
         }
     }
     else
     {
-        snprintf(_pszBuf, _uBufSize, "");
+        if (sensor._uTemperature > 0)
+        {
+            snprintf(_pszBuf, _uBufSize, "%s,%dVb,%dC,-\n", pszName, sensor._uBtyVoltage, sensor._uTemperature);
+        }
+        else
+        {
+            snprintf(_pszBuf, _uBufSize, "%s,%dVb,-\n", pszName, sensor._uBtyVoltage);
+        }
     }
 }
 
 
-/// collect sensor data and sms it
-void smsSensorData(const char *_pszMsgNo)
+/// queue the next text of the SENSORS report if the outbox takes it without evicting anything
+void sendSensorReport()
 {
+    if (gszSensorReportNo[0] == '\0')
+    {
+        return;
+    }
+    
     char buf[32];
-    char text[MAX_SENSORS * 32];
-    text[0] = '\0';
-
-    // build text for all sensors    
-    for (size_t i = 0; i < MAX_SENSORS; i++)
+    char text[SMS_TEXT_SIZE + 1];
+    size_t uLen = 0;
+    size_t i = gSensorReportNext;
+    for (; i < gSensors.count(); i++)
     {
-        buildSensorString(buf, 32, gDeviceData[i]);
-        strcat(text, buf);
+        buildSensorString(buf, sizeof(buf), i);
+        size_t n = strlen(buf);
+        if (uLen + n > SMS_TEXT_SIZE)
+        {
+            break;
+        }
+        
+        strcpy(text + uLen, buf);
+        uLen += n;
     }
+    
+    if (uLen > 0)
+    {
+        // wait until earlier texts went out (replies do not evict each other)
+        if (gGprs->canQueueTxMessage(gszSensorReportNo, text, ESP_REPLY) == false)
+        {
+            return;
+        }
         
-    // send message
-    gGprs->pushTxMessageTxt(_pszMsgNo, text);
+        if (gGprs->pushTxMessageTxt(gszSensorReportNo, text) == false)
+        {
+            gLcd->writeLine("sensors report dropped");
+            i = gSensors.count();
+        }
+    }
+    
+    // continue with the next sensor, the report is done after the last one
+    gSensorReportNext = i;
+    if (gSensorReportNext >= gSensors.count())
+    {
+        gszSensorReportNo[0] = '\0';
+    }
+}
+
+
+/// collect sensor data and sms it (one text per SMS_TEXT_SIZE characters, lines are not split); the texts are queued
+/// one at a time by 'sendSensorReport()' as the outbox has room, a report that is in progress is restarted
+void smsSensorData(const char *_pszMsgNo)
+{
+    strncpy(gszSensorReportNo, _pszMsgNo, sizeof(gszSensorReportNo)-1);
+    gszSensorReportNo[sizeof(gszSensorReportNo)-1] = '\0';
+    gSensorReportNext = 0;
+    sendSensorReport();
+}
+
+
+/// sms alerts task (also queues the rest of a SENSORS report)
+void sendAlerts()
+{
+    gAlerts->update();
+    sendSensorReport();
 }
 
 
@@ -183,7 +370,7 @@ void smsStatus(const char *_pszMsgNo)
 {
     gGprs->pushTxMessageFmt(_pszMsgNo, 
                             "Vin %u\nfree ram %d\n%s\nx %u\nSIREN %s\nTIMEOUT %s\nLOWVB %s\nPOWER %s", 
-                            (unsigned short)(inputVoltage()*100 + 0.5f),
+                            (inputVoltage() + 5) / 10,
                             freeRam(),
                             gszPhoneNo,
                             gSensorPriorityLevel,
@@ -194,121 +381,332 @@ void smsStatus(const char *_pszMsgNo)
 }
 
 
-/// process messages and events from GPRS module
-void processGprsEvents()
+/// LCD view with one line per sensor ('addr name bty Vb count e age s')
+unsigned int lcdSensorView(unsigned int _uLine, char *_pszText, size_t _uSize)
 {
-    // read text messages
-    if (gGprs->hasRxMessages() == true)
+    if (_pszText == NULL)
     {
-        GprsSms::sMessage msg;
-        
-        // take message from gprs module
-        gGprs->popRxMessage(msg);
-        covertToUpper(msg.m_pszText);
-
-        // print message to LCD
-        gLcd->writeLine("%s %s", msg.m_pszText, msg.m_pszNumber);
-        
-        // process message
-        if (strcmp(msg.m_pszText, "STATUS") == 0)
-        {
-            smsStatus(msg.m_pszNumber);
-        }
-        else if (strcmp(msg.m_pszText, "AIRTIME") == 0)
+        // lines only
+    }
+    else if (_uLine == 0)
+    {
+        snprintf(_pszText, _uSize, "sensors: %u", (unsigned int)gSensors.count());
+    }
+    else
+    {
+        const sSensorStatus &sensor = gSensors.status(_uLine - 1);
+        char pszName[BaseSensorRegistry::NAME_SIZE];
+        gSensors.name(_uLine - 1, pszName);
+        if (sensor.hasTime() == true)
         {
-            gGprs->checkAirtime();        
+            snprintf(_pszText, _uSize, "%u %s %uVb %ue %lus", sensor._uAddr, pszName, sensor._uBtyVoltage,
+                     sensor._uEventCount, sensor.age(millis()));
         }
-        else if (strcmp(msg.m_pszText, "RESET") == 0)
+        else
         {
-            gGprs->powerDown();
-            reset();        
+            snprintf(_pszText, _uSize, "%u %s %uVb %ue -", sensor._uAddr, pszName, sensor._uBtyVoltage,
+                     sensor._uEventCount);
         }
-        else if (strcmp(msg.m_pszText, "GPRS OFF") == 0)
-        {
-            gGprs->powerDown();
-        }
-        else if (strcmp(msg.m_pszText, "SENSORS") == 0)
+    }
+    
+    return gSensors.count() + 1;
+}
+
+
+/// LCD view with the base station status
+unsigned int lcdStatusView(unsigned int _uLine, char *_pszText, size_t _uSize)
+{
+    if (_pszText != NULL)
+    {
+        switch (_uLine)
         {
-            smsSensorData(msg.m_pszNumber);
+            case 0: snprintf(_pszText, _uSize, "status: x %u rx %u", gSensorPriorityLevel, gRxCounter); break;
+            case 1: snprintf(_pszText, _uSize, "Vin %u", (inputVoltage() + 5) / 10); break;
+            case 2: snprintf(_pszText, _uSize, "SIREN %s", gSensorSirenOn == true ? "ON" : "OFF"); break;
+            case 3: snprintf(_pszText, _uSize, "TIMEOUT %s", gSensorTimeoutSmsOn == true ? "ON" : "OFF"); break;
+            case 4: snprintf(_pszText, _uSize, "LOWVB %s", gSensorLowVbSmsOn == true ? "ON" : "OFF"); break;
+            case 5: snprintf(_pszText, _uSize, "POWER %s", gPowerFailureSmsOn == true ? "ON" : "OFF"); break;
+            case 6: snprintf(_pszText, _uSize, "%s", gszPhoneNo); break;
+            case 7: snprintf(_pszText, _uSize, "up %lus", millis() / 1000); break;
+            case 8: snprintf(_pszText, _uSize, "alerts merged %u dropped %u", gAlerts->mergedCount(), gAlerts->droppedCount()); break;
+            case 9: snprintf(_pszText, _uSize, "frames bad %u version %u", gRadioFrames->errorCount(), gRadioFrames->versionErrorCount()); break;
+            case 10: snprintf(_pszText, _uSize, "updates lost %u", gDeviceDataQueue.overflowCount()); break;
+            default: snprintf(_pszText, _uSize, "free ram %d", freeRam()); break;
         }
-        else if (strncmp(msg.m_pszText, "SET", 3) == 0)
-        {
-            // process command
-            int iValue = atoi(msg.m_pszText + 3);
-            gSensorPriorityLevel = iValue;
+    }
+    
+    return 12;
+}
 
-            // confirm command
-            gGprs->pushTxMessageFmt(msg.m_pszNumber, "SET %d", gSensorPriorityLevel);
-            if (strcmp(gszPhoneNo, msg.m_pszNumber) != 0)
-            {
-                gGprs->pushTxMessageFmt(gszPhoneNo, "SET %d", gSensorPriorityLevel);
-            }
-        }
-        else if (strncmp(msg.m_pszText, "SIREN", 5) == 0)
-        {
-            gSensorSirenOn = strncmp(msg.m_pszText + 6, "ON", 2) == 0;
 
-            // confirm command
-            gGprs->pushTxMessageFmt(msg.m_pszNumber, "SIREN %s", gSensorSirenOn == true ? "ON" : "OFF");
-            if (strcmp(gszPhoneNo, msg.m_pszNumber) != 0)
-            {
-                gGprs->pushTxMessageFmt(gszPhoneNo, "SIREN %s", gSensorSirenOn == true ? "ON" : "OFF");
-            }
-        }
-        else if (strncmp(msg.m_pszText, "LOWVB", 5) == 0)
-        {
-            gSensorLowVbSmsOn = strncmp(msg.m_pszText + 6, "ON", 2) == 0;
+/// sms task execution statistics to given number ('name count mean/max' in [us]) and restart the statistics
+void smsStats(const char *_pszMsgNo)
+{
+#ifdef TASKMANAGER_PROFILE
+    char text[256];
+    gTaskManager.formatStats(text, sizeof(text));
+    gTaskManager.resetStats();
+    gGprs->pushTxMessageTxt(_pszMsgNo, text);
+#else
+    gGprs->pushTxMessageTxt(_pszMsgNo, "no task stats");
+#endif
+}
 
-            // confirm command
-            gGprs->pushTxMessageFmt(msg.m_pszNumber, "LOWVB %s", gSensorLowVbSmsOn == true ? "ON" : "OFF");
-            if (strcmp(gszPhoneNo, msg.m_pszNumber) != 0)
-            {
-                gGprs->pushTxMessageFmt(gszPhoneNo, "LOWVB %s", gSensorLowVbSmsOn == true ? "ON" : "OFF");
-            }
-        }
-        else if (strncmp(msg.m_pszText, "POWER", 5) == 0)
-        {
-            gPowerFailureSmsOn = strncmp(msg.m_pszText + 6, "ON", 2) == 0;
 
-            // confirm command
-            gGprs->pushTxMessageFmt(msg.m_pszNumber, "POWER %s", gPowerFailureSmsOn == true ? "ON" : "OFF");
-            if (strcmp(gszPhoneNo, msg.m_pszNumber) != 0)
-            {
-                gGprs->pushTxMessageFmt(gszPhoneNo, "POWER %s", gPowerFailureSmsOn == true ? "ON" : "OFF");
-            }
-        }
-        else if (strncmp(msg.m_pszText, "TIMEOUT", 7) == 0)
-        {
-            gSensorTimeoutSmsOn = strncmp(msg.m_pszText + 8, "ON", 2) == 0;
+/// print task execution statistics to serial
+void dumpStats()
+{
+#ifdef TASKMANAGER_PROFILE
+    Serial.print("free ram ");
+    Serial.println(freeRam());
+    gTaskManager.printStats(Serial);
+#endif
+}
 
-            // confirm command
-            gGprs->pushTxMessageFmt(msg.m_pszNumber, "TIMEOUT %s", gSensorTimeoutSmsOn == true ? "ON" : "OFF");
-            if (strcmp(gszPhoneNo, msg.m_pszNumber) != 0)
-            {
-                gGprs->pushTxMessageFmt(gszPhoneNo, "TIMEOUT %s", gSensorTimeoutSmsOn == true ? "ON" : "OFF");
-            }
-        }
-        else if (strncmp(msg.m_pszText, "PHONESET", 8) == 0)
-        {
-            memset(gszPhoneNo, '\0', sizeof(gszPhoneNo));
-            strncpy(gszPhoneNo, msg.m_pszNumber, sizeof(gszPhoneNo)-1);
 
-            // store new number in EEPROM
-            for (char i = 0; i < sizeof(gszPhoneNo); i++)
+/// SMS command handlers (the confirmation text is written to '_pszReply', see sSmsCommand)
+void smsCmdStatus(const char *_pszNumber, const char * /*_pszArgs*/, char * /*_pszReply*/, size_t /*_uSize*/)
+{
+    smsStatus(_pszNumber);
+}
+
+void smsCmdAirtime(const char * /*_pszNumber*/, const char * /*_pszArgs*/, char * /*_pszReply*/, size_t /*_uSize*/)
+{
+    gGprs->checkAirtime();
+}
+
+void smsCmdReset(const char * /*_pszNumber*/, const char * /*_pszArgs*/, char * /*_pszReply*/, size_t /*_uSize*/)
+{
+    gGprs->powerDown();
+    gGprs->waitForCommands(30000);
+    reset();
+}
+
+void smsCmdGprsOff(const char * /*_pszNumber*/, const char * /*_pszArgs*/, char * /*_pszReply*/, size_t /*_uSize*/)
+{
+    gGprs->powerDown();
+}
+
+void smsCmdSensors(const char *_pszNumber, const char * /*_pszArgs*/, char * /*_pszReply*/, size_t /*_uSize*/)
+{
+    smsSensorData(_pszNumber);
+}
+
+void smsCmdStats(const char *_pszNumber, const char * /*_pszArgs*/, char * /*_pszReply*/, size_t /*_uSize*/)
+{
+    smsStats(_pszNumber);
+}
+
+void smsCmdPhoneSet(const char *_pszNumber, const char * /*_pszArgs*/, char *_pszReply, size_t _uSize)
+{
+    memset(gszPhoneNo, '\0', sizeof(gszPhoneNo));
+    strncpy(gszPhoneNo, _pszNumber, sizeof(gszPhoneNo)-1);
+    
+    // store new number in EEPROM
+    for (char i = 0; i < sizeof(gszPhoneNo); i++)
+    {
+        EEPROM.write(i, gszPhoneNo[i]);
+    }
+    
+    snprintf(_pszReply, _uSize, "PHONESET %s", gszPhoneNo);
+}
+
+void smsCmdPhone(const char * /*_pszNumber*/, const char * /*_pszArgs*/, char *_pszReply, size_t _uSize)
+{
+    snprintf(_pszReply, _uSize, "PHONE %s", gszPhoneNo);
+}
+
+
+/// hash of an SMS command keyword (evaluated at compile time for the command table)
+constexpr unsigned short smsKeywordHash(const char *_pszKeyword, unsigned short _uHash)
+{
+    return (*_pszKeyword == '\0') ? _uHash : smsKeywordHash(_pszKeyword + 1, (unsigned short)(_uHash * 31u + (unsigned char)*_pszKeyword));
+}
+
+/// length of an SMS command keyword (evaluated at compile time for the command table)
+constexpr unsigned char smsKeywordLength(const char *_pszKeyword)
+{
+    return (*_pszKeyword == '\0') ? 0 : 1 + smsKeywordLength(_pszKeyword + 1);
+}
+
+
+typedef void (*SmsCommandFunc)(const char *_pszNumber, const char *_pszArgs, char *_pszReply, size_t _uSize);
+
+enum eSmsArg
+{
+    ESA_NONE = 0,                   ///< the keyword must be the whole text
+    ESA_INT,                        ///< the text after the keyword is a number, stored in the int at 'm_pValue'
+    ESA_SWITCH,                     ///< the text after the keyword is ON or OFF, stored in the bool at 'm_pValue'
+    ESA_TEXT,                       ///< any text may follow the keyword (passed to the handler)
+};
+
+enum eSmsConfirm
+{
+    ESC_NONE = 0,                   ///< the handler replies itself (if at all)
+    ESC_SENDER,                     ///< the confirmation is sent to the sender
+    ESC_SENDER_OWNER,               ///< the confirmation is sent to the sender and to the owner if the sender is someone else
+};
+
+#define SMS_KEYWORD_SIZE            9
+#define SMS_COMMAND(keyword, arg, value, handler, confirm) \
+    {keyword, smsKeywordLength(keyword), smsKeywordHash(keyword, 0), arg, confirm, value, handler}
+
+/// SMS command descriptor (kept in PROGMEM). Settings ('ESA_INT' and 'ESA_SWITCH') are confirmed as 'KEYWORD value'.
+struct sSmsCommand
+{
+    char            m_szKeyword[SMS_KEYWORD_SIZE];
+    unsigned char   m_uLength;
+    unsigned short  m_uHash;        ///< smsKeywordHash() of the keyword
+    unsigned char   m_uArg;         ///< eSmsArg
+    unsigned char   m_uConfirm;     ///< eSmsConfirm
+    void            *m_pValue;      ///< setting changed by the command (or NULL)
+    SmsCommandFunc  m_fpHandler;    ///< called after the setting was changed (or NULL)
+};
+
+/// SMS commands, longest keywords first (the longest matching keyword wins, so 'PHONESET' is not taken for 'PHONE')
+constexpr sSmsCommand gSmsCommands[] PROGMEM =
+{
+    SMS_COMMAND("GPRS OFF", ESA_NONE,   NULL,                   smsCmdGprsOff,  ESC_NONE),
+    SMS_COMMAND("PHONESET", ESA_TEXT,   NULL,                   smsCmdPhoneSet, ESC_SENDER),
+    SMS_COMMAND("AIRTIME",  ESA_NONE,   NULL,                   smsCmdAirtime,  ESC_NONE),
+    SMS_COMMAND("SENSORS",  ESA_NONE,   NULL,                   smsCmdSensors,  ESC_NONE),
+    SMS_COMMAND("TIMEOUT",  ESA_SWITCH, &gSensorTimeoutSmsOn,   NULL,           ESC_SENDER_OWNER),
+    SMS_COMMAND("STATUS",   ESA_NONE,   NULL,                   smsCmdStatus,   ESC_NONE),
+    SMS_COMMAND("RESET",    ESA_NONE,   NULL,                   smsCmdReset,    ESC_NONE),
+    SMS_COMMAND("STATS",    ESA_NONE,   NULL,                   smsCmdStats,    ESC_NONE),
+    SMS_COMMAND("SIREN",    ESA_SWITCH, &gSensorSirenOn,        NULL,           ESC_SENDER_OWNER),
+    SMS_COMMAND("LOWVB",    ESA_SWITCH, &gSensorLowVbSmsOn,     NULL,           ESC_SENDER_OWNER),
+    SMS_COMMAND("POWER",    ESA_SWITCH, &gPowerFailureSmsOn,    NULL,           ESC_SENDER_OWNER),
+    SMS_COMMAND("PHONE",    ESA_TEXT,   NULL,                   smsCmdPhone,    ESC_SENDER),
+    SMS_COMMAND("SET",      ESA_INT,    &gSensorPriorityLevel,  NULL,           ESC_SENDER_OWNER),
+};
+
+#define SMS_COMMAND_COUNT           (sizeof(gSmsCommands) / sizeof(gSmsCommands[0]))
+
+/// true if the commands from '_uIndex' on are ordered by keyword length, longest first
+constexpr bool smsCommandsOrdered(size_t _uIndex)
+{
+    return (_uIndex + 1 >= SMS_COMMAND_COUNT) ||
+           ( (gSmsCommands[_uIndex].m_uLength >= gSmsCommands[_uIndex + 1].m_uLength) && smsCommandsOrdered(_uIndex + 1) );
+}
+
+static_assert(smsCommandsOrdered(0), "gSmsCommands must be ordered by keyword length, longest first");
+
+/// index of the first command (from '_uIndex' on) with a keyword of at most '_uLength' characters
+constexpr unsigned char smsCommandFirst(unsigned char _uLength, size_t _uIndex)
+{
+    return ( (_uIndex >= SMS_COMMAND_COUNT) || (gSmsCommands[_uIndex].m_uLength <= _uLength) ) ?
+           (unsigned char)_uIndex : smsCommandFirst(_uLength, _uIndex + 1);
+}
+
+/// commands with a keyword of 'n' characters are gSmsCommands[gSmsCommandFirst[n]] up to gSmsCommandFirst[n-1]
+const unsigned char gSmsCommandFirst[SMS_KEYWORD_SIZE] PROGMEM =
+{
+    smsCommandFirst(0, 0), smsCommandFirst(1, 0), smsCommandFirst(2, 0), smsCommandFirst(3, 0), smsCommandFirst(4, 0),
+    smsCommandFirst(5, 0), smsCommandFirst(6, 0), smsCommandFirst(7, 0), smsCommandFirst(8, 0)
+};
+
+static_assert(SMS_KEYWORD_SIZE == 9, "gSmsCommandFirst needs an entry per keyword length");
+
+
+/// find and run the SMS command in '_pszText' (upper case), returns false if there is no such command
+bool dispatchSmsCommand(const char *_pszText, const char *_pszNumber)
+{
+    // hash every text prefix that could be a keyword, so each command is checked by comparing two numbers
+    unsigned short prefixHash[SMS_KEYWORD_SIZE];
+    unsigned char uTextLen = 0;
+    unsigned short uHash = 0;
+    prefixHash[0] = 0;
+    while ( (uTextLen < SMS_KEYWORD_SIZE-1) && (_pszText[uTextLen] != '\0') )
+    {
+        uHash = uHash * 31u + (unsigned char)_pszText[uTextLen];
+        uTextLen++;
+        prefixHash[uTextLen] = uHash;
+    }
+    
+    // longest matching keyword: only the commands of each prefix length are checked, longest prefix first
+    int iCommand = -1;
+    for (unsigned char uLen = uTextLen; (uLen > 0) && (iCommand < 0); uLen--)
+    {
+        unsigned char uEnd = pgm_read_byte(&gSmsCommandFirst[uLen - 1]);
+        for (unsigned char i = pgm_read_byte(&gSmsCommandFirst[uLen]); i < uEnd; i++)
+        {
+            if ( (pgm_read_word(&gSmsCommands[i].m_uHash) == prefixHash[uLen]) &&
+                 (strncmp_P(_pszText, gSmsCommands[i].m_szKeyword, uLen) == 0) &&
+                 ( (pgm_read_byte(&gSmsCommands[i].m_uArg) != ESA_NONE) || (_pszText[uLen] == '\0') ) )
             {
-                EEPROM.write(i, gszPhoneNo[i]);
+                iCommand = i;
+                break;
             }
-            
-            // confirm command
-            gGprs->pushTxMessageFmt(msg.m_pszNumber, "PHONESET %s", gszPhoneNo);
         }
-        else if (strncmp(msg.m_pszText, "PHONE", 5) == 0)
+    }
+    
+    if (iCommand < 0)
+    {
+        return false;
+    }
+    
+    sSmsCommand cmd;
+    memcpy_P(&cmd, &gSmsCommands[iCommand], sizeof(cmd));
+    const char *pszArgs = _pszText + cmd.m_uLength;
+    while (*pszArgs == ' ')
+    {
+        pszArgs++;
+    }
+    
+    // change setting, run handler and build the confirmation
+    char reply[48];
+    reply[0] = '\0';
+    if (cmd.m_uArg == ESA_INT)
+    {
+        *(int*)cmd.m_pValue = atoi(pszArgs);
+        snprintf(reply, sizeof(reply), "%s %d", cmd.m_szKeyword, *(int*)cmd.m_pValue);
+    }
+    else if (cmd.m_uArg == ESA_SWITCH)
+    {
+        *(bool*)cmd.m_pValue = strncmp(pszArgs, "ON", 2) == 0;
+        snprintf(reply, sizeof(reply), "%s %s", cmd.m_szKeyword, *(bool*)cmd.m_pValue == true ? "ON" : "OFF");
+    }
+    
+    if (cmd.m_fpHandler != NULL)
+    {
+        cmd.m_fpHandler(_pszNumber, pszArgs, reply, sizeof(reply));
+    }
+    
+    // confirm command
+    if ( (cmd.m_uConfirm != ESC_NONE) && (reply[0] != '\0') )
+    {
+        gGprs->pushTxMessageTxt(_pszNumber, reply);
+        if ( (cmd.m_uConfirm == ESC_SENDER_OWNER) &&
+             (strcmp(gszPhoneNo, _pszNumber) != 0) )
         {
-            // confirm command
-            gGprs->pushTxMessageFmt(msg.m_pszNumber, "PHONE %s", gszPhoneNo);
+            gGprs->pushTxMessageTxt(gszPhoneNo, reply);
         }
     }
     
+    return true;
+}
+
+
+/// process messages and events from GPRS module
+void processGprsEvents()
+{
+    // read text messages
+    if (gGprs->hasRxMessages() == true)
+    {
+        // read message in place (released at the end)
+        GprsSms::sMessage &msg = *gGprs->rxMessage();
+        covertToUpper(msg.m_pszText);
+
+        // print message to LCD
+        gLcd->writeLine("%s %s", msg.m_pszText, msg.m_pszNumber);
+        
+        // process message
+        dispatchSmsCommand(msg.m_pszText, msg.m_pszNumber);
+        
+        gGprs->popRxMessage();
+    }
+    
     // read events if there are no text messages
     else
     {
@@ -333,7 +731,9 @@ void processGprsEvents()
         else if (evt == GprsSms::EGE_CALL_RCV)
         {
             gLcd->writeLine("call event received. resetting...");
+            gLcd->flush();
             gGprs->powerDown();
+            gGprs->waitForCommands(30000);
             reset();
         }
     }
@@ -343,26 +743,56 @@ void processGprsEvents()
 /// process and report sensor data from data queue
 void processSensorUpdates()
 {
-    if (gDeviceDataQueue.empty() == false)
-    {              
-        sDeviceData data;
-        gDeviceDataQueue.pop(data);
-        sDeviceData &oldData = gDeviceData[data._uAddr-1];
+    sDeviceData data;
+    if (gDeviceDataQueue.try_pop(data) == true)
+    {
+        // last update of the sensor (defaults if it is new)
+        int iSensor = gSensors.find(data._uAddr);
+        sSensorStatus oldStatus;
+        if (iSensor >= 0)
+        {
+            oldStatus = gSensors.status(iSensor);
+        }
+        
+        bool bWasLowVb = (iSensor >= 0) && (oldStatus._uBtyVoltage < MIN_SENSOR_VB);
         
         // check that data is new
         // - data may be sent multiple times from sensors, also assumes an eventCount of zero is invalid
-        // - ignores data if events come through too quickly 
-        bool bAllowUpdate = (data._uEventCount > 0) && (data._uEventCount != oldData._uEventCount);
-        bAllowUpdate &= (data._uTimestamp - oldData._uTimestamp > 10000) || (data._bD2Event != oldData._bD2Event) || (data._bD3Event != oldData._bD3Event);
+        // - ignores status updates that come through too quickly (sensors limit the rate of their activation updates
+        //   and count the activations in between)
+        bool bAllowUpdate = (data._uEventCount > 0) && (data._uEventCount != oldStatus._uEventCount);
+        bAllowUpdate &= (oldStatus.age(data._uTimestamp) > 10) || (data._uD2Count > 0) || (data._uD3Count > 0) ||
+                        (data._bD2Event != oldStatus.d2Event()) || (data._bD3Event != oldStatus.d3Event());
         
         if (bAllowUpdate)
         {
-            // store data
-            gDeviceData[data._uAddr-1] = data;
+            if (iSensor < 0)
+            {
+                iSensor = gSensors.add(data._uAddr);
+                if (iSensor < 0)
+                {
+                    gLcd->writeLine("sensors full: %u", data._uAddr);
+                    return;
+                }
+            }
+            
+            // store data (sensors only send their name now and then)
+            if (data._pszName[0] == '\0')
+            {
+                gSensors.name(iSensor, data._pszName);
+            }
+            else
+            {
+                gSensors.setName(iSensor, data._pszName);
+            }
+            
+            gSensors.status(iSensor).set(data);
+            gSensorTimeouts.arm(iSensor, data._uTimestamp + sensorTimeout(data));
+            gLcd->refresh();
             
             // create data string
-            char rxBuf[48];
-            encodeDeviceData(rxBuf, 48, data);
+            char rxBuf[64];
+            formatDeviceData(rxBuf, sizeof(rxBuf), data);
             
             // process sensor events and status updates seperately
             if ( (data._bD2Event == true) || (data._bD3Event == true) )
@@ -382,7 +812,7 @@ void processSensorUpdates()
                     }
                     
                     // send sms
-                    gGprs->pushTxMessageFmt(gszPhoneNo, "evt %4u %s", gRxCounter, rxBuf);
+                    gAlerts->push(gszPhoneNo, ESP_ALARM, "evt %4u %s", gRxCounter, rxBuf);
                 }
             }
             else
@@ -390,6 +820,17 @@ void processSensorUpdates()
                 // status update
                 gLcd->writeLine("%4u %s", gRxCounter, rxBuf);
             }
+            
+            // report low batteries once, when the voltage drops below the limit
+            if ( (data._uBtyVoltage < MIN_SENSOR_VB) && (bWasLowVb == false) )
+            {
+                gLcd->writeLine("btylow: %s,%dVb", data._pszName, data._uBtyVoltage);
+                
+                if (gSensorLowVbSmsOn == true)
+                {
+                    gAlerts->push(gszPhoneNo, ESP_SENSOR, "btylow: %s,%dVb", data._pszName, data._uBtyVoltage);
+                }
+            }
         }
     }                    
 }
@@ -398,32 +839,21 @@ void processSensorUpdates()
 /// check for sensor problems
 void checkSensorStatus()
 {
-    for (size_t i = 0; i < MAX_SENSORS; i++)
+    gLcd->refresh();  // sensor ages
+    
+    // only sensors whose timeout is due (low batteries are reported when the update arrives)
+    int i = -1;
+    while ((i = gSensorTimeouts.expire(millis())) >= 0)
     {
-        sDeviceData &data = gDeviceData[i];
-        if ( (data._uAddr == i + 1) &&
-             (data._uTimestamp > 0) )   // only check if time attribute is valid
+        sSensorStatus &sensor = gSensors.status(i);
+        sensor.clearTime();  // reset time attribute
+        char pszName[BaseSensorRegistry::NAME_SIZE];
+        gSensors.name(i, pszName);
+        gLcd->writeLine("timeout: %s,%dVb", pszName, sensor._uBtyVoltage);
+        
+        if (gSensorTimeoutSmsOn == true)
         {
-            if (data._uBtyVoltage < MIN_SENSOR_VB)
-            {
-                data._uTimestamp = 0;  // reset time attribute
-                gLcd->writeLine("btylow: %s,%dVb", data._pszName, data._uBtyVoltage);
-                
-                if (gSensorLowVbSmsOn == true)
-                {
-                    gGprs->pushTxMessageFmt(gszPhoneNo, "btylow: %s,%dVb", data._pszName, data._uBtyVoltage);
-                }
-            }
-            else if (millis() - data._uTimestamp > SENSOR_TIMEOUT)
-            {
-                data._uTimestamp = 0;  // reset time attribute
-                gLcd->writeLine("timeout: %s,%dVb", data._pszName, data._uBtyVoltage);
-                
-                if (gSensorTimeoutSmsOn == true)
-                {
-                    gGprs->pushTxMessageFmt(gszPhoneNo, "timeout: %s,%dVb", data._pszName, data._uBtyVoltage);
-                }
-            }
+            gAlerts->push(gszPhoneNo, ESP_SENSOR, "timeout: %s,%dVb", pszName, sensor._uBtyVoltage);
         }
     }
 }
@@ -442,59 +872,43 @@ void animate()
 }
 
 
-/// check supply voltage for power outs, etc.
+/// start sampling the analog inputs (the results are cached when the sweep completes)
+void sampleAnalogInputs()
+{
+    gAdc.startSweep();
+}
+
+
+/// send pending LCD output (a few bytes per call)
+void updateLcd()
+{
+    gLcd->update();
+}
+
+
+/// returns true if the LCD has output pending
+bool lcdHasOutput()
+{
+    return gLcd->busy();
+}
+
+
+/// check supply voltage for power outs, etc. (runs every 100ms)
 void checkSupplyVoltage()
 {
-    static unsigned long        gVinWaitTime = 0;
+    // smoothed Vin (1/1024 per update) compared to its slowly decaying peak while the supply is on, and to its
+    // minimum while it is off
+    static EmaFilter<10>            gVinAve;
+    static TrackingComparator<10>   gVinState(VIN_FALL_MV, VIN_RISE_MV);
     
-    if (millis() > gVinWaitTime)
+    if (gVinState.update(gVinAve.update(inputVoltage())) == true)
     {
-        static bool    gVinHigh = true;
-        static float   gVinRef = inputVoltage();
-        float          fVinAve = aveInputVoltage();
-        
-        Serial.print(fVinAve);
-        Serial.print(" ");
-        Serial.println(gVinRef);
-        
-        if (gVinHigh == true)
-        {
-            // set ref at max Vin, but also slowly recover from peaks
-            gVinRef = max(gVinRef, fVinAve) * 0.999 + fVinAve * 0.001;
-            
-            // check if Vin is falling
-            if (gVinRef - fVinAve > 0.05)
-            {
-                gVinHigh = false;
-                gVinRef = fVinAve;
-                
-                gLcd->writeLine("Power supply is off");
-                if (gPowerFailureSmsOn == true)
-                {
-                    gGprs->pushTxMessageTxt(gszPhoneNo, "Power supply is off");
-                }
-            }
-        }
-        else
+        const char *pszText = (gVinState.high() == true) ? "Power supply is on" : "Power supply is off";
+        gLcd->writeLine(pszText);
+        if (gPowerFailureSmsOn == true)
         {
-            // set ref at mimimum Vin
-            gVinRef = min(gVinRef, fVinAve);
-            
-            // check if Vin is rising
-            if (fVinAve - gVinRef > 0.1)
-            {
-                gVinHigh = true;
-                gVinRef = fVinAve;
-                
-                gLcd->writeLine("Power supply is on");                
-                if (gPowerFailureSmsOn == true)
-                {
-                    gGprs->pushTxMessageTxt(gszPhoneNo, "Power supply is on");
-                }
-            }
+            gAlerts->push(gszPhoneNo, ESP_POWER, "%s", pszText);
         }
-        
-        gVinWaitTime = millis() + 100;
     }
 }
 
@@ -506,8 +920,9 @@ void setup()
     // NOTE: always resets module, just in-case something went wrong with it
     // NOTE: has to be done right after power on
     LCD_SERIAL.begin(9600);
-    gLcd = new LcdScreen(LCD_SERIAL, 48, 32);
     gLcd->reset();
+    gLcd->addView(lcdSensorView);
+    gLcd->addView(lcdStatusView);
     
     // startup/programming delay before pins and interrupts are changed
     waitAndFlash(4000, 500, DEVICE_STATUS_LED_PIN);
@@ -516,8 +931,14 @@ void setup()
     for (unsigned char i = 2; i <= 13; i++) {pinMode(i, INPUT_PULLUP);}
     for (unsigned char i = 20; i <= 53; i++) {pinMode(i, INPUT_PULLUP);}
     
+    // sample analog inputs by interrupt
+    gAdc.addChannel(VIN_PIN, VIN_OVERSAMPLING);
+    gAdc.addChannel(LEFTRIGHT_PIN);
+    gAdc.addChannel(UPDOWN_PIN);
+    gAdc.begin();
+    
     // setup LCD module
-    gLcdAnimator = new LcdAnimator(*gLcd, UPDOWN_PIN, LEFTRIGHT_PIN);
+    gLcdAnimator = new LcdAnimator(*gLcd, UPDOWN_PIN, LEFTRIGHT_PIN, readJoystick);
     gLcdAnimator->setBlink(true);
     
     // setup alarm output pin
@@ -538,24 +959,37 @@ void setup()
     // setup radio module
     RADIO_SERIAL.begin(RADIO_BAUD);
     gRadio = new FioXBee(RADIO_SERIAL, RADIO_BAUD, -1);
+    gRadio->setApiMode(true);
+    gRadioFrames = new DeviceFrameReader(RADIO_SERIAL);
+    gRadioApi = new XBeeApi(RADIO_SERIAL);
     
     // setup GPRS module
     GPRS_SERIAL.begin(19200);
-    gGprs = new GprsSms(GPRS_SERIAL, GPRS_POWER_PIN);
+    gGprs = new GprsSms(GPRS_SERIAL, GPRS_POWER_PIN, gSmsOutbox);
+    gSmsJournal.begin();
+    gGprs->setJournal(&gSmsJournal);
+    gAlerts = new BaseSmsAlerts(*gGprs, ALERT_WINDOW_MS, ALERT_BUCKET_SIZE, ALERT_REFILL_MS);
     
     // write startup messages to LCD
     gLcdAnimator->setBackLightOn(millis() + 20000);        
     gLcd->writeLine("startup..");
         
-    gLcd->writeLine("- input voltage: %u", (unsigned short)(inputVoltage()*100 + 0.5f));
+    gLcd->writeLine("- input voltage: %u", (inputVoltage() + 5) / 10);
     gLcd->writeLine("- LCD size: %dx%d", gLcd->width(), gLcd->height());
     gLcd->writeLine("- radio data queue size: %d", (int)gDeviceDataQueue.size());
       
-    // program radio device
+    // program radio device (quick API mode setup if the radio is already in API mode, otherwise switch it to API mode)
     gLcd->writeLine("radio start..");
-    if (gRadio->program(RADIO_PAN_ID) == false)
+    gLcd->flush();
+    gRadioApiMode = gRadio->programApi(*gRadioApi, RADIO_PAN_ID);
+    if (gRadioApiMode == true)
+    {
+        gLcd->writeLine("radio OK (API)");
+    }
+    else if (gRadio->program(RADIO_PAN_ID) == false)
     {
         gLcd->writeLine("radio failed, retrying with default baud..");
+        gLcd->flush();
         waitAndFlash(1000, 200, DEVICE_STATUS_LED_PIN);
         
         // retry with default radio baud rate if programming failed
@@ -567,6 +1001,7 @@ void setup()
         else
         {
             gLcd->writeLine("radio OK");
+            gRadioApiMode = true;
         }
         
         // reset baud rate
@@ -575,16 +1010,20 @@ void setup()
     else
     {
         gLcd->writeLine("radio OK");
+        gRadioApiMode = true;
     }
         
     // setup GPRS shield
     gLcd->writeLine("GPRS start..");
+    gLcd->flush();
     gGprs->powerUp();
     gGprs->deleteAllReadMessages();
     gGprs->deleteAllSentMessages();
     gGprs->checkProvider();
+    gGprs->waitForCommands(60000);
     gLcd->writeLine(gGprs->providerText());
     gLcd->writeLine("GPRS OK");
+    gLcd->writeLine("- unsent alerts: %u", (unsigned int)gGprs->replayJournal());
     gLcd->writeLine("phone no: %s", gszPhoneNo);
     
     // read phone no from EEPROM
@@ -603,14 +1042,19 @@ void setup()
         strncpy(gszPhoneNo, PHONE_NO_DEFAULT, sizeof(gszPhoneNo)-1);
     }
     
-    // add base station tasks
-    gTaskManager.addTask(readFromRadio, TaskManager::ETP_HIGH);
-    gTaskManager.addTask(processSensorUpdates, TaskManager::ETP_NORMAL);
-    gTaskManager.addTask(readGprsQuick, TaskManager::ETP_NORMAL);
-    gTaskManager.addTask(animate, TaskManager::ETP_LOW);
-    gTaskManager.addTask(processGprsEvents, TaskManager::ETP_LOW);
-    gTaskManager.addTask(checkSupplyVoltage, TaskManager::ETP_LOW);
-    gTaskManager.addTask(checkSensorStatus, TaskManager::ETP_LOW);
+    // add base station tasks (period [ms] and/or ready check; the MCU idles when nothing is due)
+    gTaskManager.addTask(readFromRadio, BaseTaskManager::ETP_HIGH, 20, radioHasData, "radio");
+    gTaskManager.addTask(processSensorUpdates, BaseTaskManager::ETP_NORMAL, 0, sensorUpdatesQueued, "sensor");
+    gTaskManager.addTask(readGprsQuick, BaseTaskManager::ETP_NORMAL, 10, gprsHasData, "gprs");
+    gTaskManager.addTask(sampleAnalogInputs, BaseTaskManager::ETP_LOW, ADC_SWEEP_MS, NULL, "adc");
+    gTaskManager.addTask(animate, BaseTaskManager::ETP_LOW, 50, NULL, "anim");
+    gTaskManager.addTask(updateLcd, BaseTaskManager::ETP_LOW, 0, lcdHasOutput, "lcd");
+    gTaskManager.addTask(processGprsEvents, BaseTaskManager::ETP_LOW, 0, gprsHasEvents, "sms");
+    gTaskManager.addTask(sendAlerts, BaseTaskManager::ETP_LOW, 100, NULL, "alerts");
+    gTaskManager.addTask(checkSupplyVoltage, BaseTaskManager::ETP_LOW, 100, NULL, "vin");
+    gTaskManager.addTask(checkSensorStatus, BaseTaskManager::ETP_LOW, 1000, NULL, "status");
+    gTaskManager.addTask(dumpStats, BaseTaskManager::ETP_LOW, STATS_DUMP_INTERVAL_MS, NULL, "stats");
+    gTaskManager.setIdleSleep(true);
             
     // check available RAM    
     gLcd->writeLine("free ram: %d", freeRam());